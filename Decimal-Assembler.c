@@ -17,239 +17,1028 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* Assembler declarations */
 #define NREG 10
 #define MEMLEN 100
 
-/* CPU & Memory State */
-/* One day I will refactor the global
- * variables below and package them
- * into a struct that I will pass
- * around in functions... but today
- * is not that day */
-int pc;
-int ir;
-int running;     /* Is the CPU running? (1 yes, 0 no) */
-int reg[NREG];   /* CPU registers */
-int mem[MEMLEN]; /* memory */
+/* Why a machine stopped */
+#define HALT_NONE 0  /* still running */
+#define HALT_INSTR 1 /* ran a HALT */
+#define HALT_PC 2    /* program counter out of range */
+#define HALT_LOOP 3  /* came back to a state it was in before */
+
+/* Backward jumps from one loop_check to the next (a power of two) */
+#define LOOP_CHECK_EVERY 16
+
+/* Hash of word value at location i; the memory hash is their sum, so
+ * a store updates it by swapping one term for another */
+#define WORD_HASH(i, value) \
+  (((unsigned long) (unsigned int) (value) * 0x9E3779B97F4A7C15UL + (i)) \
+   * 0xBF58476D1CE4E5B9UL)
+
+/* Performance counters, kept on every run */
+typedef struct {
+  unsigned long ops[10];    /* instructions retired per opcode */
+  unsigned long taken;      /* conditional branches that branched */
+  unsigned long loads;      /* instructions reading memory */
+  unsigned long stores;     /* instructions writing memory */
+  unsigned long io[10];     /* I/O subroutine calls per number */
+  double seconds;           /* host time spent running them */
+} Stats;
+
+/* CPU & Memory State: everything about one SDC machine is in here
+ * and passed around, so any number of them can run at once */
+typedef struct {
+  int pc;
+  int ir;
+  int running;     /* Is the CPU running? (1 yes, 0 no) */
+  int halt_reason; /* HALT_* */
+  int reg[NREG];   /* CPU registers */
+  int mem[MEMLEN]; /* memory */
+  int trace;       /* print each instruction as it runs? */
+  FILE *in;        /* GETC reads from here (NULL: nothing to read) */
+  FILE *out;       /* the program's output and trace go here */
+  long max_cycles; /* r and --run stop after this many instructions */
+  Stats stats;
+
+  /* Infinite loop detection: the state is saved at the 16th, 32nd,
+   * 64th... backward jump and every 16th backward jump in between
+   * compares itself with it (Brent's algorithm), so a program stuck in
+   * a loop that changes nothing is stopped within 32 times the loop's
+   * length, at the cost of a counter in the jumps */
+  unsigned long mem_hash;     /* sum of WORD_HASH over memory */
+  unsigned long jumps;        /* backward jumps taken */
+  unsigned long next_save;    /* save the state at this many jumps */
+  unsigned long saved_hash;   /* mem_hash then */
+  int saved_pc;
+  unsigned long saved_reads;  /* GETC calls made then */
+  int saved_reg[NREG];
+  int saved_mem[MEMLEN];
+} Machine;
+
+/* Largest word; the opcode is its first digit, the register the
+ * second and the address the last two */
+#define MAX_WORD 9999
+
+/* One instruction word, decoded (see decode_table) */
+typedef struct decoded Decoded;
+typedef void (*Handler)(Machine *m, const Decoded *d);
+
+struct decoded {
+  Handler handler;      /* *_instr function for the opcode */
+  unsigned int opcode;  /* first digit */
+  unsigned char reg;    /* R, second digit */
+  unsigned char addr;   /* MM, last two digits */
+  signed char sign;     /* of the word: -1 or 1 */
+  unsigned int ir;      /* the word without its sign */
+};
+
+/* Every word from -MAX_WORD to MAX_WORD, decoded, at word + MAX_WORD */
+Decoded decode_table[2 * MAX_WORD + 1];
+
+/* Batch mode (--batch) */
+typedef struct {
+  char *program;       /* program image */
+  char *input;         /* what GETC reads, NULL for nothing */
+  char *result;        /* result line, filled in by the worker */
+  int passed;          /* did it stop on a HALT? */
+} BatchJob;
+
+typedef struct {
+  BatchJob *jobs;
+  int njobs;
+  int next;            /* next job to hand out */
+  pthread_mutex_t lock;
+  long budget;         /* instructions per job */
+} Batch;
+
+/* Assembler (--assemble) */
+#define MAX_LABELS MEMLEN
+
+/* Operands a mnemonic takes */
+enum {
+  ARGS_NONE,        /* HALT, GETC, ... */
+  ARGS_REG,         /* NEG R1 */
+  ARGS_REG_ADDR,    /* LD R1, label or MM */
+  ARGS_REG_IMM,     /* LDI R1, -99..99 */
+  ARGS_ADDR,        /* JMP label or MM */
+  ARGS_WORD,        /* .WORD -9999..9999 or label */
+  ARGS_BLOCK,       /* .BLOCK count */
+  ARGS_STRING       /* .STRING "text" */
+};
+
+typedef struct {
+  const char *name;
+  int word;         /* opcode and fixed register digit */
+  int sign;         /* of the word, BR- is the only negative one */
+  int operands;
+} Mnemonic;
 
 /* Function Prototypes */
 
 /* Initizialization */
-FILE *get_datafile(int argc, char *argv[]);
-void initialize_control_unit(int reg[], int nreg);
-void initialize_memory(int argc, char *argv[], int mem[], int memlen);
+FILE *get_datafile(int argc, char *argv[], char **datafile_name);
+void machine_init(Machine *m);
+void initialize_control_unit(Machine *m);
+void initialize_memory(int argc, char *argv[], Machine *m);
+char *map_datafile(FILE *datafile, size_t *len, int *mapped);
+void unmap_datafile(char *text, size_t len, int mapped);
+int load_image(const char *text, size_t len, const char *name,
+               int mem[], int memlen);
+int assemble(const char *text, size_t len, const char *name,
+             int mem[], int memlen);
+int assemble_file(char *source_name, char *image_name);
 
 /* Dumping info (program + debug) */
-void dump_control_unit(int pc, int ir, int running, int reg[], int nreg);
-void dump_memory(int mem[], int memlen);
-void dump_registers(int reg[], int nreg);
+void dump_control_unit(Machine *m);
+void dump_memory(Machine *m);
+void dump_registers(Machine *m);
 void help_message(void);
+void stats_report(Machine *m);
 
 /* Manipulate CPU */
-int read_execute_command(int reg[], int nreg, int mem[], int memlen);
-int execute_command(char cmd_char, int reg[], int nreg, int mem[], int memlen);
-void one_instruction_cycle(int reg[], int nreg, int mem[], int memlen);
-void many_instruction_cycles(int nbr_cycles, int reg[], int nreg, int mem[], int memlen);
-void exec_HLT();
+void command_loop(Machine *m, FILE *in, int interactive);
+int step_count(const char *line, int *nbr_cycles);
+int execute_command(char cmd_char, Machine *m);
+void one_instruction_cycle(Machine *m);
+void many_instruction_cycles(Machine *m, int nbr_cycles);
+long run(Machine *m, long budget);
+void exec_HLT(Machine *m, int reason);
+void loop_check(Machine *m);
+
+/* Decoding and executing instructions */
+void init_decode_table(void);
+void decode_word(int word, Decoded *d);
+void halt_instr(Machine *m, const Decoded *d);
+void load_instr(Machine *m, const Decoded *d);
+void store_instr(Machine *m, const Decoded *d);
+void add_instr(Machine *m, const Decoded *d);
+void neg_instr(Machine *m, const Decoded *d);
+void ldi_instr(Machine *m, const Decoded *d);
+void addi_instr(Machine *m, const Decoded *d);
+void jump_instr(Machine *m, const Decoded *d);
+void branch_instr(Machine *m, const Decoded *d);
+void io_instr(Machine *m, const Decoded *d);
+void bad_instr(Machine *m, const Decoded *d);
+
+/* Batch mode */
+int batch_run(int argc, char *argv[]);
+int batch_read_manifest(Batch *batch, char *manifest_name);
+int split_fields(char *line, char **field, int max);
+void *batch_worker(void *arg);
+void batch_run_job(Machine *m, BatchJob *job, int number, long budget);
 
 
 int main(int argc, char *argv[])
 {
+  static Machine machine;
+  Machine *m = &machine;
+  int headless = 0;
+  char *script_name = NULL;
+  long max_cycles = LONG_MAX;
+
   printf("SDC Simulator\n");
+  init_decode_table();
+
+  /* --assemble FILE [-o IMAGE]: write the decimal image and stop */
+  if (argc > 1 && strcmp(argv[1], "--assemble") == 0) {
+    if (argc == 3)
+      return assemble_file(argv[2], NULL);
+    if (argc == 5 && strcmp(argv[3], "-o") == 0)
+      return assemble_file(argv[2], argv[4]);
+    printf("usage: %s --assemble FILE.asm [-o FILE.sdc]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* --batch MANIFEST: many programs at once, one machine each */
+  if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+    return batch_run(argc, argv);
+
+  /* Options before the program, in any order */
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--run") == 0) {
+      /* --run: run until HALT without the command loop or the
+       * instruction trace */
+      headless = 1;
+      argc--;
+      argv++;
+    } else if (argc > 2 && strcmp(argv[1], "--script") == 0) {
+      /* --script FILE: read the commands from FILE, leaving stdin to
+       * the program */
+      script_name = argv[2];
+      argc -= 2;
+      argv += 2;
+    } else if (argc > 2 && strcmp(argv[1], "--max-cycles") == 0 &&
+               (max_cycles = strtol(argv[2], NULL, 10)) > 0) {
+      /* --max-cycles N: --run and r stop after N instructions */
+      argc -= 2;
+      argv += 2;
+    } else {
+      printf("usage: %s [--run] [--script FILE] [--max-cycles N] "
+             "[program.sdc|.asm]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
 
   /* initialize everything */
-  initialize_control_unit(reg, NREG);
-  initialize_memory(argc, argv, mem, MEMLEN);
+  initialize_control_unit(m);
+  initialize_memory(argc, argv, m);
+  m->trace = !headless;
+  m->max_cycles = max_cycles;
+
+  if (headless) {
+    long n = run(m, m->max_cycles);
+
+    if (m->running)
+      printf("\nStopped after %ld instructions (--max-cycles)", n);
+    printf("\n");
+    dump_control_unit(m);
+    printf("\n");
+    stats_report(m);
+    return m->halt_reason == HALT_INSTR ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
-  char *prompt = "> ";
-  printf("\nBeginning execution; type h for help\n%s", prompt);
-  int done = read_execute_command(reg, NREG, mem, MEMLEN);
-  while (!done) {
-    printf("%s", prompt);
-    done = read_execute_command(reg, NREG, mem, MEMLEN);
+  if (script_name != NULL) {
+    FILE *script = fopen(script_name, "r");
+
+    if (script == NULL) {
+      printf("Could not open script %s\n", script_name);
+      return EXIT_FAILURE;
+    }
+    command_loop(m, script, 0);
+    fclose(script);
+  } else {
+    printf("\nBeginning execution; type h for help\n");
+    command_loop(m, stdin, 1);
   }
 
   /* Dump everything when done */
   printf("Termination\n");
-  dump_control_unit(pc, ir, running, reg, NREG);
+  dump_control_unit(m);
   printf("\n");
-  dump_memory(mem, MEMLEN);
+  dump_memory(m);
+  stats_report(m);
 
   return 0;
 }
 
-void initialize_control_unit(int reg[], int nreg)
+/* A machine ready to run from location 0, its I/O on the terminal */
+void machine_init(Machine *m)
 {
-  int i;
-  for (i = 0; i < nreg; i++)
-    reg[i] = 0;
+  memset(m, 0, sizeof(Machine));
+  m->running = 1;
+  m->halt_reason = HALT_NONE;
+  m->trace = 1;
+  m->in = stdin;
+  m->out = stdout;
+  m->max_cycles = LONG_MAX;
+  m->next_save = LOOP_CHECK_EVERY;
+}
 
-  pc = 0;
-  running = 1;
-  ir = 0;
+void initialize_control_unit(Machine *m)
+{
+  machine_init(m);
 
   printf("\nInitial control unit:\n");
-  dump_control_unit(pc, ir, running, reg, nreg);
+  dump_control_unit(m);
   printf("\n");
 }
 
-void initialize_memory(int argc, char *argv[], int mem[], int memlen)
+void initialize_memory(int argc, char *argv[], Machine *m)
 {
-  FILE *datafile = get_datafile(argc, argv);
+  char *datafile_name;
+  FILE *datafile = get_datafile(argc, argv, &datafile_name);
+  struct timespec start, end;
+  size_t len;
+  int mapped, words;
+  double secs;
+  char *text, *dot;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  text = map_datafile(datafile, &len, &mapped);
+  if (text == NULL) {
+    printf("Failed to read: %s\n", datafile_name);
+    exit(EXIT_FAILURE);
+  }
 
-  int value_read, words_read, loc = 0, done = 0;
+  /* Source is assembled on the way in */
+  dot = strrchr(datafile_name, '.');
+  if (dot != NULL && strcmp(dot, ".asm") == 0)
+    words = assemble(text, len, datafile_name, m->mem, MEMLEN);
+  else
+    words = load_image(text, len, datafile_name, m->mem, MEMLEN);
+  unmap_datafile(text, len, mapped);
+  fclose(datafile);
+  if (words < 0)
+    exit(EXIT_FAILURE);
 
-  char *buffer = NULL;
-  size_t buffer_len = 0, bytes_read = 0;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Loaded %d words (%lu bytes) in %.3f ms, %.1f MB/s\n",
+         words, (unsigned long) len, secs * 1e3,
+         secs > 0 ? len / secs / 1e6 : 0.0);
 
+  dump_memory(m);
+}
+
+/* Get the whole data file in memory: mmap it if we can, otherwise
+ * (pipes, empty files) read it into a malloc'd buffer */
+char *map_datafile(FILE *datafile, size_t *len, int *mapped)
+{
+  struct stat st;
+  char *text = NULL;
+  size_t size = 0, cap = 0, n;
+
+  if (fstat(fileno(datafile), &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                fileno(datafile), 0);
+    if (text != MAP_FAILED) {
+      *len = st.st_size;
+      *mapped = 1;
+      return text;
+    }
+    text = NULL;
+  }
 
-  /* Fetch first instruction */
-  bytes_read = getline(&buffer, &buffer_len, datafile);
-  while (bytes_read != -1 && !done) {
+  *mapped = 0;
+  do {
+    if (size == cap) {
+      char *bigger = realloc(text, cap = cap ? 2 * cap : 4096);
+      if (bigger == NULL) {
+        free(text);
+        return NULL;
+      }
+      text = bigger;
+    }
+    n = fread(text + size, 1, cap - size, datafile);
+    size += n;
+  } while (n > 0);
 
-    words_read = sscanf(buffer, "%d", &value_read);
+  *len = size;
+  return text;
+}
 
-    /* If beginning was not an integer (junk) discard it and go on
-     * else populate memory location and advance to the next one.
-     * Always check that you have not hit the memory bound */
-    if (words_read == 0 || words_read == -1) {
-      bytes_read = getline(&buffer, &buffer_len, datafile);
-      continue;
+void unmap_datafile(char *text, size_t len, int mapped)
+{
+  if (mapped)
+    munmap(text, len);
+  else
+    free(text);
+}
+
+/* Four decimal digits at p (already checked) to their value in
+ * two steps: pairs of digits first, then the two pairs */
+static int dec4(const unsigned char *p)
+{
+  unsigned int v = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+
+  v -= 0x30303030;
+  v = (v * 10 + (v >> 8)) & 0x00FF00FF;
+  v = (v * 100 + (v >> 16)) & 0xFFFF;
+  return v;
+}
+
+#define IS_DIGIT(c) ((unsigned) ((c) - '0') < 10)
+
+/* Parse a decimal image: one signed word per line, loaded from
+ * location 0. Blank lines and anything after ';' or '#' are ignored,
+ * and a value outside -9999..9999 is a sentinel that ends the program.
+ * Zeroes the rest of memory. Returns the number of words loaded, or
+ * -1 after printing name:line: what's wrong */
+int load_image(const char *text, size_t len, const char *name,
+               int mem[], int memlen)
+{
+  const unsigned char *p = (const unsigned char *) text;
+  const unsigned char *end = p + len;
+  int line = 1, loc = 0;
+
+  while (p < end) {
+    const unsigned char *number;
+    int value, sign = 1;
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+
+    /* Blank or comment-only line */
+    if (p == end || *p == '\n' || *p == ';' || *p == '#')
+      goto next_line;
+
+    number = p;
+    if (*p == '-' || *p == '+') {
+      if (*p == '-')
+        sign = -1;
+      p++;
+    }
+    if (p == end || !IS_DIGIT(*p)) {
+      printf("%s:%d: error: expected a decimal word, found '%.*s'\n",
+             name, line, (int) (p < end ? p - number + 1 : p - number),
+             (const char *) number);
+      return -1;
     }
 
-    if (loc > memlen) {
-      printf("The memory location is out of range");
-      done = 1;
-    } else if (value_read > 9999 || value_read < -9999) {
-      printf("Hit sentinel, quitting loop");
-      done = 1;
+    if (end - p >= 4 && IS_DIGIT(p[0]) && IS_DIGIT(p[1]) &&
+        IS_DIGIT(p[2]) && IS_DIGIT(p[3])) {
+      value = dec4(p);
+      p += 4;
     } else {
-      mem[loc++] = value_read;
-      bytes_read = getline(&buffer, &buffer_len, datafile);
+      value = 0;
+    }
+    for (; p < end && IS_DIGIT(*p); p++)
+      if (value <= 9999)
+        value = value * 10 + (*p - '0');
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      p++;
+    if (p < end && *p != '\n' && *p != ';' && *p != '#') {
+      printf("%s:%d: error: unexpected '%c' after a word\n",
+             name, line, *p);
+      return -1;
+    }
+
+    if (value > 9999) {
+      printf("Hit sentinel, quitting loop\n");
+      break;
     }
+    if (loc == memlen) {
+      printf("%s:%d: error: program does not fit in %d words of memory\n",
+             name, line, memlen);
+      return -1;
+    }
+    mem[loc++] = sign * value;
+
+  next_line:
+    p = memchr(p, '\n', end - p);
+    if (p == NULL)
+      break;
+    p++;
+    line++;
   }
 
-  /* buffer is not needed anymore */
-  free(buffer);
+  /* zero-out the rest of the memory locations in one go */
+  memset(mem + loc, 0, (memlen - loc) * sizeof(int));
+
+  return loc;
+}
+
+/* Assembler (--assemble): SDC mnemonics to decimal words, in a single
+ * pass over the source. A label used before it is defined is left as
+ * 0 in the word and the word is chained onto the label (through
+ * fixup[]); defining the label then walks the chain and adds its
+ * address into each word */
+static Mnemonic mnemonics[] = {
+  { "HALT",  0,    1, ARGS_NONE },
+  { "LD",    1000, 1, ARGS_REG_ADDR },
+  { "ST",    2000, 1, ARGS_REG_ADDR },
+  { "ADD",   3000, 1, ARGS_REG_ADDR },
+  { "NEG",   4000, 1, ARGS_REG },
+  { "LDI",   5000, 1, ARGS_REG_IMM },
+  { "ADDI",  6000, 1, ARGS_REG_IMM },
+  { "JMP",   7000, 1, ARGS_ADDR },
+  { "BR+",   8000, 1, ARGS_REG_ADDR },
+  { "BR-",   8000, -1, ARGS_REG_ADDR },
+  { "GETC",  9000, 1, ARGS_NONE },
+  { "PUTC",  9100, 1, ARGS_NONE },
+  { "PUTS",  9200, 1, ARGS_ADDR },
+  { "DUMPCU", 9300, 1, ARGS_NONE },
+  { "DUMPMEM", 9400, 1, ARGS_NONE },
+  { ".WORD", 0,    1, ARGS_WORD },
+  { ".BLOCK", 0,   1, ARGS_BLOCK },
+  { ".STRING", 0,  1, ARGS_STRING }
+};
+
+#define NMNEMONICS (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+typedef struct {
+  const char *name;   /* in the source, not terminated */
+  int len;
+  int address;        /* -1 until defined */
+  int fixups;         /* first word waiting for it, -1 for none */
+  int line;           /* where it was defined or first used */
+} Label;
+
+/* Everything one assembly needs */
+typedef struct {
+  const char *name;   /* of the source, for errors */
+  Label labels[MAX_LABELS];
+  int nlabels;
+  int fixup[MEMLEN];  /* next word waiting for the same label, or -1 */
+  int sign[MEMLEN];   /* sign of each word, applied once it's complete */
+  int errors;
+} Assembly;
+
+void asm_error(Assembly *as, int line, const char *fmt, ...)
+{
+  va_list args;
+
+  printf("%s:%d: error: ", as->name, line);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+  as->errors++;
+}
+
+/* The label called name, added (undefined) if it's new */
+Label *find_label(Assembly *as, const char *name, int len, int line)
+{
+  int i;
+
+  for (i = 0; i < as->nlabels; i++)
+    if (as->labels[i].len == len &&
+        memcmp(as->labels[i].name, name, len) == 0)
+      return &as->labels[i];
+
+  if (as->nlabels == MAX_LABELS) {
+    asm_error(as, line, "more than %d labels", MAX_LABELS);
+    return NULL;
+  }
+  as->labels[i].name = name;
+  as->labels[i].len = len;
+  as->labels[i].address = -1;
+  as->labels[i].fixups = -1;
+  as->labels[i].line = line;
+  as->nlabels++;
+  return &as->labels[i];
+}
+
+#define IS_SEPARATOR(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == ',')
+#define IS_LINE_END(c) ((c) == '\n' || (c) == ';' || (c) == '#')
+
+/* Next word of the line at *pp, NULL at the end of the line */
+const char *next_word(const char **pp, const char *end, int *len)
+{
+  const char *p = *pp, *word;
+
+  while (p < end && IS_SEPARATOR(*p))
+    p++;
+  if (p == end || IS_LINE_END(*p)) {
+    *pp = p;
+    return NULL;
+  }
+
+  word = p;
+  if (*p == '"') {
+    for (p++; p < end && *p != '"' && *p != '\n'; p++)
+      ;
+    if (p < end && *p == '"')
+      p++;
+  } else {
+    while (p < end && !IS_SEPARATOR(*p) && !IS_LINE_END(*p))
+      p++;
+  }
+
+  *len = p - word;
+  *pp = p;
+  return word;
+}
+
+Mnemonic *find_mnemonic(const char *word, int len)
+{
+  size_t i;
+
+  for (i = 0; i < NMNEMONICS; i++)
+    if ((int) strlen(mnemonics[i].name) == len &&
+        strncasecmp(mnemonics[i].name, word, len) == 0)
+      return &mnemonics[i];
+  return NULL;
+}
+
+/* A decimal number with an optional sign, all of word */
+int parse_decimal(const char *word, int len, int *value)
+{
+  int i = 0, v = 0, neg = 0;
 
-  /* zero-out the rest of the memory locations */
-  while (loc < memlen) {
-    mem[loc] = 0;
+  if (len > 0 && (word[0] == '-' || word[0] == '+')) {
+    neg = word[0] == '-';
+    i++;
+  }
+  if (i == len)
+    return 0;
+  for (; i < len; i++) {
+    if (!IS_DIGIT(word[i]))
+      return 0;
+    if (v < 100000)
+      v = v * 10 + word[i] - '0';
+  }
+
+  *value = neg ? -v : v;
+  return 1;
+}
+
+/* Register operand: R0-R9 */
+int asm_register(Assembly *as, int line, const char *word, int len)
+{
+  if (word == NULL || len != 2 || (word[0] != 'R' && word[0] != 'r') ||
+      !IS_DIGIT(word[1])) {
+    asm_error(as, line, "expected a register, found '%.*s'",
+              word ? len : 0, word ? word : "");
+    return 0;
+  }
+  return word[1] - '0';
+}
+
+/* Address operand of the word at loc: a number, or a label whose
+ * address is added in now or once it is defined */
+int asm_address(Assembly *as, int line, const char *word, int len, int loc)
+{
+  Label *label;
+  int value;
+
+  if (word == NULL) {
+    asm_error(as, line, "missing address");
+    return 0;
+  }
+  if (parse_decimal(word, len, &value)) {
+    if (value < 0 || value >= MEMLEN)
+      asm_error(as, line, "address %d is out of range", value);
+    return value;
+  }
+
+  label = find_label(as, word, len, line);
+  if (label == NULL)
+    return 0;
+  if (label->address >= 0)
+    return label->address;
+
+  /* Not known yet: chain this word on the label */
+  as->fixup[loc] = label->fixups;
+  label->fixups = loc;
+  return 0;
+}
+
+/* Assemble SDC source into mem, zeroing the rest. Returns the number
+ * of words, or -1 after printing name:line: what's wrong */
+int assemble(const char *text, size_t len, const char *name,
+             int mem[], int memlen)
+{
+  Assembly assembly;
+  Assembly *as = &assembly;
+  const char *p = text, *end = text + len;
+  int line = 1, loc = 0, i;
+
+  memset(as, 0, sizeof(Assembly));
+  as->name = name;
+
+  while (p < end) {
+    const char *word;
+    Mnemonic *mn;
+    int wlen = 0, r = 0, addr = 0, sign;
+
+    word = next_word(&p, end, &wlen);
+    if (word == NULL)
+      goto next_line;
+
+    mn = find_mnemonic(word, wlen);
+    if (mn == NULL) {
+      /* A label: resolve everything that was waiting for it */
+      Label *label = find_label(as, word, wlen, line);
+
+      if (label != NULL && label->address >= 0) {
+        asm_error(as, line, "'%.*s' already defined on line %d",
+                  wlen, word, label->line);
+      } else if (label != NULL) {
+        int at = label->fixups;
+
+        label->address = loc;
+        label->line = line;
+        while (at >= 0) {
+          int next = as->fixup[at];
+          mem[at] += loc;
+          at = next;
+        }
+        label->fixups = -1;
+      }
+
+      word = next_word(&p, end, &wlen);
+      if (word == NULL)
+        goto next_line;
+      mn = find_mnemonic(word, wlen);
+      if (mn == NULL) {
+        asm_error(as, line, "unknown instruction '%.*s'", wlen, word);
+        goto next_line;
+      }
+    }
+
+    if (mn->operands == ARGS_BLOCK || mn->operands == ARGS_STRING) {
+      int n = 0;
+
+      word = next_word(&p, end, &wlen);
+      if (mn->operands == ARGS_BLOCK &&
+          (word == NULL || !parse_decimal(word, wlen, &n) || n < 0)) {
+        asm_error(as, line, ".BLOCK needs a count");
+        goto next_line;
+      }
+      if (mn->operands == ARGS_STRING &&
+          (word == NULL || wlen < 2 || word[0] != '"' ||
+           word[wlen - 1] != '"')) {
+        asm_error(as, line, ".STRING needs a quoted string");
+        goto next_line;
+      }
+      if (mn->operands == ARGS_STRING)
+        n = wlen - 1;           /* the characters and a 0 */
+      if (loc + n > memlen) {
+        asm_error(as, line, "program does not fit in %d words of memory",
+                  memlen);
+        break;
+      }
+      for (i = 0; i < n; i++) {
+        mem[loc + i] = mn->operands == ARGS_STRING && i < n - 1
+                     ? (unsigned char) word[i + 1] : 0;
+        as->sign[loc + i] = 1;
+        as->fixup[loc + i] = -1;
+      }
+      loc += n;
+      goto check_end;
+    }
+
+    if (loc == memlen) {
+      asm_error(as, line, "program does not fit in %d words of memory",
+                memlen);
+      break;
+    }
+    as->fixup[loc] = -1;
+    sign = mn->sign;
+
+    switch (mn->operands) {
+    case ARGS_REG:
+      word = next_word(&p, end, &wlen);
+      r = asm_register(as, line, word, wlen);
+      break;
+    case ARGS_REG_ADDR:
+      word = next_word(&p, end, &wlen);
+      r = asm_register(as, line, word, wlen);
+      word = next_word(&p, end, &wlen);
+      addr = asm_address(as, line, word, wlen, loc);
+      break;
+    case ARGS_REG_IMM:
+      word = next_word(&p, end, &wlen);
+      r = asm_register(as, line, word, wlen);
+      word = next_word(&p, end, &wlen);
+      if (word == NULL || !parse_decimal(word, wlen, &addr) ||
+          addr < -99 || addr > 99) {
+        asm_error(as, line, "%s needs a value from -99 to 99", mn->name);
+        addr = 0;
+      }
+      if (addr < 0) {
+        sign = -1;
+        addr = -addr;
+      }
+      break;
+    case ARGS_ADDR:
+      word = next_word(&p, end, &wlen);
+      addr = asm_address(as, line, word, wlen, loc);
+      break;
+    case ARGS_WORD:
+      word = next_word(&p, end, &wlen);
+      if (word != NULL && parse_decimal(word, wlen, &addr)) {
+        if (addr < -9999 || addr > 9999)
+          asm_error(as, line, ".WORD %d does not fit in a word", addr);
+        if (addr < 0) {
+          sign = -1;
+          addr = -addr;
+        }
+      } else {
+        addr = asm_address(as, line, word, wlen, loc);
+      }
+      break;
+    }
+
+    /* The sign goes on last, so backpatching only ever adds */
+    mem[loc] = mn->word + r * 100 + addr;
+    as->sign[loc] = sign;
     loc++;
+
+  check_end:
+    if (next_word(&p, end, &wlen) != NULL)
+      asm_error(as, line, "too many operands for %s", mn->name);
+
+  next_line:
+    p = memchr(p, '\n', end - p);
+    if (p == NULL)
+      break;
+    p++;
+    line++;
   }
 
-  dump_memory(mem, memlen);
+  for (i = 0; i < as->nlabels; i++)
+    if (as->labels[i].address < 0)
+      asm_error(as, as->labels[i].line, "undefined label '%.*s'",
+                as->labels[i].len, as->labels[i].name);
+  if (as->errors)
+    return -1;
+
+  for (i = 0; i < loc; i++)
+    mem[i] *= as->sign[i];
+  memset(mem + loc, 0, (memlen - loc) * sizeof(int));
+
+  return loc;
 }
 
-FILE *get_datafile(int argc, char *argv[])
+/* --assemble: write the decimal image of a source file, one word per
+ * line. Returns the process exit status */
+int assemble_file(char *source_name, char *image_name)
 {
-  char *datafile_name;
+  FILE *source = fopen(source_name, "r"), *image;
+  char *text, *default_name = NULL;
+  size_t len;
+  int mem[MEMLEN], mapped, words, i;
+
+  if (source == NULL) {
+    printf("Failed to open: %s\n", source_name);
+    return EXIT_FAILURE;
+  }
+  text = map_datafile(source, &len, &mapped);
+  if (text == NULL) {
+    printf("Failed to read: %s\n", source_name);
+    return EXIT_FAILURE;
+  }
+  words = assemble(text, len, source_name, mem, MEMLEN);
+  unmap_datafile(text, len, mapped);
+  fclose(source);
+  if (words < 0)
+    return EXIT_FAILURE;
+
+  /* Default: the source's name with .sdc for its extension */
+  if (image_name == NULL) {
+    char *dot = strrchr(source_name, '.');
+    size_t base = dot ? (size_t) (dot - source_name) : strlen(source_name);
+
+    default_name = malloc(base + 5);
+    if (default_name == NULL)
+      return EXIT_FAILURE;
+    memcpy(default_name, source_name, base);
+    strcpy(default_name + base, ".sdc");
+    image_name = default_name;
+  }
+
+  image = fopen(image_name, "w");
+  if (image == NULL) {
+    printf("Failed to open: %s\n", image_name);
+    free(default_name);
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < words; i++)
+    fprintf(image, "%d\n", mem[i]);
+  if (fclose(image) != 0) {
+    printf("Failed to write: %s\n", image_name);
+    free(default_name);
+    return EXIT_FAILURE;
+  }
 
+  printf("Assembled %d words into %s\n", words, image_name);
+  free(default_name);
+  return EXIT_SUCCESS;
+}
+
+FILE *get_datafile(int argc, char *argv[], char **datafile_name)
+{
   /* if a datafile is not provided, use the default */
   if (argv[1] != NULL)
-    datafile_name = argv[1];
+    *datafile_name = argv[1];
   else
-    datafile_name = "default.sdc";
+    *datafile_name = "default.sdc";
 
-  FILE *datafile = fopen(datafile_name, "r");
+  FILE *datafile = fopen(*datafile_name, "r");
 
   if (datafile == NULL) {
-    printf("Failed to open: %s\n", datafile_name);
+    printf("Failed to open: %s\n", *datafile_name);
     exit(EXIT_FAILURE);
   }
 
   return datafile;
 }
 
-void dump_control_unit(int pc, int ir, int running,
-                       int reg[], int nreg)
+void dump_control_unit(Machine *m)
 {
-  printf("PC:\t %d \t IR: \t %d Running: \t %d \n", pc, ir, running);
-  dump_registers(reg, nreg);
+  fprintf(m->out, "PC:\t %d \t IR: \t %d Running: \t %d \n",
+          m->pc, m->ir, m->running);
+  dump_registers(m);
 }
 
-void dump_memory(int mem[], int memlen)
+/* Formatted into one buffer and printed in one go, ten words a line */
+void dump_memory(Machine *m)
 {
-  int loc = 0;
+  char buf[(MEMLEN / 10 + 1) * 128], *p = buf;
   int i;
 
-  printf("\n%d: ", loc);
-  for (i = 0; i < memlen; i++) {
-    if (((i) % 10) == 0) {
-      printf("\n%d: ", loc);
-      loc += 10;
-    }
-    printf("\t%4d", mem[i]);
+  for (i = 0; i < MEMLEN; i++) {
+    if (i % 10 == 0)
+      p += sprintf(p, "\n%d: ", i);
+    p += sprintf(p, "\t%4d", m->mem[i]);
   }
-  printf("\n");
+  *p++ = '\n';
+  fwrite(buf, 1, p - buf, m->out);
 }
 
-void dump_registers(int reg[], int nreg)
+void dump_registers(Machine *m)
 {
   int i;
 
-  for (i = 0; i < nreg / 2; i++) {
-    printf("R%d: %d \t", i, reg[i]);
+  for (i = 0; i < NREG / 2; i++) {
+    fprintf(m->out, "R%d: %d \t", i, m->reg[i]);
   }
-  printf("\n");
+  fprintf(m->out, "\n");
 
-  for (i = nreg / 2; i < nreg; i++) {
-    printf("R%d: %d \t", i, reg[i]);
+  for (i = NREG / 2; i < NREG; i++) {
+    fprintf(m->out, "R%d: %d \t", i, m->reg[i]);
   }
 }
 
-int read_execute_command(int reg[], int nreg, int mem[], int memlen)
+/* Read and execute commands from in until q or the end of it. The
+ * line buffer is kept for the whole session. Typed at the prompt each
+ * step command runs on its own; from a script consecutive ones are
+ * added up and run as one */
+void command_loop(Machine *m, FILE *in, int interactive)
 {
-  char *cmd_buffer = NULL;
-  size_t cmd_buffer_len = 0, bytes_read = 0;
+  char *cmd_buffer = NULL, *p;
+  size_t cmd_buffer_len = 0;
+  long steps = 0;
+  int nbr_cycles, is_step, done = 0;
 
-  int nbr_cycles;
-  char cmd_char;
-  size_t words_read;
+  while (!done) {
+    if (interactive)
+      printf("> ");
 
-  int done = 0;
+    /* End of file (Ctrl + D) ends the session like q */
+    if (getline(&cmd_buffer, &cmd_buffer_len, in) < 0)
+      break;
 
-  /* Get user input */
-  bytes_read = getline(&cmd_buffer, &cmd_buffer_len, stdin);
+    is_step = step_count(cmd_buffer, &nbr_cycles);
+    if (is_step == 0)
+      continue;
 
-  /* Did we hit the end of file? */
-  if (bytes_read == -1) {
-    done = 1;
-  }
+    if (is_step == 1 && interactive) {
+      many_instruction_cycles(m, nbr_cycles);
+      continue;
+    }
+    if (is_step == 1) {
+      steps += nbr_cycles;
+      continue;
+    }
 
-  words_read = sscanf(cmd_buffer, "%d", &nbr_cycles);
+    for (; steps > 0; steps -= nbr_cycles) {
+      nbr_cycles = steps > INT_MAX ? INT_MAX : steps;
+      many_instruction_cycles(m, nbr_cycles);
+    }
 
-  /* If a char was read then try to execute the according
-   * command, else if an integer was entered, try to
-   * execute this number of cycles */
-  if (words_read == 0) {
-    sscanf(cmd_buffer, "%c", &cmd_char);
-    done = execute_command(cmd_char, reg, nreg, mem, memlen);
-  } else {
+    for (p = cmd_buffer; *p == ' ' || *p == '\t'; p++)
+      ;
+    done = execute_command(*p, m);
+  }
 
-    /* Check first is the number of cycles is invalid.
-     * If yes then execute one or more instructions */
-    if (nbr_cycles < 1 ||
-        nbr_cycles > memlen ||
-        nbr_cycles > (memlen - pc)) {
-      printf("%d is an invalid number of cycles!!", nbr_cycles);
-    } else if (nbr_cycles == 1) {
-      one_instruction_cycle(reg, nreg, mem, memlen);
-    } else {
-      many_instruction_cycles(nbr_cycles, reg, nreg, mem, memlen);
-    }
+  for (; steps > 0; steps -= nbr_cycles) {
+    nbr_cycles = steps > INT_MAX ? INT_MAX : steps;
+    many_instruction_cycles(m, nbr_cycles);
   }
 
-  /* Command buffer not needed anymore */
   free(cmd_buffer);
+}
+
+/* Is line a step command, a number of cycles or an empty line for
+ * one? Returns 1 with the number in nbr_cycles if so, 0 if the number
+ * is out of range (after saying so) and -1 for any other command */
+int step_count(const char *line, int *nbr_cycles)
+{
+  char *end;
+  long n;
 
-  return done;
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (*line == '\n' || *line == '\r' || *line == '\0') {
+    *nbr_cycles = 1;
+    return 1;
+  }
+  if (!isdigit((unsigned char) *line) && *line != '-' && *line != '+')
+    return -1;
+
+  n = strtol(line, &end, 10);
+  while (isspace((unsigned char) *end))
+    end++;
+  if (end == line || *end != '\0')
+    return -1;
+
+  if (n < 1 || n > INT_MAX) {
+    printf("%ld is an invalid number of cycles!!", n);
+    return 0;
+  }
+  *nbr_cycles = n;
+  return 1;
 }
 
-int execute_command(char cmd_char, int reg[], int nreg,
-                    int mem[], int memlen)
+int execute_command(char cmd_char, Machine *m)
 {
 
   if (cmd_char == '?' || cmd_char == 'h')
@@ -257,8 +1046,8 @@ int execute_command(char cmd_char, int reg[], int nreg,
 
   switch (cmd_char) {
   case 'd':
-    dump_control_unit(pc, ir, running, reg, nreg);
-    dump_memory(mem, memlen);
+    dump_control_unit(m);
+    dump_memory(m);
     return 0;
     break;
 
@@ -266,8 +1055,17 @@ int execute_command(char cmd_char, int reg[], int nreg,
     return 1;
     break;
 
-  case '\n':
-    one_instruction_cycle(reg, nreg, mem, memlen);
+  case 'p':
+    stats_report(m);
+    return 0;
+    break;
+
+  case 'r':
+    if (m->running == 0)
+      printf("The CPU is not running");
+    else if (run(m, m->max_cycles) == m->max_cycles && m->running)
+      printf("Stopped after %ld instructions (--max-cycles)\n",
+             m->max_cycles);
     return 0;
     break;
 
@@ -284,161 +1082,589 @@ void help_message(void)
   printf("Choose from the following menu\n");
   printf("d: dump control unit\n");
   printf("q: quit the program \n");
+  printf("p: show the performance counters\n");
+  printf("r: run until HALT, an infinite loop or --max-cycles\n");
   printf("\'\\n: one instruction \n");
   printf("Type in a number for the number of cycles");
 }
 
-void many_instruction_cycles(int nbr_cycles, int reg[], int nreg,
-                             int mem[], int memlen)
+void many_instruction_cycles(Machine *m, int nbr_cycles)
 {
   if (nbr_cycles <= 0) {
     printf("You have indicated to run an invalid amount(%d) of times",
            nbr_cycles);
     return;
-  } else if (running == 0) {
+  } else if (m->running == 0) {
     printf("The CPU is not running");
     return;
 
   } else {
-    int i;
-    for (i = 0; i < nbr_cycles && running != 0; i++) {
-      one_instruction_cycle(reg, nreg, mem, memlen);
-    }
+    run(m, nbr_cycles);
   }
 }
 
-void one_instruction_cycle(int reg[], int nreg,
-                           int mem[], int memlen)
+/* Run m for up to budget instructions or until it halts, timing it.
+ * Touches nothing outside m, so as many machines as there are threads
+ * can run at once. Returns the number of instructions executed */
+long run(Machine *m, long budget)
 {
-  int reg_R, addr_MM, instr_sign, opcode;
+  struct timespec start, end;
+  long i;
+
+  /* Nothing but ST changes memory while it runs */
+  m->mem_hash = 0;
+  for (i = 0; i < MEMLEN; i++)
+    m->mem_hash += WORD_HASH(i, m->mem[i]);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < budget && m->running != 0; i++) {
+    one_instruction_cycle(m);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  m->stats.seconds += (end.tv_sec - start.tv_sec)
+                    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return i;
+}
+
+/* Print the performance counters */
+void stats_report(Machine *m)
+{
+  Stats *s = &m->stats;
+  static char *names[10] = {
+    "HALT", "LOAD", "STORE", "ADD-MM", "NOT",
+    "LOAD-IM", "ADD-IM", "JUMP", "BRANCH", "I/O"
+  };
+  unsigned long total = 0;
+  int i;
+
+  for (i = 0; i < 10; i++)
+    total += s->ops[i];
+
+  printf("Performance counters:\n");
+  printf("  %lu instructions in %.3f s", total, s->seconds);
+  if (s->seconds > 0)
+    printf(", %.3f MIPS", total / s->seconds / 1e6);
+  printf("\n");
+  if (total == 0)
+    return;
+
+  printf("  branches: %lu taken, %lu not taken\n",
+         s->taken, s->ops[8] - s->taken);
+  printf("  loads: %lu, stores: %lu\n", s->loads, s->stores);
+
+  printf("  per opcode:");
+  for (i = 0; i < 10; i++)
+    if (s->ops[i] != 0)
+      printf(" %s %lu (%.1f%%)", names[i], s->ops[i],
+             100.0 * s->ops[i] / total);
+  printf("\n");
+
+  if (s->ops[9] != 0) {
+    printf("  I/O:");
+    for (i = 0; i < 10; i++)
+      if (s->io[i] != 0)
+        printf(" 9%d %lu", i, s->io[i]);
+    printf("\n");
+  }
+}
+
+void one_instruction_cycle(Machine *m)
+{
+  const Decoded *d;
+  Decoded wide;
+  int word;
 
   /* Check if CPU is running */
-  if (running == 0) {
+  if (m->running == 0) {
     printf("The CPU is not running");
     return;
   }
 
   /* Make sure that we didn't hit any boundaries */
-  if (pc >= memlen) {
-    printf("Program counter out of range");
-    exec_HLT();
+  if (m->pc >= MEMLEN) {
+    fprintf(m->out, "Program counter out of range");
+    exec_HLT(m, HALT_PC);
+    return;
   }
 
-  /* Get instruction and increment PC */
-  int instr_loc = pc;
-  ir = mem[pc++];
-
-  /* Check instruction sign */
-  if (ir < 0) {
-    instr_sign = -1;
-    ir *= -1;
-  } else if (ir > 0) {
-    instr_sign = 1;
+  /* Get instruction and increment PC; every word an instruction
+   * can be is in the table, only a computed value can be outside */
+  int instr_loc = m->pc;
+  word = m->mem[m->pc++];
+  if (word >= -MAX_WORD && word <= MAX_WORD) {
+    d = &decode_table[word + MAX_WORD];
+  } else {
+    decode_word(word, &wide);
+    d = &wide;
   }
+  m->ir = d->ir;
 
-  /* Decode instruction into opcode, register, and memory address */
-  opcode = ir / 1000;
-  reg_R = (ir % 1000) / 100;
-  addr_MM = ir % 100;
+  if (m->trace)
+    fprintf(m->out, "At %02d instr %d %d %02d: ",
+            instr_loc, d->opcode, d->reg, d->addr);
 
-  printf("At %02d instr %d %d %02d: ",
-         instr_loc, opcode, reg_R, addr_MM);
+  if (d->opcode <= 9)
+    m->stats.ops[d->opcode]++;
 
-  switch (opcode) {
-  /* HALT */
-  case 0:
-    exec_HLT();
-    break;
+  d->handler(m, d);
+}
+
+/* Split a word into what one_instruction_cycle needs: opcode,
+ * register, address and sign, and the function that executes it */
+void decode_word(int word, Decoded *d)
+{
+  static Handler handlers[10] = {
+    halt_instr, load_instr, store_instr, add_instr, neg_instr,
+    ldi_instr, addi_instr, jump_instr, branch_instr, io_instr
+  };
+  unsigned int ir = word < 0 ? -(unsigned int) word : (unsigned int) word;
+
+  d->sign = word < 0 ? -1 : 1;
+  d->ir = ir;
+  d->opcode = ir / 1000;
+  d->reg = (ir % 1000) / 100;
+  d->addr = ir % 100;
+  d->handler = d->opcode <= 9 ? handlers[d->opcode] : bad_instr;
+}
+
+/* Decode every word from -MAX_WORD to MAX_WORD once, so running an
+ * instruction is a table lookup instead of three divisions */
+void init_decode_table(void)
+{
+  int word;
+
+  for (word = -MAX_WORD; word <= MAX_WORD; word++)
+    decode_word(word, &decode_table[word + MAX_WORD]);
+}
+
+/* HALT */
+void halt_instr(Machine *m, const Decoded *d)
+{
+  exec_HLT(m, HALT_INSTR);
+}
+
+/* LOAD */
+void load_instr(Machine *m, const Decoded *d)
+{
+  m->reg[d->reg] = m->mem[d->addr];
+  m->stats.loads++;
+}
+
+/* STORE */
+void store_instr(Machine *m, const Decoded *d)
+{
+  m->mem_hash += WORD_HASH(d->addr, m->reg[d->reg])
+               - WORD_HASH(d->addr, m->mem[d->addr]);
+  m->mem[d->addr] = m->reg[d->reg];
+  m->stats.stores++;
+}
+
+/* ADD-IM-MM */
+void add_instr(Machine *m, const Decoded *d)
+{
+  m->reg[d->reg] += m->mem[d->addr];
+  m->stats.loads++;
+}
+
+/* NOT */
+void neg_instr(Machine *m, const Decoded *d)
+{
+  m->reg[d->reg] = -m->reg[d->reg];
+}
+
+/* LOAD IMMEDIATE */
+void ldi_instr(Machine *m, const Decoded *d)
+{
+  m->reg[d->reg] = d->addr * d->sign;
+}
+
+/* ADD IMMEDIATE */
+void addi_instr(Machine *m, const Decoded *d)
+{
+  m->reg[d->reg] += d->addr * d->sign;
+}
+
+/* JUMP */
+void jump_instr(Machine *m, const Decoded *d)
+{
+  int backward = d->addr < m->pc;
+
+  m->pc = d->addr;
+  if (backward && (++m->jumps & (LOOP_CHECK_EVERY - 1)) == 0)
+    loop_check(m);
+}
+
+/* BRANCH CONDITIONAL: BR+ if the word is positive, BR- if negative */
+void branch_instr(Machine *m, const Decoded *d)
+{
+  int r = m->reg[d->reg];
+
+  if ((r > 0 && d->sign > 0) || (r < 0 && d->sign < 0)) {
+    int backward = d->addr < m->pc;
+
+    m->pc = d->addr;
+    m->stats.taken++;
+    if (backward && (++m->jumps & (LOOP_CHECK_EVERY - 1)) == 0)
+      loop_check(m);
+  }
+}
 
-  /* LOAD */
+/* I/O Subroutines */
+void io_instr(Machine *m, const Decoded *d)
+{
+  int addr_MM = d->addr;
+
+  m->stats.io[d->reg]++;
+  switch (d->reg) {
+  /* GETCHAR */
+  case 0: {
+    fprintf(m->out, "enter a character>> ");
+    int k = m->in != NULL ? getc(m->in) : EOF;
+    m->reg[0] = k;
+  } break;
+
+  /* PRINTCHAR */
   case 1: {
-    reg[reg_R] = mem[addr_MM];
+    fprintf(m->out, "%c\n", m->reg[0]);
   } break;
 
-  /* STORE */
+  /* PRINT-STRING */
   case 2: {
-    mem[addr_MM] = reg[reg_R];
+    while (addr_MM < MEMLEN && m->mem[addr_MM] != 0) {
+        fprintf(m->out, "%c \n", m->mem[addr_MM++]);
+    }
+    fprintf(m->out, "\n");
   } break;
 
-  /* ADD-IM-MM */
+  /* DUMP CU */
   case 3: {
-    reg[reg_R] += mem[addr_MM];
+    dump_control_unit(m);
   } break;
 
-  /* NOT */
+  /* DUMP MEM */
   case 4: {
-    reg[reg_R] = (-reg[reg_R]);
-  } break;
-
-  /* LOAD IMMEDIATE */
-  case 5: {
-    reg[reg_R] = addr_MM * instr_sign;
+    dump_memory(m);
   } break;
 
-  /* ADD IMMEDIATE */
-  case 6: {
-    reg[reg_R] += addr_MM * instr_sign;
-  } break;
+  default:
+    break;
+  }
+}
 
-  /* JUMP */
-  case 7: {
-    pc = addr_MM;
-  } break;
+/* A word too large to be an instruction */
+void bad_instr(Machine *m, const Decoded *d)
+{
+  fprintf(m->out, "Bad opcode!? %d\n", d->opcode);
+}
 
-  /* BRANCH CONDITIONAL */
-  case 8: {
-    if (reg[reg_R] > 0 && instr_sign > 0) {
-      pc = addr_MM;
-    } else if (reg[reg_R] < 0 && instr_sign < 0)
-      pc = addr_MM;
-  } break;
+/* At every LOOP_CHECK_EVERY-th backward jump: halt if the machine is
+ * back in the state last saved, which means it will go round the same
+ * loop forever. The PC, input read so far and the memory hash rule
+ * out almost every other state before anything is compared word by
+ * word */
+void loop_check(Machine *m)
+{
+  if (m->jumps == m->next_save) {
+    m->saved_pc = m->pc;
+    m->saved_reads = m->stats.io[0];
+    m->saved_hash = m->mem_hash;
+    memcpy(m->saved_reg, m->reg, sizeof(m->reg));
+    memcpy(m->saved_mem, m->mem, sizeof(m->mem));
+    m->next_save *= 2;
+    return;
+  }
 
-  /* I/O Subroutines */
-  case 9: {
-    switch (reg_R) {
-    /* GETCHAR */
-    case 0: {
-      printf("enter a character>> ");
-      int k = getchar();
-      reg[0] = k;
-    } break;
-
-    /* PRINTCHAR */
-    case 1: {
-      printf("%c\n", reg[0]);
-    } break;
-
-    /* PRINT-STRING */
-    case 2: {
-      while (mem[addr_MM] != 0) {
-          printf("%c \n", mem[addr_MM++]);
-      }
-      printf("\n");
-    } break;
+  if (m->pc == m->saved_pc && m->mem_hash == m->saved_hash &&
+      m->stats.io[0] == m->saved_reads &&
+      memcmp(m->reg, m->saved_reg, sizeof(m->reg)) == 0 &&
+      memcmp(m->mem, m->saved_mem, sizeof(m->mem)) == 0) {
+    fprintf(m->out, "Infinite loop: back at %02d with nothing changed\n",
+            m->pc);
+    exec_HLT(m, HALT_LOOP);
+  }
+}
 
-    /* DUMP CU */
-    case 3: {
-      dump_control_unit(pc, ir, running, reg, nreg);
-    } break;
+void exec_HLT(Machine *m, int reason)
+{
+  fprintf(m->out, "HALT\nHalting\n");
+  m->running = 0;
+  m->halt_reason = reason;
+}
 
-    /* DUMP MEM */
-    case 4: {
-      dump_memory(mem, memlen);
-    } break;
 
-    default:
-      return;
+/* Readable reason for each HALT_* code */
+char *halt_reasons[] = {
+  "cycle limit",
+  "HALT",
+  "program counter out of range",
+  "infinite loop"
+};
+
+/* --batch MANIFEST [--results FILE] [--jobs N] [--max-cycles N]: run
+ * every program of the manifest (one per line, optionally followed by
+ * a file GETC reads; '#' starts a comment), each on a machine of its
+ * own, on a pool of threads. One result line per job, in manifest
+ * order, with how it stopped, its registers, memory and output.
+ * Returns the process exit status */
+int batch_run(int argc, char *argv[])
+{
+  Batch batch;
+  pthread_t *threads;
+  struct timespec start, end;
+  FILE *results = stdout;
+  char *manifest_name = argv[2], *results_name = NULL;
+  int i, nworkers = 0, failed = 0;
+
+  batch.budget = LONG_MAX;
+  for (i = 3; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--results") == 0)
+      results_name = argv[i + 1];
+    else if (strcmp(argv[i], "--jobs") == 0)
+      nworkers = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--max-cycles") == 0)
+      batch.budget = strtol(argv[i + 1], NULL, 10);
+    else
       break;
+  }
+  if (manifest_name == NULL || i < argc || batch.budget <= 0) {
+    printf("usage: %s --batch MANIFEST [--results FILE] [--jobs N] "
+           "[--max-cycles N]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (batch_read_manifest(&batch, manifest_name) != 0)
+    return EXIT_FAILURE;
+  batch.next = 0;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  if (nworkers <= 0)
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nworkers > batch.njobs)
+    nworkers = batch.njobs;
+  if (nworkers < 1)
+    nworkers = 1;
+  threads = calloc(nworkers, sizeof(pthread_t));
+  if (threads == NULL) {
+    printf("Could not allocate %d workers\n", nworkers);
+    return EXIT_FAILURE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nworkers; i++) {
+    if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) {
+      printf("Could not start worker %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nworkers; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (results_name != NULL) {
+    results = fopen(results_name, "w");
+    if (results == NULL) {
+      printf("Could not open results file %s\n", results_name);
+      return EXIT_FAILURE;
     }
-  } break;
-  default:
-    printf("Bad opcode!? %d\n", opcode);
   }
+  for (i = 0; i < batch.njobs; i++) {
+    fputs(batch.jobs[i].result, results);
+    if (!batch.jobs[i].passed)
+      failed++;
+  }
+  if (results != stdout)
+    fclose(results);
+
+  printf("Ran %d jobs on %d threads in %.3f s, %d did not halt\n",
+         batch.njobs, nworkers, (end.tv_sec - start.tv_sec) +
+         (end.tv_nsec - start.tv_nsec) / 1e9, failed);
+
+  for (i = 0; i < batch.njobs; i++) {
+    free(batch.jobs[i].program);
+    free(batch.jobs[i].input);
+    free(batch.jobs[i].result);
+  }
+  free(batch.jobs);
+  free(threads);
+  pthread_mutex_destroy(&batch.lock);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-void exec_HLT()
+/* Cut line in place into its words, stopping at a word that starts
+ * with '#'. The first max are kept in field; returns how many there
+ * are in all */
+int split_fields(char *line, char **field, int max)
 {
-  printf("HALT\nHalting\n");
-  running = 0;
+  int n = 0;
+
+  for (;;) {
+    line += strspn(line, " \t\r\n\v\f");
+    if (*line == '\0' || *line == '#')
+      return n;
+    if (n < max)
+      field[n] = line;
+    n++;
+    line += strcspn(line, " \t\r\n\v\f");
+    if (*line != '\0')
+      *line++ = '\0';
+  }
 }
 
+int batch_read_manifest(Batch *batch, char *manifest_name)
+{
+  FILE *manifest = fopen(manifest_name, "r");
+  char *buffer = NULL;
+  size_t buffer_len = 0;
+  int line = 0, cap = 0;
+
+  if (manifest == NULL) {
+    printf("Could not open manifest %s\n", manifest_name);
+    return -1;
+  }
+
+  batch->jobs = NULL;
+  batch->njobs = 0;
+
+  while (getline(&buffer, &buffer_len, manifest) != -1) {
+    char *field[2];
+    int fields;
+    BatchJob *job;
+
+    line++;
+    fields = split_fields(buffer, field, 2);
+    if (fields == 0)
+      continue;
+    if (fields > 2) {
+      printf("%s:%d: error: expected a program and an input file\n",
+             manifest_name, line);
+      free(buffer);
+      fclose(manifest);
+      return -1;
+    }
+
+    if (batch->njobs == cap) {
+      cap = cap ? 2 * cap : 64;
+      batch->jobs = realloc(batch->jobs, cap * sizeof(BatchJob));
+      if (batch->jobs == NULL) {
+        printf("Could not allocate %d jobs\n", cap);
+        exit(EXIT_FAILURE);
+      }
+    }
+    job = &batch->jobs[batch->njobs++];
+    job->program = strdup(field[0]);
+    job->input = fields == 2 ? strdup(field[1]) : NULL;
+    job->result = NULL;
+    job->passed = 0;
+  }
+
+  free(buffer);
+  fclose(manifest);
+  return 0;
+}
+
+/* Take jobs in manifest order until there are none left */
+void *batch_worker(void *arg)
+{
+  Batch *batch = arg;
+  Machine *m = malloc(sizeof(Machine));
+  int job;
+
+  if (m == NULL) {
+    printf("Could not allocate a machine\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    job = batch->next < batch->njobs ? batch->next++ : -1;
+    pthread_mutex_unlock(&batch->lock);
+    if (job < 0)
+      break;
+    batch_run_job(m, &batch->jobs[job], job + 1, batch->budget);
+  }
+
+  free(m);
+  return NULL;
+}
+
+/* Load, run and report one job. Everything it touches is in m and
+ * job, so any number of these can run at once */
+void batch_run_job(Machine *m, BatchJob *job, int number, long budget)
+{
+  FILE *program, *result;
+  char *text = NULL, *output = NULL, *dot;
+  size_t len, result_len, output_len = 0, i;
+  int mapped, loaded = -1;
+  long cycles;
+
+  machine_init(m);
+  m->trace = 0;
+
+  result = open_memstream(&job->result, &result_len);
+  if (result == NULL) {
+    printf("Could not allocate the result of job %d\n", number);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(result, "job=%d program=%s", number, job->program);
+
+  program = fopen(job->program, "r");
+  m->in = job->input != NULL ? fopen(job->input, "r") : NULL;
+  m->out = open_memstream(&output, &output_len);
+  dot = strrchr(job->program, '.');
+
+  if (program == NULL) {
+    fprintf(result, " error=\"could not open program\"\n");
+  } else if (job->input != NULL && m->in == NULL) {
+    fprintf(result, " error=\"could not open input\"\n");
+  } else if (m->out == NULL ||
+             (text = map_datafile(program, &len, &mapped)) == NULL) {
+    fprintf(result, " error=\"could not read program\"\n");
+  } else if ((loaded = dot != NULL && strcmp(dot, ".asm") == 0
+                     ? assemble(text, len, job->program, m->mem, MEMLEN)
+                     : load_image(text, len, job->program,
+                                  m->mem, MEMLEN)) < 0) {
+    fprintf(result, " error=\"malformed program\"\n");
+  }
+
+  if (loaded >= 0) {
+    cycles = run(m, budget);
+    fflush(m->out);
+
+    fprintf(result, " halt=\"%s\" cycles=%ld pc=%d regs=",
+            halt_reasons[m->halt_reason], cycles, m->pc);
+    for (i = 0; i < NREG; i++)
+      fprintf(result, "%s%d", i ? "," : "", m->reg[i]);
+    fprintf(result, " mem=");
+    for (i = 0; i < MEMLEN; i++)
+      fprintf(result, "%s%d", i ? "," : "", m->mem[i]);
+
+    fprintf(result, " output=\"");
+    for (i = 0; i < output_len; i++) {
+      unsigned char c = output[i];
+
+      if (c == '"' || c == '\\')
+        fprintf(result, "\\%c", c);
+      else if (c == '\n')
+        fprintf(result, "\\n");
+      else if (c < ' ' || c > '~')
+        fprintf(result, "\\x%02X", c);
+      else
+        fputc(c, result);
+    }
+    fprintf(result, "\"\n");
+
+    job->passed = m->halt_reason == HALT_INSTR;
+  }
+
+  if (text != NULL)
+    unmap_datafile(text, len, mapped);
+  if (program != NULL)
+    fclose(program);
+  if (m->in != NULL)
+    fclose(m->in);
+  if (m->out != NULL)
+    fclose(m->out);
+  free(output);
+  fclose(result);
+}
@@ -12,6 +12,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+
+/* The JIT (--jit) emits x86-64 code; elsewhere --jit just interprets */
+#if defined(__x86_64__) && defined(__unix__)
+# define LC3_JIT
+#endif
 
 /* Assembler declarations */
 # define MEMLEN 65536
@@ -20,7 +39,175 @@
 typedef short int Word;             /* word of LC-3 memory */
 typedef unsigned short int Address; /* an LC-3 address */
 
+typedef struct cpu CPU;
+typedef struct decoded Decoded;
+typedef struct jit Jit;
+typedef struct snapshot Snapshot;
+typedef struct console Console;
+typedef struct keyboard Keyboard;
+typedef struct history History;
+typedef struct debug Debug;
+
+/* Executes one predecoded instruction */
+typedef void (*InstrHandler)(CPU *cpu, const Decoded *d);
+
+/* Predecoded instruction. Every memory word has one of these in
+ * the instruction cache, so the fields below are extracted and
+ * sign-extended once instead of on every execution */
+struct decoded {
+    InstrHandler handler; /* *_instr function for the opcode */
+    short offset;         /* sign-extended imm5/offset6/PCoffset9/11, trap vector */
+    unsigned char op;     /* dispatch slot: opcode, OP_DECODE/OP_FUSE or SLOT_* */
+    unsigned char dst;    /* DR/SR, bits 11-9 (nzp for BR) */
+    unsigned char src;    /* SR1/BaseR, bits 8-6 */
+    unsigned char src2;   /* SR2, bits 2-0 */
+    unsigned char imm;    /* immediate form (bit 5 of ADD/AND, bit 11 of JSR) */
+};
+
+/* Dispatch slots of a cache entry that has to be (re)decoded. A
+ * word the program stored is likely to be stored again, so it is only
+ * decoded; anything else (a new image, a restored snapshot) is also
+ * matched against the idioms */
+# define OP_DECODE 16
+# define OP_FUSE   17
+# define STALE(op) ((op) == OP_DECODE || (op) == OP_FUSE)
+
+/* Dispatch slots of the first entry of an idiom the threaded loop
+ * runs as one (see fuse_instr). Only that loop ever sees them, since
+ * fetch_decoded puts the opcode back */
+# define SLOT_CONST  18 /* AND Rx,Rx,#0; ADD Rx,Rx,#n: Rx <- n */
+# define SLOT_NEGATE 19 /* NOT Rx,Ry; ADD Rx,Rx,#1: Rx <- -Ry */
+# define SLOT_COUNT  20 /* ADD Rx,Rx,#n; BR: step a loop counter */
+# define SLOT_BUMP   21 /* LDR Rt,Rb,#k; ADD Rt,Rt,#n; STR Rt,Rb,#k */
+
+/* Opcodes an idiom can start with, one bit per opcode */
+# define FUSE_OPS 0x0262
+
+/* Runs a whole idiom without a trace, or returns 0 having done
+ * nothing if it can't */
+typedef int (*FusedHandler)(CPU *cpu, const Decoded *d);
+
+typedef struct {
+    int op;              /* opcodes of the first and last instructions */
+    int last;
+    int len;             /* instructions in the idiom */
+    FusedHandler run;
+} Idiom;
+
+/* Memory is tracked in pages for snapshots: a bit per page records
+ * whether it was stored to since the last snapshot */
+# define PAGE_SHIFT 8
+# define PAGE_LEN (1 << PAGE_SHIFT)   /* words */
+# define NPAGES (MEMLEN >> PAGE_SHIFT)
+# define PAGE_DIRTY(cpu, page) ((cpu)->dirty[(page) >> 3] & (1 << ((page) & 7)))
+# define MARK_DIRTY(cpu, addr) \
+    ((cpu)->dirty[(addr) >> (PAGE_SHIFT + 3)] |= 1 << (((addr) >> PAGE_SHIFT) & 7))
+
+/* Trace levels */
+# define TRACE_NONE     0 /* only the program's own console output */
+# define TRACE_BRANCHES 1 /* control transfers (BR, JSR, JMP, RTI, TRAP) */
+# define TRACE_FULL     2 /* every instruction */
+
+/* Memory dump formats (dump_range) */
+# define DUMP_TEXT   0   /* xADDR: xWORD decimal, zero runs folded */
+# define DUMP_HEX    1   /* hexdump -C of the big-endian bytes */
+# define DUMP_BINARY 2   /* a .obj */
+
+/* Opcodes traced at TRACE_BRANCHES, one bit per opcode */
+# define CONTROL_OPS 0x9111
+
+/* Why the cpu stopped running (see halt_reasons) */
+# define HALT_NONE      0
+# define HALT_TRAP      1
+# define HALT_BAD_TRAP  2
+# define HALT_RTI       3
+# define HALT_RESERVED  4
+# define HALT_PC_RANGE  5
+# define HALT_MCR       6
+
+/* Memory-mapped device registers. Loads and stores from IO_BASE up
+ * go through device_read and device_write; below it memory is plain */
+# define IO_BASE 0xFE00
+# define KBSR    0xFE00  /* keyboard status: bit 15 set while a key waits */
+# define KBDR    0xFE02  /* keyboard data: loading it takes the key */
+# define DSR     0xFE04  /* display status: bit 15 set when ready */
+# define DDR     0xFE06  /* display data: storing to it prints a character */
+# define TMR     0xFE08  /* timer: bit 15 set when it fires, cleared by
+                            loading it; bit 14 enables its interrupt */
+# define TMI     0xFE0A  /* timer interval in instructions, 0 stops it */
+# define PSR     0xFFFC  /* processor status: privilege, priority, cc */
+# define MCR     0xFFFE  /* machine control: clearing bit 15 halts */
+
+/* Interrupts. A device interrupt is taken between two instructions
+ * when its priority level is above the program's: the PSR and PC are
+ * pushed on the supervisor stack and the PC is loaded from the
+ * vector's entry in the table. RTI pops them back. Devices are only
+ * looked at when the run loop stops for an event (see events_run) */
+# define INT_TABLE     0x0100  /* interrupt vector table */
+# define INT_PRIVILEGE 0x00    /* exception: RTI in user mode */
+# define INT_KEYBOARD  0x80
+# define INT_TIMER     0x81
+# define PL_KEYBOARD   4
+# define PL_TIMER      5
+# define KBSR_IE       0x4000  /* KBSR and TMR: interrupt enable */
+# define SSP_INITIAL   0x3000  /* supervisor stack, growing down */
+# define KEYBOARD_POLL 1024    /* instructions between keyboard checks
+                                  with its interrupt on, a power of two */
+
+/* Binary execution trace (--trace-file). One fixed-size record per
+ * executed instruction goes into a ring buffer that is written out
+ * whenever it fills up; --decode-trace turns a trace file back into
+ * the text of a full trace. Records are stored in host byte order */
+# define TRACE_RING_LEN 65536 /* records, a power of two */
+# define TRACE_MAGIC "LC3T"
+# define TRACE_VERSION 1
+
+# define TR_TAKEN 1 /* flags: BR was taken */
+
+typedef struct {
+    Address pc;          /* address of the instruction */
+    Address ir;          /* the instruction */
+    Address value;       /* value written to the destination register or
+                            memory word (R7 for JSR/JMP, R0 for TRAP) */
+    Address ea;          /* load/store address, new PC for BR/JSR/JMP,
+                            trap vector for TRAP */
+    unsigned char cc;    /* condition code afterwards */
+    unsigned char flags; /* TR_* bits */
+} TraceRecord;
+
+/* Start of a trace file: the registers when tracing began, so
+ * the decoder can reconstruct every intermediate value */
 typedef struct {
+    char magic[4];
+    unsigned short version;
+    unsigned short record_size;
+    Word reg[NREG];
+    Address pc;
+    unsigned short cc;
+} TraceHeader;
+
+/* Performance counters. They are always kept; loads and stores are
+ * worked out from the opcode counts rather than counted separately */
+typedef struct {
+    unsigned long ops[16];      /* instructions retired per opcode */
+    unsigned long taken;        /* BRs that branched */
+    unsigned long traps[256];   /* TRAPs per vector */
+    double seconds;             /* host time spent running them */
+} Stats;
+
+/* Processor status beyond the condition code: the privilege and
+ * priority of the PSR, the stack pointer of the other mode and when
+ * the interval timer fires next */
+typedef struct {
+    int user;            /* 1 in user mode, 0 in supervisor mode */
+    int priority;        /* PL0-PL7: only interrupts above it are taken */
+    Word saved_ssp;      /* R6 of whichever mode isn't running */
+    Word saved_usp;
+    unsigned long timer_next; /* cycle the timer fires at */
+    int timer_reload;    /* TMI was stored to: restart the timer */
+} Status;
+
+struct cpu {
     Word mem[MEMLEN];    /* memory */
     Word reg[NREG];      /* registers */
     int pc;              /* program counter */
@@ -30,84 +217,900 @@ typedef struct {
     int opcode;          /* current instruction's opcode */
     unsigned int origin; /* where the program begins in memory */
     char condition;      /* condition code in character format (debug info) */
-} CPU;
+    int halt_reason;     /* HALT_* code once running is 0 */
+    unsigned long cycles;   /* instructions executed so far */
+    int trace;           /* TRACE_* level */
+    int tracing;         /* is the current instruction being traced? */
+    Address ea;          /* effective address of the last load/store */
+    TraceRecord *trace_ring;   /* binary trace, NULL when not recording */
+    unsigned long trace_count; /* records appended to trace_ring */
+    FILE *trace_file;          /* where full rings are written */
+    Decoded icache[MEMLEN]; /* predecoded copy of mem */
+    Jit *jit;               /* translated code, NULL when not using --jit */
+    unsigned char dirty[NPAGES / 8]; /* pages stored to since snap_base */
+    Snapshot *snap_base;    /* snapshot the dirty bitmap is relative to */
+    Snapshot *snapshot;     /* the command loop's snapshot (s and l) */
+    Console *console;       /* where GETC/IN/OUT/PUTS go, NULL for the terminal */
+    FILE *messages;         /* where loading errors go, NULL for stdout */
+    History *history;       /* undo log for reverse execution, or NULL */
+    Debug *debug;           /* breakpoints, NULL until one is set */
+    Stats stats;            /* performance counters */
+    Status status;          /* privilege, priority, stacks, timer */
+    unsigned long next_event; /* cycle of the next device event */
+    int stop;               /* leave the run loop: halted, or an
+                               interrupt may have become due */
+};
+
+/* Console device: what GETC/IN read and OUT/PUTS/IN print. A batch
+ * job's console holds all of its input and keeps all of its output;
+ * the terminal's buffers its output until a newline (or input, or a
+ * halt) and refills its input a block at a time */
+# define CONSOLE_MAX_OUTPUT (1 << 20) /* bytes of output kept per job */
+# define CONSOLE_BUF_LEN 4096         /* bytes the terminal buffers */
+
+struct console {
+    const char *in;      /* what the program will read */
+    size_t in_len;
+    size_t in_pos;       /* next character to read */
+    int in_fd;           /* where in is refilled from, -1 for nowhere */
+    FILE *in_file;       /* or read a character at a time from here */
+    char *out;           /* what the program printed */
+    size_t out_len;
+    size_t out_cap;
+    FILE *out_file;      /* where out is flushed, NULL to keep it all */
+    int line_buffered;   /* flush at every newline (out_file is a tty) */
+    int truncated;       /* printed more than CONSOLE_MAX_OUTPUT */
+    Keyboard *keyboard;  /* reads in_fd in the background once started */
+};
+
+/* Keys read by a background thread for programs polling KBSR, in a
+ * single-producer single-consumer ring: only the thread moves tail
+ * and only the cpu moves head, so neither ever takes a lock */
+# define KEYBOARD_LEN 4096   /* keys queued, a power of two */
+
+struct keyboard {
+    unsigned char keys[KEYBOARD_LEN];
+    atomic_uint head;    /* next key to take */
+    atomic_uint tail;    /* where the next key read goes */
+    atomic_int eof;      /* the thread has read everything */
+    int fd;
+};
+
+/* How long either side sleeps waiting for the other */
+static const struct timespec keyboard_nap = { 0, 100000 };
+
+/* The console of every cpu whose console is NULL */
+static Console terminal;
+static char terminal_in[CONSOLE_BUF_LEN];
+static char terminal_out[CONSOLE_BUF_LEN];
+
+/* Snapshot of everything a program can see, to go back to later
+ * (snapshot_restore) or to start other runs from (--snapshot) */
+struct snapshot {
+    Word mem[MEMLEN];
+    Word reg[NREG];
+    int pc;
+    int running;
+    int cc;
+    Word ir;
+    unsigned int origin;
+    int halt_reason;
+    unsigned long cycles;
+    Status status;
+};
+
+/* Snapshot files: this header followed by the Snapshot, host byte order */
+# define SNAP_MAGIC "LC3S"
+# define SNAP_VERSION 2
+
+typedef struct {
+    char magic[4];
+    unsigned short version;
+    unsigned short pad;
+    unsigned int size;   /* sizeof(Snapshot) */
+} SnapshotHeader;
+
+/* Breakpoints and watchpoints (see debug_cycles) */
+# define MAX_BREAKPOINTS 32
+
+# define BP_EXEC  1      /* kind: the PC reaches the address */
+# define BP_READ  2      /* kind: an instruction reads it */
+# define BP_WRITE 4      /* kind: an instruction writes it */
+
+# define COND_NONE 0     /* conditions on a register */
+# define COND_EQ   1
+# define COND_NE   2
+# define COND_LT   3
+# define COND_LE   4
+# define COND_GT   5
+# define COND_GE   6
+
+typedef struct {
+    int number;          /* shown by b, 0 if the slot is free */
+    Address lo, hi;      /* address range covered */
+    int kind;            /* BP_* bits */
+    int cond_reg;        /* register tested, -1 for no condition */
+    int cond_op;         /* COND_* */
+    Word cond_value;
+    unsigned long hits;
+} Breakpoint;
+
+struct debug {
+    unsigned char flags[MEMLEN];  /* BP_* bits of the breakpoints covering
+                                     each address */
+    Breakpoint bp[MAX_BREAKPOINTS];
+    int nbreakpoints;    /* slots in use */
+    int nwatch;          /* of which watchpoints */
+    int last_number;
+    int stopped;         /* breakpoint that stopped the last run, or 0 */
+};
+
+/* Reverse execution (see history_init) */
+# define UNDO_LEN (1 << 18)           /* undo records kept, a power of two */
+# define CHECKPOINT_INTERVAL (1 << 16) /* instructions between checkpoints */
+# define NCHECKPOINTS 32
+
+# define UNDO_STORE 1    /* flags: wrote mem[addr] */
+# define UNDO_INPUT 2    /* flags: read a character of input */
+# define UNDO_NOREG 0xFF
+
+/* What one instruction overwrote */
+typedef struct {
+    Address pc;          /* where it was */
+    Word ir;             /* instruction register before it */
+    Word old[2];         /* previous values of up to two registers */
+    unsigned char reg[2];  /* which registers, UNDO_NOREG if fewer */
+    Address addr;        /* location stored to */
+    Word mem;            /* its previous value */
+    unsigned char cc;    /* condition code before it */
+    unsigned char flags; /* UNDO_* bits */
+} UndoRecord;
+
+typedef struct {
+    Snapshot state;
+    size_t input_pos;    /* input journal position at that point */
+} Checkpoint;
+
+struct history {
+    UndoRecord undo[UNDO_LEN];  /* ring, newest at undo_end - 1 */
+    unsigned long undo_end;
+    unsigned long nundo;        /* records in the ring */
+    Checkpoint checkpoint[NCHECKPOINTS]; /* ring, oldest first */
+    int first_checkpoint;
+    int ncheckpoints;
+    unsigned long start_cycles; /* cpu->cycles when recording began */
+    char *input;                /* every character GETC/IN ever read */
+    size_t input_len;
+    size_t input_cap;
+    size_t input_pos;           /* next one to read */
+    int replaying;              /* re-executing from a checkpoint */
+    int active;                 /* cur is being filled in */
+    UndoRecord cur;             /* record of the current instruction */
+    Word reg[NREG];             /* registers before it */
+};
+
+/* Basic-block JIT (--jit) */
+# define JIT_CODE_SIZE (16 << 20) /* bytes of translated code */
+# define JIT_MAX_BLOCK 64         /* instructions per block */
+# define JIT_MAX_DROPS 4          /* retranslations before interpreting */
+
+struct jit {
+    unsigned char *code;     /* trampolines followed by translated blocks */
+    size_t used;             /* bytes of code in use */
+    size_t start_offset;     /* where the first block goes */
+    size_t exit_offset;      /* exit trampoline */
+    int smc_addr;            /* word of translated code stored to, or -1 */
+    unsigned char *entry[MEMLEN];    /* block starting at each address */
+    unsigned char length[MEMLEN];    /* its length in instructions */
+    unsigned char codemap[MEMLEN];   /* blocks containing each word */
+    unsigned char drops[MEMLEN];     /* times that block was thrown away */
+};
+
+/* Assembler (see assemble) */
+# define MAX_OPERANDS 3
+
+# define FMT_NONE    0   /* operand formats: none */
+# define FMT_ADD     1   /* DR, SR1, SR2 or imm5 */
+# define FMT_NOT     2   /* DR, SR */
+# define FMT_PC9     3   /* DR, label or PCoffset9 */
+# define FMT_OFF6    4   /* DR, BaseR, offset6 */
+# define FMT_BR      5   /* label or PCoffset9 */
+# define FMT_BASE    6   /* BaseR */
+# define FMT_PC11    7   /* label or PCoffset11 */
+# define FMT_TRAP    8   /* trapvect8 */
+# define FMT_ORIG    9   /* directives */
+# define FMT_FILL    10
+# define FMT_BLKW    11
+# define FMT_STRINGZ 12
+# define FMT_END     13
+
+# define ARG_NONE   0    /* operand kinds */
+# define ARG_REG    1
+# define ARG_NUMBER 2
+# define ARG_LABEL  3
+# define ARG_STRING 4
+
+typedef struct {
+    const char *name;
+    int format;          /* FMT_* */
+    int bits;            /* fixed bits of the instruction */
+} Mnemonic;
+
+typedef struct {
+    int kind;            /* ARG_* */
+    int value;           /* register, number or symbol index */
+    const char *text;    /* in the source (inside the quotes for a string) */
+    int len;
+} Operand;
+
+/* One line of source, as found by the first pass */
+typedef struct {
+    const Mnemonic *mnemonic;
+    int address;
+    int line;
+    int nargs;
+    Operand arg[MAX_OPERANDS];
+} Statement;
+
+typedef struct {
+    const char *name;    /* in the source, not terminated */
+    int len;
+    unsigned int hash;
+    int address;         /* -1 until its label is seen */
+    int line;            /* where that was */
+} Symbol;
+
+typedef struct {
+    int *slots;          /* open addressing: index into sym + 1, 0 if free */
+    int mask;            /* number of slots - 1 */
+    Symbol *sym;         /* in order of first appearance */
+    int count;
+    int cap;
+} SymbolTable;
+
+typedef struct {
+    const char *name;    /* of the source, for errors */
+    FILE *messages;      /* where the errors go */
+    SymbolTable symbols;
+    Statement *statements;
+    int nstatements;
+    int cap;
+    int origin;
+    int end;             /* address after the last word */
+    Word *image;         /* words origin..end-1 */
+    int errors;
+} Assembler;
+
+/* Command line options */
+typedef struct {
+    char *datafile;           /* program to load (NULL for the default) */
+    int run;                  /* run to halt instead of reading commands */
+    int trace;                /* TRACE_* level */
+    unsigned long max_cycles; /* instruction budget for a run, 0 for none */
+    char *trace_file;         /* record a binary trace here */
+    char *decode_trace;       /* print this binary trace as text and exit */
+    int jit;                  /* run through the JIT */
+    char *snapshot;           /* start from this snapshot instead */
+    char *save_snapshot;      /* snapshot the final state to this file */
+    char *batch;              /* run the jobs in this manifest */
+    char *results;            /* where batch results go (NULL: stdout) */
+    int jobs;                 /* batch worker threads, 0 for one per core */
+    char *assemble;           /* assemble this source and exit */
+    char *output;             /* the .obj it goes to (NULL: next to it) */
+    char *input;              /* GETC/IN read this instead of stdin */
+    char *dump;               /* dump all of memory here at the end */
+    int dump_format;          /* DUMP_* format of that dump */
+    char *script;             /* read the commands from here, not stdin */
+    unsigned long lockstep;   /* --lockstep stride, 0 when not comparing */
+    unsigned long fuzz;       /* inputs to fuzz the program or loader with */
+    int fuzz_loader;          /* fuzz the loader instead of the program */
+    unsigned long fuzz_seed;  /* seed of the mutations */
+    char *fuzz_out;           /* directory the findings are saved in */
+    char *vector;             /* run the program over every input listed here */
+} Options;
+
+/* A command line and the words it splits into. Both buffers are kept
+ * from one command to the next, so a long script only allocates when
+ * a line longer than any before it comes along */
+# define MAX_WORDS 8     /* words kept; nwords counts them all */
+
+typedef struct {
+    char *line;          /* as read, for commands parsing it themselves */
+    size_t line_cap;
+    char *text;          /* a copy of line cut into the words */
+    size_t text_cap;
+    char *word[MAX_WORDS];
+    int nwords;
+} Command;
+
+/* Batch mode */
+typedef struct {
+    char *program;       /* program image */
+    char *input;         /* what GETC/IN read, NULL for nothing */
+    char *result;        /* result line, filled in by the worker */
+    int passed;          /* did it stop on a HALT trap? */
+} BatchJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int next;            /* jobs [next, end) are still to be run */
+    int end;
+} JobQueue;
+
+typedef struct {
+    BatchJob *jobs;
+    int njobs;
+    JobQueue *queues;    /* one per worker */
+    int nworkers;
+    Options *opt;
+} Batch;
+
+typedef struct {
+    Batch *batch;
+    int id;              /* index of its queue */
+} Worker;
+
+/* Vector mode (see vector_run) */
+# define VECTOR_LANES  64  /* inputs stepped together */
+# define VECTOR_WIDTH  16  /* Words in a 256-bit vector */
+# define VECTOR_CHUNKS (VECTOR_LANES / VECTOR_WIDTH)
+
+/* Lane l of an array of vectors */
+# define LANE(v, l) (((Word *) (v))[l])
+
+/* gang_alu and gang_branch are built for AVX2 and for any x86-64, the
+ * one the host can run being picked when the program is loaded */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+# define VECTOR_CLONES __attribute__ ((target_clones ("avx2", "default")))
+#else
+# define VECTOR_CLONES
+#endif
+
+typedef Word WordVector __attribute__ ((vector_size (VECTOR_WIDTH * sizeof(Word))));
+
+/* One line of the inputs list */
+typedef struct {
+    char *file;          /* what GETC/IN read, NULL for nothing */
+    Word reg[NREG];      /* registers to start with instead of the */
+    int preset;          /* program's: Rn if bit n is set */
+} VectorInput;
+
+typedef struct {
+    const char *error;   /* why it couldn't run, NULL if it could */
+    char *text;          /* what GETC/IN read */
+    size_t len;
+    int mapped;
+    Console console;
+    Word *page[NPAGES];  /* its memory: the loaded image's pages, or
+                            its own copy once it has stored to one */
+    int pc;              /* while the gang is diverged */
+    unsigned long cycles; /* the same */
+    int running;         /* once out of the gang, as for a cpu */
+    int halt_reason;
+} Lane;
+
+typedef struct {
+    WordVector reg[NREG][VECTOR_CHUNKS]; /* Rn of lane l is LANE(reg[n], l) */
+    WordVector cc[VECTOR_CHUNKS];
+    WordVector live[VECTOR_CHUNKS];      /* -1 for the lanes still stepped */
+    Lane lane[VECTOR_LANES];
+    int nlanes;
+    int nlive;
+    int converged;       /* every live lane is at pc, having run steps
+                            more instructions than its cycles says */
+    int pc;
+    unsigned long steps;
+    unsigned long limit; /* steps before the first lane's budget is up */
+    unsigned long budget;
+    CPU *base;           /* the loaded program */
+    CPU *cpu;            /* spare, for lanes going on by themselves */
+    unsigned char written[MEMLEN]; /* stored to by some lane */
+} Gang;
+
+/* Fuzzing */
+# define FUZZ_MAX_INPUT 4096       /* bytes of input a program is given */
+# define FUZZ_MAX_IMAGE (1 << 20)  /* bytes of a program file */
+# define FUZZ_CORPUS    256        /* inputs kept to mutate */
+# define FUZZ_SEEN      4096       /* outcomes and findings remembered */
+# define FUZZ_TIMEOUT   2          /* seconds the loader may take */
+
+typedef struct {
+    unsigned long long rng;   /* xorshift state */
+    char *out_dir;            /* findings are saved here */
+    unsigned long seen[FUZZ_SEEN]; /* hash set of outcomes and findings */
+    char *corpus[FUZZ_CORPUS];
+    size_t corpus_len[FUZZ_CORPUS];
+    int ncorpus;
+    unsigned long findings;
+} Fuzzer;
 
 /* Function Prototypes */
 
 /* Initialization */
-FILE *get_datafile(int argc, char *argv[]);  
+void parse_options(int argc, char *argv[], Options *opt);
+void usage(char *name);
+FILE *get_datafile(char *datafile_name);
 void initialize_control_unit(CPU *cpu);
-void initialize_memory(int argc, char *argv[], CPU *cpu);
+void initialize_memory(char *datafile_name, CPU *cpu);
+char *map_datafile(FILE *datafile, size_t *len, int *mapped);
+void unmap_datafile(char *text, size_t len, int mapped);
+int load_image(CPU *cpu, const char *text, size_t len, const char *name);
+int load_object(CPU *cpu, const char *text, size_t len, const char *name);
+int load_source(CPU *cpu, const char *text, size_t len, const char *name);
+int load_program(CPU *cpu, const char *text, size_t len, const char *name);
+void image_loaded(CPU *cpu, int origin, int end);
+void init_hex_digits(void);
 
 /* Dumping info (program + debug) */
 void dump_control_unit(CPU *cpu);
 void dump_memory(CPU *cpu);
 void dump_registers(CPU *cpu);
+int write_all(int fd, const char *buf, size_t len);
+int dump_range(CPU *cpu, int fd, int lo, int hi, int format);
+int dump_format(const char *name);
+int dump_to_file(CPU *cpu, char *name, int lo, int hi, int format);
+void dump_command(Command *cmd, CPU *cpu);
 void help_message(void);
 
 /* Instruction Execution-related */
-int execute_command(char *cmd_buffer, char cmd_char, CPU *cpu);
+int execute_command(Command *cmd, CPU *cpu);
 void one_instruction_cycle(CPU *cpu);
-void manyInstructionCycles(CPU *cpu, int nbr_cycles);
+void manyInstructionCycles(CPU *cpu, unsigned long nbr_cycles);
+unsigned long run_cycles(CPU *cpu, unsigned long nbr_cycles);
+unsigned long step_cycles(CPU *cpu, unsigned long nbr_cycles);
+int run_program(CPU *cpu, Options *opt);
+int lockstep_run(CPU *ref, Options *opt);
+int lockstep_compare(CPU *ref, CPU *fast, unsigned long start);
+void lockstep_header(CPU *ref, unsigned long start);
+void trace_prefix(CPU *cpu, Decoded *d);
+void fused_steps(CPU *cpu, Decoded *d, Address pc, int n);
+unsigned long timed_run(CPU *cpu, unsigned long nbr_cycles);
+void stats_report(CPU *cpu);
+void stats_command(char *cmd_buffer, CPU *cpu);
+
+/* Batch mode */
+int batch_run(Options *opt);
+int batch_read_manifest(Batch *batch, char *manifest_name);
+int split_fields(char *line, char **field, int max);
+int batch_next_job(Batch *batch, int id);
+void *batch_worker(void *arg);
+void batch_run_job(CPU *cpu, BatchJob *job, int number, Options *opt);
+int batch_report(FILE *result, CPU *cpu, Console *console);
+
+/* Vector mode */
+int vector_run(CPU *base, Options *opt);
+int vector_read_inputs(char *list_name, VectorInput **inputs, int *ninputs);
+void gang_start(Gang *g, VectorInput *inputs, int n);
+void gang_run(Gang *g);
+int gang_schedule(Gang *g, WordVector *mask);
+void gang_split(Gang *g);
+Decoded *gang_fetch(Gang *g, int pc, WordVector *mask, Decoded *local);
+VECTOR_CLONES void gang_alu(Gang *g, const Decoded *d, int pc,
+                            const WordVector *mask);
+VECTOR_CLONES int gang_branch(Gang *g, const Decoded *d, int pc,
+                              const WordVector *mask, int *next);
+void gang_advance(Gang *g, const WordVector *mask, int pc);
+void gang_diverge(Gang *g, const WordVector *mask, const int *next);
+void gang_memory(Gang *g, const Decoded *d, int pc, WordVector *mask);
+int gang_report(Gang *g, FILE *results, int first, char *program);
+void gang_free(Gang *g);
+void lane_sync(Gang *g, int l);
+void lane_finish(Gang *g, int l);
+void lane_halt(Gang *g, int l, int reason, int pc);
+void lane_store(Gang *g, int l, Address addr, Word value);
+int lane_trap(Gang *g, int l, const Decoded *d, int pc);
+void lane_evict(Gang *g, int l);
+
+/* Fuzzing */
+int fuzz_guest(CPU *cpu, Options *opt);
+int fuzz_loader(Options *opt);
+const char *fuzz_check(CPU *cpu, char *detail, size_t size);
+void fuzz_init(Fuzzer *fz, Options *opt, const char *seed, size_t len);
+void fuzz_done(Fuzzer *fz, unsigned long execs, struct timespec *start);
+unsigned long fuzz_random(Fuzzer *fz);
+unsigned long fuzz_hash(unsigned long h, const void *data, size_t len);
+int fuzz_seen(Fuzzer *fz, unsigned long hash);
+void fuzz_add(Fuzzer *fz, const char *data, size_t len);
+size_t fuzz_mutate(Fuzzer *fz, char *buf, size_t cap);
+void fuzz_finding(Fuzzer *fz, const char *kind, const char *detail,
+                  unsigned long where, const char *data, size_t len);
+
+/* Console */
+void console_init(Console *console, const char *in, size_t in_len);
+void terminal_init(char *input_name, int shared_stdin);
+int console_read(Console *console);
+int console_getc(CPU *cpu);
+void console_putc(CPU *cpu, int c);
+void console_puts(CPU *cpu, const char *s);
+void console_flush(CPU *cpu);
+void console_put_string(CPU *cpu, Address addr);
+int console_key_ready(CPU *cpu);
+int console_key(CPU *cpu);
+void *keyboard_reader(void *arg);
+int keyboard_start(Console *console);
+int keyboard_pop(Keyboard *kb);
+int keyboard_wait(Keyboard *kb);
+
+/* Binary trace */
+void trace_open(CPU *cpu, char *trace_name);
+void trace_record(CPU *cpu, const Decoded *d, Address pc);
+void trace_flush(CPU *cpu, size_t nrecords);
+void trace_close(CPU *cpu);
+void replay_record(CPU *cpu, const TraceRecord *r);
+int decode_trace(CPU *cpu, char *trace_name);
+
+/* Snapshots */
+void snapshot_take(CPU *cpu, Snapshot *snap);
+int snapshot_restore(CPU *cpu, Snapshot *snap);
+int snapshot_save(Snapshot *snap, char *snap_name);
+int snapshot_load(Snapshot *snap, char *snap_name);
+void snapshot_command(Command *cmd, CPU *cpu);
+void start_from_snapshot(CPU *cpu, char *snap_name);
+int finish_snapshot(CPU *cpu, char *snap_name);
+
+/* Reverse execution */
+void history_init(CPU *cpu);
+void history_reset(CPU *cpu);
+void history_begin(CPU *cpu);
+void history_end(CPU *cpu);
+void history_store(CPU *cpu, Address addr);
+int history_getc(CPU *cpu);
+void history_checkpoint(CPU *cpu);
+void history_undo(CPU *cpu);
+int history_back(CPU *cpu, unsigned long nbr_cycles);
+unsigned long history_back_to_write(CPU *cpu, Address addr);
+void undo_command(char *cmd_buffer, CPU *cpu);
+
+/* Assembler */
+int assemble(Assembler *as, const char *text, size_t len, const char *name,
+             FILE *messages);
+void assembler_free(Assembler *as);
+int symbol_lookup(SymbolTable *table, const char *name, int len, int insert);
+int write_object(Assembler *as, char *obj_name);
+int write_symbols(Assembler *as, char *sym_name);
+int assemble_file(char *source_name, char *obj_name);
+
+/* Breakpoints and watchpoints */
+unsigned long debug_cycles(CPU *cpu, unsigned long nbr_cycles);
+Breakpoint *debug_match(CPU *cpu, Address addr, int kind);
+int instr_accesses(CPU *cpu, Address pc, Address addr[2], int access[2]);
+void debug_update_flags(Debug *debug);
+Breakpoint *debug_add(CPU *cpu, Address lo, Address hi, int kind);
+int parse_condition(char *text, Breakpoint *bp);
+void breakpoint_command(char *cmd_buffer, CPU *cpu);
+void continue_command(char *cmd_buffer, CPU *cpu);
+
+/* JIT */
+int jit_init(CPU *cpu);
+unsigned char *jit_translate(CPU *cpu, Address start);
+unsigned long jit_run(CPU *cpu, unsigned long nbr_cycles);
+void jit_flush(Jit *jit);
+void jit_free(Jit *jit);
+void jit_invalidate(Jit *jit, Address addr);
+
+/* Instruction cache */
+void decode_instr(Word ir, Decoded *d);
+void decode_entry(CPU *cpu, Address addr);
+void fuse_instr(CPU *cpu, Address addr);
+Decoded *fetch_decoded(CPU *cpu, Address addr);
+void flush_icache(CPU *cpu);
+void store_word(CPU *cpu, Address addr, Word value);
+void write_word(CPU *cpu, Address addr, Word value);
+Word device_read(CPU *cpu, Address addr);
+void device_write(CPU *cpu, Address addr, Word value);
+
+/* Interrupts */
+Word psr_read(CPU *cpu);
+void psr_write(CPU *cpu, Word psr);
+void interrupt_enter(CPU *cpu, int vector, int priority);
+void interrupt_check(CPU *cpu);
+void events_schedule(CPU *cpu);
+void events_run(CPU *cpu);
+void events_due(CPU *cpu);
 
 /* Condition Code */
 void generateCondition(CPU *cpu);
 void calculateCondition(int result, CPU *cpu);
 
 /* LC-3 instruction operations*/
-void add_instr(CPU *cpu);
-void and_instr(CPU *cpu);
-void not_instr(CPU *cpu);
-
-void load_instr(CPU *cpu);
-void ldr_instr(CPU *cpu);
-void ldi_instr(CPU *cpu);
-void lea_instr(CPU *cpu);
-
-void store_instr(CPU *cpu);
-void str_instr(CPU *cpu);
-void sti_instr(CPU *cpu);
-
-void branch_instr(CPU *cpu);
-void jump_instr(CPU *cpu);
-void jump_subr_instr(CPU *cpu);
-void trap_instr(CPU *cpu);
+void add_instr(CPU *cpu, const Decoded *d);
+void and_instr(CPU *cpu, const Decoded *d);
+void not_instr(CPU *cpu, const Decoded *d);
+
+void load_instr(CPU *cpu, const Decoded *d);
+void ldr_instr(CPU *cpu, const Decoded *d);
+void ldi_instr(CPU *cpu, const Decoded *d);
+void lea_instr(CPU *cpu, const Decoded *d);
+
+void store_instr(CPU *cpu, const Decoded *d);
+void str_instr(CPU *cpu, const Decoded *d);
+void sti_instr(CPU *cpu, const Decoded *d);
+
+void branch_instr(CPU *cpu, const Decoded *d);
+void jump_instr(CPU *cpu, const Decoded *d);
+void jump_subr_instr(CPU *cpu, const Decoded *d);
+void trap_instr(CPU *cpu, const Decoded *d);
+void rti_instr(CPU *cpu, const Decoded *d);
+void reserved_instr(CPU *cpu, const Decoded *d);
+
+/* Fused idioms, for the threaded loop */
+int const_fused(CPU *cpu, const Decoded *d);
+int negate_fused(CPU *cpu, const Decoded *d);
+int count_fused(CPU *cpu, const Decoded *d);
+int bump_fused(CPU *cpu, const Decoded *d);
 
 /* Manipulate CPU */
-int read_execute_command(CPU *cpu);
-void jump_command(char *cmd_buffer,CPU *cpu);
-void register_command(char *cmd_buffer,CPU *cpu);
-void memory_command(char *cmd_buffer, CPU *cpu);
-void halt_processor(CPU *cpu);
+int read_command(FILE *in, Command *cmd);
+int command_number(const char *word, unsigned long *value);
+int step_count(Command *cmd, unsigned long *nbr_cycles);
+void command_loop(CPU *cpu, FILE *in, int interactive);
+void jump_command(Command *cmd, CPU *cpu);
+void register_command(Command *cmd, CPU *cpu);
+void memory_command(Command *cmd, CPU *cpu);
+void halt_processor(CPU *cpu, int reason);
 
     
 int main(int argc, char *argv[])
 {
+    static CPU cpu_value;
+    CPU *cpu = &cpu_value;
+    Options opt;
+
+    parse_options(argc, argv, &opt);
+
+    if (opt.assemble != NULL)
+        return assemble_file(opt.assemble, opt.output);
+
     printf("LC-3 Simulator\n");
 
-    CPU cpu_value;
-    CPU *cpu = &cpu_value;
+    /* Batch: many programs at once, each on a cpu of its own */
+    if (opt.batch != NULL)
+        return batch_run(&opt);
+
+    /* Fuzz the loader with mutations of the program file */
+    if (opt.fuzz_loader)
+        return fuzz_loader(&opt);
 
-    /* Initialize everything */
+    /* Initialize everything; the command loop reads its commands
+     * from stdin too, unless they come from a script */
+    terminal_init(opt.input, !opt.run && opt.script == NULL);
     initialize_control_unit(cpu);
-    initialize_memory(argc, argv, cpu);
+    if (opt.snapshot != NULL)
+        start_from_snapshot(cpu, opt.snapshot);
+    else
+        initialize_memory(opt.datafile, cpu);
+    cpu->trace = opt.trace;
+
+    /* Offline: turn a recorded binary trace of this program into text */
+    if (opt.decode_trace != NULL)
+        return decode_trace(cpu, opt.decode_trace);
+
+    /* Fuzz the program with mutations of its input */
+    if (opt.fuzz > 0)
+        return fuzz_guest(cpu, &opt);
+
+    /* The program over many inputs, a gang of them at a time */
+    if (opt.vector != NULL)
+        return vector_run(cpu, &opt);
+
+    if (opt.trace_file != NULL)
+        trace_open(cpu, opt.trace_file);
+
+    /* Headless: run until the program halts and report how it ended */
+    if (opt.run) {
+        int status = opt.lockstep ? lockstep_run(cpu, &opt)
+                                  : run_program(cpu, &opt);
+        trace_close(cpu);
+        if (opt.dump != NULL &&
+            dump_to_file(cpu, opt.dump, 0, MEMLEN - 1, opt.dump_format))
+            status = EXIT_FAILURE;
+        if (opt.save_snapshot != NULL && finish_snapshot(cpu, opt.save_snapshot))
+            status = EXIT_FAILURE;
+        return status;
+    }
 
     /* Dump initial (clean) state */
     dump_control_unit(cpu);
     dump_memory(cpu);
 
+    /* Record everything executed from here on, so u can undo it */
+    history_init(cpu);
+
     /* Start accepting input */
-    char *prompt = "> ";
-    printf("Beginning execution; type h for help\n%s", prompt);
-    int done = read_execute_command(cpu);
-    while (!done) {
-         printf("\n%s", prompt);
-         done = read_execute_command(cpu);
+    if (opt.script != NULL) {
+        FILE *script = fopen(opt.script, "r");
+
+        if (script == NULL) {
+            printf("error: Could not open script %s\n", opt.script);
+            exit(EXIT_FAILURE);
+        }
+        command_loop(cpu, script, 0);
+        fclose(script);
+    } else {
+        printf("Beginning execution; type h for help\n");
+        command_loop(cpu, stdin, 1);
     }
 
+    stats_report(cpu);
+    trace_close(cpu);
+    if (opt.dump != NULL)
+        dump_to_file(cpu, opt.dump, 0, MEMLEN - 1, opt.dump_format);
+    if (opt.save_snapshot != NULL)
+        finish_snapshot(cpu, opt.save_snapshot);
     return 0;
 }
 
+/* Command line: [--run] [--trace=none|branches|full]
+ *               [--max-cycles N] [--trace-file FILE]
+ *               [--decode-trace FILE] [--jit] [--snapshot FILE]
+ *               [--save-snapshot FILE] [--batch MANIFEST]
+ *               [--results FILE] [--jobs N] [--input FILE] [--dump FILE]
+ *               [--dump-format text|hex|bin] [--script FILE]
+ *               [--lockstep[=N]] [--fuzz N | --fuzz-loader N]
+ *               [--fuzz-seed S] [--fuzz-out DIR] [--vector INPUTS]
+ *               [program.hex]
+ *               --assemble FILE.asm [-o FILE.obj] */
+void parse_options(int argc, char *argv[], Options *opt)
+{
+    int i;
+
+    opt->datafile = NULL;
+    opt->run = 0;
+    opt->trace = -1;
+    opt->max_cycles = 0;
+    opt->trace_file = NULL;
+    opt->decode_trace = NULL;
+    opt->jit = 0;
+    opt->snapshot = NULL;
+    opt->save_snapshot = NULL;
+    opt->batch = NULL;
+    opt->results = NULL;
+    opt->jobs = 0;
+    opt->assemble = NULL;
+    opt->output = NULL;
+    opt->input = NULL;
+    opt->dump = NULL;
+    opt->dump_format = DUMP_TEXT;
+    opt->script = NULL;
+    opt->lockstep = 0;
+    opt->fuzz = 0;
+    opt->fuzz_loader = 0;
+    opt->fuzz_seed = 1;
+    opt->fuzz_out = "fuzz-findings";
+    opt->vector = NULL;
+
+    for (i = 1; i < argc; i++) {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "--run") == 0) {
+            opt->run = 1;
+        } else if (strcmp(arg, "--trace=none") == 0) {
+            opt->trace = TRACE_NONE;
+        } else if (strcmp(arg, "--trace=branches") == 0) {
+            opt->trace = TRACE_BRANCHES;
+        } else if (strcmp(arg, "--trace=full") == 0) {
+            opt->trace = TRACE_FULL;
+        } else if (strcmp(arg, "--max-cycles") == 0 && i + 1 < argc) {
+            opt->max_cycles = strtoul(argv[++i], NULL, 0);
+        } else if (strncmp(arg, "--max-cycles=", 13) == 0) {
+            opt->max_cycles = strtoul(arg + 13, NULL, 0);
+        } else if (strcmp(arg, "--trace-file") == 0 && i + 1 < argc) {
+            opt->trace_file = argv[++i];
+        } else if (strncmp(arg, "--trace-file=", 13) == 0) {
+            opt->trace_file = arg + 13;
+        } else if (strcmp(arg, "--decode-trace") == 0 && i + 1 < argc) {
+            opt->decode_trace = argv[++i];
+        } else if (strncmp(arg, "--decode-trace=", 15) == 0) {
+            opt->decode_trace = arg + 15;
+        } else if (strcmp(arg, "--jit") == 0) {
+            opt->jit = 1;
+        } else if (strcmp(arg, "--snapshot") == 0 && i + 1 < argc) {
+            opt->snapshot = argv[++i];
+        } else if (strncmp(arg, "--snapshot=", 11) == 0) {
+            opt->snapshot = arg + 11;
+        } else if (strcmp(arg, "--save-snapshot") == 0 && i + 1 < argc) {
+            opt->save_snapshot = argv[++i];
+        } else if (strncmp(arg, "--save-snapshot=", 16) == 0) {
+            opt->save_snapshot = arg + 16;
+        } else if (strcmp(arg, "--batch") == 0 && i + 1 < argc) {
+            opt->batch = argv[++i];
+        } else if (strncmp(arg, "--batch=", 8) == 0) {
+            opt->batch = arg + 8;
+        } else if (strcmp(arg, "--results") == 0 && i + 1 < argc) {
+            opt->results = argv[++i];
+        } else if (strncmp(arg, "--results=", 10) == 0) {
+            opt->results = arg + 10;
+        } else if (strcmp(arg, "--jobs") == 0 && i + 1 < argc) {
+            opt->jobs = atoi(argv[++i]);
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            opt->jobs = atoi(arg + 7);
+        } else if (strcmp(arg, "--assemble") == 0 && i + 1 < argc) {
+            opt->assemble = argv[++i];
+        } else if (strncmp(arg, "--assemble=", 11) == 0) {
+            opt->assemble = arg + 11;
+        } else if (strcmp(arg, "--input") == 0 && i + 1 < argc) {
+            opt->input = argv[++i];
+        } else if (strncmp(arg, "--input=", 8) == 0) {
+            opt->input = arg + 8;
+        } else if (strcmp(arg, "--dump") == 0 && i + 1 < argc) {
+            opt->dump = argv[++i];
+        } else if (strncmp(arg, "--dump=", 7) == 0) {
+            opt->dump = arg + 7;
+        } else if (strcmp(arg, "--dump-format") == 0 && i + 1 < argc) {
+            if ((opt->dump_format = dump_format(argv[++i])) < 0)
+                usage(argv[0]);
+        } else if (strncmp(arg, "--dump-format=", 14) == 0) {
+            if ((opt->dump_format = dump_format(arg + 14)) < 0)
+                usage(argv[0]);
+        } else if (strcmp(arg, "--script") == 0 && i + 1 < argc) {
+            opt->script = argv[++i];
+        } else if (strncmp(arg, "--script=", 9) == 0) {
+            opt->script = arg + 9;
+        } else if (strcmp(arg, "--lockstep") == 0) {
+            opt->run = 1;
+            opt->lockstep = 1;
+        } else if (strncmp(arg, "--lockstep=", 11) == 0) {
+            opt->run = 1;
+            if ((opt->lockstep = strtoul(arg + 11, NULL, 0)) == 0)
+                usage(argv[0]);
+        } else if (strcmp(arg, "--fuzz") == 0 && i + 1 < argc) {
+            opt->fuzz = strtoul(argv[++i], NULL, 0);
+        } else if (strncmp(arg, "--fuzz=", 7) == 0) {
+            opt->fuzz = strtoul(arg + 7, NULL, 0);
+        } else if (strcmp(arg, "--fuzz-loader") == 0 && i + 1 < argc) {
+            opt->fuzz_loader = 1;
+            opt->fuzz = strtoul(argv[++i], NULL, 0);
+        } else if (strncmp(arg, "--fuzz-loader=", 14) == 0) {
+            opt->fuzz_loader = 1;
+            opt->fuzz = strtoul(arg + 14, NULL, 0);
+        } else if (strcmp(arg, "--fuzz-seed") == 0 && i + 1 < argc) {
+            opt->fuzz_seed = strtoul(argv[++i], NULL, 0);
+        } else if (strncmp(arg, "--fuzz-seed=", 12) == 0) {
+            opt->fuzz_seed = strtoul(arg + 12, NULL, 0);
+        } else if (strcmp(arg, "--fuzz-out") == 0 && i + 1 < argc) {
+            opt->fuzz_out = argv[++i];
+        } else if (strncmp(arg, "--fuzz-out=", 11) == 0) {
+            opt->fuzz_out = arg + 11;
+        } else if (strcmp(arg, "--vector") == 0 && i + 1 < argc) {
+            opt->vector = argv[++i];
+        } else if (strncmp(arg, "--vector=", 9) == 0) {
+            opt->vector = arg + 9;
+        } else if (strcmp(arg, "-o") == 0 && i + 1 < argc) {
+            opt->output = argv[++i];
+        } else if (arg[0] == '-' || opt->datafile != NULL) {
+            usage(argv[0]);
+        } else {
+            opt->datafile = arg;
+        }
+    }
+
+    /* The command loop traces everything, a headless run nothing */
+    if (opt->trace == -1)
+        opt->trace = opt->run ? TRACE_NONE : TRACE_FULL;
+}
+
+void usage(char *name)
+{
+    printf("usage: %s [--run] [--trace=none|branches|full] "
+           "[--max-cycles N]\n"
+           "          [--trace-file FILE] [--decode-trace FILE] [--jit]\n"
+           "          [--snapshot FILE] [--save-snapshot FILE] "
+           "[program.hex|.obj|.asm]\n"
+           "          [--input FILE] [--dump FILE] "
+           "[--dump-format text|hex|bin] [--script FILE]\n"
+           "          [--lockstep[=N]]\n"
+           "       %s --fuzz N|--fuzz-loader N [--fuzz-seed S] "
+           "[--fuzz-out DIR] [--input FILE]\n"
+           "          [--max-cycles N] program.hex|.obj|.asm\n"
+           "       %s --batch MANIFEST [--results FILE] [--jobs N] "
+           "[--max-cycles N] [--jit]\n"
+           "       %s --vector INPUTS [--results FILE] [--max-cycles N] "
+           "program.hex|.obj|.asm\n"
+           "       %s --assemble FILE.asm [-o FILE.obj]\n",
+           name, name, name, name, name);
+    exit(EXIT_FAILURE);
+}
+
 /* Calculate cc from previous result */
 void calculateCondition(int result, CPU *cpu)
 {
@@ -140,6 +1143,30 @@ void initialize_control_unit(CPU *cpu)
     cpu->ir = 0;
     cpu->running = 1;
     cpu->cc = 2;
+    cpu->halt_reason = HALT_NONE;
+    cpu->cycles = 0;
+    cpu->trace = TRACE_FULL;
+    cpu->tracing = 0;
+    cpu->ea = 0;
+    cpu->trace_ring = NULL;
+    cpu->trace_count = 0;
+    cpu->trace_file = NULL;
+    cpu->jit = NULL;
+    memset(cpu->dirty, 0, sizeof(cpu->dirty));
+    cpu->snap_base = NULL;
+    cpu->snapshot = NULL;
+    cpu->console = NULL;
+    cpu->messages = NULL;
+    cpu->history = NULL;
+    cpu->debug = NULL;
+    cpu->status.user = 1;
+    cpu->status.priority = 0;
+    cpu->status.saved_ssp = SSP_INITIAL;
+    cpu->status.saved_usp = 0;
+    cpu->status.timer_next = ULONG_MAX;
+    cpu->status.timer_reload = 0;
+    cpu->next_event = ULONG_MAX;
+    cpu->stop = 0;
     
     int i;
     for(i = 0; i < NREG; i++)
@@ -147,65 +1174,291 @@ void initialize_control_unit(CPU *cpu)
 }
 
 /* init: populate memory and set PC to the start of the program */
-void initialize_memory(int argc, char *argv[], CPU *cpu)
+void initialize_memory(char *datafile_name, CPU *cpu)
 {
-    FILE *datafile = get_datafile(argc, argv);
+    FILE *datafile = get_datafile(datafile_name);
+    struct timespec start, end;
+    size_t len;
+    int mapped, words;
+    double secs;
+    char *text;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    text = map_datafile(datafile, &len, &mapped);
+    if (text == NULL) {
+        printf("error: Could not read %s\n", datafile_name);
+        exit(EXIT_FAILURE);
+    }
 
-    int value_read, words_read, loc = 0, done = 0;
+    words = load_program(cpu, text, len, datafile_name);
+    unmap_datafile(text, len, mapped);
+    fclose(datafile);
+    if (words < 0)
+        exit(EXIT_FAILURE);
 
-    char *buffer = NULL;
-    size_t buffer_len = 0, bytes_read = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Loaded %d words (%lu bytes) in %.3f ms, %.1f MB/s\n\n",
+           words, (unsigned long) len, secs * 1e3,
+           secs > 0 ? len / secs / 1e6 : 0.0);
+}
 
+/* The whole data file in memory: mmap'd if possible, read into a
+ * malloc'd buffer otherwise (pipes, empty files) */
+char *map_datafile(FILE *datafile, size_t *len, int *mapped)
+{
+    struct stat st;
+    char *text = NULL;
+    size_t size = 0, cap = 0, n;
+
+    if (fstat(fileno(datafile), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                    fileno(datafile), 0);
+        if (text != MAP_FAILED) {
+            *len = st.st_size;
+            *mapped = 1;
+            return text;
+        }
+        text = NULL;
+    }
+
+    *mapped = 0;
+    do {
+        if (size == cap) {
+            char *bigger = realloc(text, cap = cap ? 2 * cap : 65536);
+            if (bigger == NULL) {
+                free(text);
+                return NULL;
+            }
+            text = bigger;
+        }
+        n = fread(text + size, 1, cap - size, datafile);
+        size += n;
+    } while (n > 0);
+
+    *len = size;
+    return text;
+}
+
+void unmap_datafile(char *text, size_t len, int mapped)
+{
+    if (mapped)
+        munmap(text, len);
+    else
+        free(text);
+}
+
+/* Value of each character as a hex digit, 0xFF if it isn't one */
+static unsigned char hex_digit[256];
 
-    /* First line of the data file, contains the beginning (origin)
-     * of the program. Start populating memory from that location
-     * and also update the PC to point there */
-    bytes_read = getline(&buffer, &buffer_len, datafile); 
-    words_read = sscanf(buffer,"%x",&value_read);
-    loc = value_read;
-    cpu->pc = value_read;
-    cpu->origin = value_read;
+void init_hex_digits(void)
+{
+    int c;
 
-    /* Fetch first instruction */
-    bytes_read = getline(&buffer, &buffer_len, datafile);
-    while (bytes_read != -1 && !done) {
+    memset(hex_digit, 0xFF, sizeof(hex_digit));
+    for (c = '0'; c <= '9'; c++)
+        hex_digit[c] = c - '0';
+    for (c = 'A'; c <= 'F'; c++)
+        hex_digit[c] = hex_digit[c + 'a' - 'A'] = c - 'A' + 10;
+}
 
-        /* Scan for integer (in hexadecimal format) */
-        words_read = sscanf(buffer, "%x", &value_read);
+/* Four hex digits at p (already checked) to their value, all at
+ * once: each byte becomes its nibble ('0'-'9' keep their low bits,
+ * letters get 9 added) and the nibbles are then packed together */
+static unsigned int hex4(const unsigned char *p)
+{
+    unsigned int v = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
 
-        /* If beginning was not an integer (junk) discard it and go on
-         * else populate memory location and advance to the next one */
-        if (words_read == 0 || words_read == -1) {
-            bytes_read = getline(&buffer, &buffer_len, datafile);
-            continue;
+    v = (v & 0x0F0F0F0F) + 9 * ((v >> 6) & 0x01010101);
+    v = ((v & 0x000F000F) << 4) | ((v >> 8) & 0x000F000F);
+    return (v & 0xFF) << 8 | ((v >> 16) & 0xFF);
+}
+
+/* Parse a hex image: one word per line, the first one being the
+ * origin. Words may be written as 3000, x3000 or 0x3000; blank lines
+ * and anything after ';' or '#' are ignored. Fills cpu->mem from
+ * the origin, zeroes the rest and sets pc/origin. Returns the number
+ * of words loaded, or -1 after printing name:line: what's wrong */
+int load_image(CPU *cpu, const char *text, size_t len, const char *name)
+{
+    const unsigned char *p = (const unsigned char *) text;
+    const unsigned char *end = p + len;
+    FILE *out = cpu->messages ? cpu->messages : stdout;
+    int line = 1, loc = -1, origin = 0;
+
+    if (hex_digit[0] == 0)
+        init_hex_digits();
+
+    while (p < end) {
+        const unsigned char *digits;
+        unsigned int value;
+        int ndigits;
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+
+        /* Blank or comment-only line */
+        if (p == end || *p == '\n' || *p == ';' || *p == '#')
+            goto next_line;
+
+        if (*p == '0' && end - p > 2 && (p[1] == 'x' || p[1] == 'X') &&
+            hex_digit[p[2]] < 16)
+            p += 2;
+        else if ((*p == 'x' || *p == 'X') && end - p > 1 &&
+                 hex_digit[p[1]] < 16)
+            p++;
+
+        digits = p;
+        if (end - p >= 4 && hex_digit[p[0]] < 16 && hex_digit[p[1]] < 16 &&
+            hex_digit[p[2]] < 16 && hex_digit[p[3]] < 16) {
+            value = hex4(p);
+            p += 4;
+        } else {
+            value = 0;
+        }
+        for (; p < end && hex_digit[*p] < 16; p++)
+            if (value <= 0xFFFF)
+                value = value << 4 | hex_digit[*p];
+        ndigits = p - digits;
+
+        if (ndigits == 0) {
+            fprintf(out, "%s:%d: error: expected a hex word, found '%c'\n",
+                    name, line, *p);
+            return -1;
+        }
+        if (value > 0xFFFF) {
+            fprintf(out, "%s:%d: error: %.*s does not fit in 16 bits\n",
+                    name, line, ndigits, (const char *) digits);
+            return -1;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        if (p < end && *p != '\n' && *p != ';' && *p != '#') {
+            fprintf(out, "%s:%d: error: unexpected '%c' after %.*s\n",
+                    name, line, *p, ndigits, (const char *) digits);
+            return -1;
+        }
+
+        if (loc < 0) {
+            origin = loc = value;
+        } else if (loc == MEMLEN) {
+            fprintf(out, "%s:%d: error: program runs past the end of "
+                    "memory\n", name, line);
+            return -1;
         } else {
-            cpu->mem[loc++] = value_read;
-            bytes_read = getline(&buffer, &buffer_len, datafile);
+            cpu->mem[loc++] = value;
         }
+
+    next_line:
+        p = memchr(p, '\n', end - p);
+        if (p == NULL)
+            break;
+        p++;
+        line++;
     }
 
-    /* buffer is not needed any more */
-    free(buffer);
-    
-    /* zero-out the rest of the memory */
-    while (loc < MEMLEN) {
-        cpu -> mem[loc++] = 0;
+    if (loc < 0) {
+        fprintf(out, "%s: error: no origin, the file is empty\n", name);
+        return -1;
+    }
+
+    image_loaded(cpu, origin, loc);
+    return loc - origin;
+}
+
+/* Parse a binary .obj image: big-endian words, the first one being
+ * the origin. Returns the number of words loaded, or -1 */
+int load_object(CPU *cpu, const char *text, size_t len, const char *name)
+{
+    const unsigned char *p = (const unsigned char *) text;
+    FILE *out = cpu->messages ? cpu->messages : stdout;
+    int origin, n, i;
+
+    if (len < 2 || len % 2 != 0) {
+        fprintf(out, "%s: error: not an object file (%lu bytes)\n",
+                name, (unsigned long) len);
+        return -1;
+    }
+
+    origin = p[0] << 8 | p[1];
+    n = len / 2 - 1;
+    if (origin + n > MEMLEN) {
+        fprintf(out, "%s: error: program runs past the end of memory\n",
+                name);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+        cpu->mem[origin + i] = p[2 * i + 2] << 8 | p[2 * i + 3];
+
+    image_loaded(cpu, origin, origin + n);
+    return n;
+}
+
+/* Assemble LC-3 source straight into memory. Returns the number of
+ * words loaded, or -1 after printing the errors */
+int load_source(CPU *cpu, const char *text, size_t len, const char *name)
+{
+    Assembler as;
+    int n = -1;
+
+    if (assemble(&as, text, len, name,
+                 cpu->messages ? cpu->messages : stdout) == 0) {
+        n = as.end - as.origin;
+        memcpy(cpu->mem + as.origin, as.image, n * sizeof(Word));
+        image_loaded(cpu, as.origin, as.end);
     }
+
+    assembler_free(&as);
+    return n;
+}
+
+/* Load a program by its extension: .obj is binary, .asm source and
+ * anything else a hex image. What's wrong with it, if anything, is
+ * printed to cpu->messages */
+int load_program(CPU *cpu, const char *text, size_t len, const char *name)
+{
+    const char *dot = strrchr(name, '.');
+
+    if (dot != NULL && strcmp(dot, ".obj") == 0)
+        return load_object(cpu, text, len, name);
+    if (dot != NULL && strcmp(dot, ".asm") == 0)
+        return load_source(cpu, text, len, name);
+    return load_image(cpu, text, len, name);
+}
+
+/* A new image now fills origin..end-1: zero the rest of memory and
+ * start from its origin */
+void image_loaded(CPU *cpu, int origin, int end)
+{
+    memset(cpu->mem, 0, origin * sizeof(Word));
+    memset(cpu->mem + end, 0, (MEMLEN - end) * sizeof(Word));
+    cpu->pc = origin;
+    cpu->origin = origin;
+
+    /* Every page differs from any snapshot taken before the load */
+    memset(cpu->dirty, 0xFF, sizeof(cpu->dirty));
+
+    /* Nothing has been decoded from the new image yet */
+    flush_icache(cpu);
+
+    /* The device registers were cleared with the rest */
+    cpu->status.timer_next = ULONG_MAX;
+    events_schedule(cpu);
 }
 
-FILE *get_datafile(int argc, char *argv[])
+FILE *get_datafile(char *datafile_name)
 {
     char *default_datafile_name = "program.hex";
-    char *datafile_name;
 
     /* if a datafile is not provided, use the default. */
-    if(argv[1] != NULL) {
-        datafile_name = argv[1];
-    } else {
+    if(datafile_name == NULL) {
         datafile_name = default_datafile_name;
     }   
 
-    printf("Loading %s\n\n", datafile_name);
+    printf("Loading %s\n", datafile_name);
 
     FILE *datafile = fopen(datafile_name, "r");
     if (datafile == NULL) {
@@ -221,48 +1474,303 @@ void dump_control_unit(CPU *cpu)
 {
     printf("CONTROL UNIT:\n");
     generateCondition(cpu);
-    printf("PC: x%4X\tIR: %#4X\tCC: %c\tRUNNING: %d\n",
-           cpu->pc, cpu->ir, cpu->condition, cpu->running);
+    printf("PC: x%04X\tIR: x%04X\tCC: %c\tRUNNING: %d\n",
+           cpu->pc, (Address) cpu->ir, cpu->condition, cpu->running);
     dump_registers(cpu); 
 }
 
 void dump_memory(CPU *cpu)
 {
     printf("MEMORY (addresses x0000 - xFFFF):\n");
+    dump_to_file(cpu, NULL, 0, MEMLEN - 1, DUMP_TEXT);
+    printf("\n");
+}
 
-    int loc = cpu->origin;
+/* Write all of buf to fd. Returns 0, or -1 if it could not */
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static const char upper_hex[] = "0123456789ABCDEF";
+static const char lower_hex[] = "0123456789abcdef";
+
+/* xNNNN, the way every dump prints addresses and words */
+static char *put_word(char *p, unsigned int w)
+{
+    *p++ = 'x';
+    *p++ = upper_hex[(w >> 12) & 0xF];
+    *p++ = upper_hex[(w >> 8) & 0xF];
+    *p++ = upper_hex[(w >> 4) & 0xF];
+    *p++ = upper_hex[w & 0xF];
+    return p;
+}
 
-    while(cpu->mem[loc] != 0) {
+static char *put_decimal(char *p, long v)
+{
+    char digits[24];
+    int n = 0;
 
-        if (cpu->mem[loc] < 0) {
-            int x = 65535;
-            x = (x & cpu->mem[loc]);
+    if (v < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
 
-            printf("x%4X: x%04X\t%d\n",
-                   loc, x, cpu->mem[loc]);
+/* One line of hexdump -C: 8 words (16 bytes) from addr, big endian */
+static char *put_hex_line(char *p, CPU *cpu, int addr, int nwords)
+{
+    unsigned int offset = addr * 2;
+    int i, shift;
+
+    for (shift = 28; shift >= 0; shift -= 4)
+        *p++ = lower_hex[(offset >> shift) & 0xF];
+    *p++ = ' ';
+
+    for (i = 0; i < 16; i++) {
+        if (i % 8 == 0)
+            *p++ = ' ';
+        if (i < nwords * 2) {
+            Address w = cpu->mem[addr + i / 2];
+            unsigned int b = i % 2 ? w & 0xFF : w >> 8;
+            *p++ = lower_hex[b >> 4];
+            *p++ = lower_hex[b & 0xF];
         } else {
-            printf("x%4x: x%04X\t%d\n",
-                   loc, cpu->mem[loc], cpu->mem[loc]);
+            *p++ = ' ';
+            *p++ = ' ';
         }
-        loc++;
+        *p++ = ' ';
     }
-    printf("\n");
+
+    *p++ = ' ';
+    *p++ = '|';
+    for (i = 0; i < nwords * 2; i++) {
+        Address w = cpu->mem[addr + i / 2];
+        unsigned int b = i % 2 ? w & 0xFF : w >> 8;
+        *p++ = b >= 0x20 && b < 0x7F ? b : '.';
+    }
+    *p++ = '|';
+    *p++ = '\n';
+    return p;
+}
+
+/* Dump words lo..hi of memory to fd, formatted into one buffer and
+ * written with a single write:
+ *   DUMP_TEXT    xADDR: xWORD decimal, a run of zeros on one line
+ *   DUMP_HEX     hexdump -C of the words as big-endian bytes, offsets
+ *                being byte addresses (2 * the word address)
+ *   DUMP_BINARY  a .obj: lo, then every word, big endian
+ * Returns 0, or -1 if it could not be written */
+int dump_range(CPU *cpu, int fd, int lo, int hi, int format)
+{
+    int n = hi - lo + 1, addr, status;
+    size_t size;
+    char *buf, *p;
+
+    switch (format) {
+    case DUMP_HEX:
+        size = (n / 8 + 3) * 80;
+        break;
+    case DUMP_BINARY:
+        size = (n + 1) * 2;
+        break;
+    default:
+        size = n * 20 + 64;
+        break;
+    }
+    buf = malloc(size);
+    if (buf == NULL)
+        return -1;
+    p = buf;
+
+    if (format == DUMP_BINARY) {
+        *p++ = lo >> 8;
+        *p++ = lo & 0xFF;
+        for (addr = lo; addr <= hi; addr++) {
+            *p++ = (Address) cpu->mem[addr] >> 8;
+            *p++ = cpu->mem[addr] & 0xFF;
+        }
+    } else if (format == DUMP_HEX) {
+        int folded = 0;
+
+        /* Like hexdump, a line repeating the one before is a '*' */
+        for (addr = lo; addr <= hi; addr += 8) {
+            int nwords = hi - addr + 1 < 8 ? hi - addr + 1 : 8;
+
+            if (addr > lo && nwords == 8 &&
+                memcmp(&cpu->mem[addr], &cpu->mem[addr - 8],
+                       8 * sizeof(Word)) == 0) {
+                if (!folded) {
+                    *p++ = '*';
+                    *p++ = '\n';
+                    folded = 1;
+                }
+                continue;
+            }
+            folded = 0;
+            p = put_hex_line(p, cpu, addr, nwords);
+        }
+        for (addr = 28; addr >= 0; addr -= 4)
+            *p++ = lower_hex[((hi + 1) * 2 >> addr) & 0xF];
+        *p++ = '\n';
+    } else {
+        for (addr = lo; addr <= hi; addr++) {
+            int end = addr;
+
+            while (end < hi && cpu->mem[addr] == 0 && cpu->mem[end + 1] == 0)
+                end++;
+            p = put_word(p, addr);
+            if (end > addr) {
+                *p++ = '-';
+                p = put_word(p, end);
+                *p++ = ':';
+                *p++ = ' ';
+                p = put_decimal(p, end - addr + 1);
+                memcpy(p, " zero words\n", 12);
+                p += 12;
+                addr = end;
+                continue;
+            }
+            *p++ = ':';
+            *p++ = ' ';
+            p = put_word(p, (Address) cpu->mem[addr]);
+            *p++ = '\t';
+            p = put_decimal(p, cpu->mem[addr]);
+            *p++ = '\n';
+        }
+    }
+
+    status = write_all(fd, buf, p - buf);
+    free(buf);
+    return status;
+}
+
+/* The format called name, -1 if there's none */
+int dump_format(const char *name)
+{
+    if (strcmp(name, "text") == 0)
+        return DUMP_TEXT;
+    if (strcmp(name, "hex") == 0)
+        return DUMP_HEX;
+    if (strcmp(name, "bin") == 0)
+        return DUMP_BINARY;
+    return -1;
+}
+
+/* Dump lo..hi to the file called name (stdout if NULL or "-").
+ * Returns 0, or -1 after saying why not */
+int dump_to_file(CPU *cpu, char *name, int lo, int hi, int format)
+{
+    int fd = STDOUT_FILENO, status;
+
+    if (name != NULL && strcmp(name, "-") == 0)
+        name = NULL;
+    if (name != NULL) {
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            printf("error: Could not open file %s\n", name);
+            return -1;
+        }
+    } else {
+        fflush(stdout);
+    }
+
+    status = dump_range(cpu, fd, lo, hi, format);
+    if (name != NULL && close(fd) != 0)
+        status = -1;
+    if (status != 0)
+        printf("error: Could not write the dump to %s\n",
+               name != NULL ? name : "stdout");
+    return status;
+}
+
+/* d [xLO [xHI]] [text|hex|bin] [FILE]: dump a location or range (all
+ * of memory by default) to the terminal or FILE. d alone also shows
+ * the control unit */
+void dump_command(Command *cmd, CPU *cpu)
+{
+    unsigned long addr[2], value;
+    int naddr = 0, format = -1, i;
+    char *file = NULL;
+
+    for (i = 1; i < cmd->nwords; i++) {
+        char *word = i < MAX_WORDS ? cmd->word[i] : "";
+
+        if (naddr < 2 && format < 0 && file == NULL && word[0] == 'x' &&
+            command_number(word, &value) == 0) {
+            addr[naddr++] = value;
+        } else if (format < 0 && file == NULL && dump_format(word) >= 0) {
+            format = dump_format(word);
+        } else if (file == NULL && word[0] != '\0') {
+            file = word;
+        } else {
+            printf("Dump command should be d [xLO [xHI]] [text|hex|bin] "
+                   "[FILE]\n");
+            return;
+        }
+    }
+
+    if (naddr == 0) {
+        addr[0] = 0;
+        addr[1] = MEMLEN - 1;
+    } else if (naddr == 1) {
+        addr[1] = addr[0];
+    }
+    if (addr[0] > addr[1] || addr[1] >= MEMLEN) {
+        printf("Bad address range x%lX-x%lX\n", addr[0], addr[1]);
+        return;
+    }
+    if (format < 0)
+        format = DUMP_TEXT;
+    if (format == DUMP_BINARY && file == NULL) {
+        printf("A binary dump needs a FILE\n");
+        return;
+    }
+
+    if (naddr == 0 && format == DUMP_TEXT && file == NULL) {
+        dump_control_unit(cpu);
+        dump_memory(cpu);
+        return;
+    }
+    if (dump_to_file(cpu, file, addr[0], addr[1], format) == 0 && file != NULL)
+        printf("Dumped x%04lX-x%04lX to %s\n", addr[0], addr[1], file);
 }
 
 void dump_registers(CPU *cpu)
 {
     int i;
     for(i = 0; i < NREG/2; i++)
-        printf("R%d: %x \t", i, cpu->reg[i]);
+        printf("R%d: x%04X \t", i, (Address) cpu->reg[i]);
     printf("\n");
 
     for(i = NREG/2; i < NREG; i++)
-        printf("R%d: %x \t", i, cpu->reg[i]); 
+        printf("R%d: x%04X \t", i, (Address) cpu->reg[i]);
     printf("\n\n");
 }
 
-int execute_command(char *cmd_buffer, char cmd_char, CPU *cpu)
+/* Run the command in cmd (not a step command). Returns 1 for q */
+int execute_command(Command *cmd, CPU *cpu)
 {
+    /* For the commands that parse the line themselves: the line from
+     * its first word on, text being a copy of line */
+    char *cmd_buffer = cmd->line + (cmd->word[0] - cmd->text);
+    char cmd_char = cmd->word[0][0];
+
     switch(cmd_char) {
     case '?':
     case 'h':
@@ -271,8 +1779,7 @@ int execute_command(char *cmd_buffer, char cmd_char, CPU *cpu)
             break;
 
     case 'd':
-            dump_control_unit(cpu);
-            dump_memory(cpu);
+            dump_command(cmd, cpu);
             return 0;
             break;
 
@@ -282,15 +1789,43 @@ int execute_command(char *cmd_buffer, char cmd_char, CPU *cpu)
             break;
 
     case 'j':
-            jump_command(cmd_buffer, cpu);           
+            jump_command(cmd, cpu);
+            history_reset(cpu);
             break;
 
     case 'r':
-            register_command(cmd_buffer,cpu);
+            register_command(cmd, cpu);
+            history_reset(cpu);
             break;
 
     case 'm':
-            memory_command(cmd_buffer,cpu);
+            memory_command(cmd, cpu);
+            history_reset(cpu);
+            break;
+
+    case 's':
+    case 'l':
+            snapshot_command(cmd, cpu);
+            if (cmd_char == 'l')
+                history_reset(cpu);
+            break;
+
+    case 'u':
+            undo_command(cmd_buffer, cpu);
+            break;
+
+    case 'b':
+    case 'w':
+    case 'x':
+            breakpoint_command(cmd_buffer, cpu);
+            break;
+
+    case 'c':
+            continue_command(cmd_buffer, cpu);
+            break;
+
+    case 'p':
+            stats_command(cmd_buffer, cpu);
             break;
     default: 
             printf("Invalid command");
@@ -303,582 +1838,5647 @@ int execute_command(char *cmd_buffer, char cmd_char, CPU *cpu)
 void help_message(void)
 {
     printf("Choose from the following menu\n");
-    printf("d: dump control unit\n");
+    printf("d: dump control unit and memory\n");
+    printf("d xNNNN [xMMMM] [text|hex|bin] [file] to dump a range\n");
     printf("q: quit the program \n");
     printf("j xNNNN to jump to a new location\n");
-    printf("m XNNNN XMMMM to assign memory location xMMMMM tox NNNN\n");
+    printf("r rN xNNNN to set register N\n");
+    printf("m xNNNN xMMMM to store xMMMM at location xNNNN\n");
+    printf("s [file] to take a snapshot (and save it to file)\n");
+    printf("l [file] to go back to the snapshot (or the one in file)\n");
+    printf("u [N] to step back N instructions (default 1)\n");
+    printf("u w xNNNN to go back to the last write of location xNNNN\n");
+    printf("b xNNNN [if RN OP VALUE] to break at xNNNN (b alone lists)\n");
+    printf("w xNNNN [xMMMM] [r|w|rw] to watch a location or range\n");
+    printf("x [N] to delete breakpoint N (or all of them)\n");
+    printf("c [N] to run until a breakpoint or halt (at most N cycles)\n");
+    printf("p [r] to show the performance counters (r: and reset them)\n");
     printf("a number to run the amount of instruction cycles \n");
     printf("or a return to execute one cycle\n");
+    printf("(numbers are xNNNN in hex, #N or N in decimal)\n");
 }
 
-int read_execute_command(CPU *cpu)
+/* Read a command line from in into cmd and split it into words.
+ * Returns the number of words, or -1 at the end of the input */
+int read_command(FILE *in, Command *cmd)
 {
-    int done = 0, nbr_cycles;
-    char *cmd_buffer = NULL;
-    size_t cmd_buffer_len = 0, bytes_read = 0;
-
-    char cmd_char;
-    size_t words_read;
+    ssize_t len = getline(&cmd->line, &cmd->line_cap, in);
+    char *p;
 
-    /* Get user input */
-    bytes_read = getline(&cmd_buffer, &cmd_buffer_len, stdin);
+    if (len < 0)
+        return -1;
 
-    /* Did we get an end-of-file? (Ctrl + D from user keyboard) */
-    if (bytes_read == -1)
-        done = 1;
+    if (cmd->text_cap < (size_t) len + 1) {
+        char *bigger = realloc(cmd->text, len + 1);
 
-    words_read = sscanf(cmd_buffer, "%d", &nbr_cycles);
-
-    /* If a char was read then try to execute the according
-     * command, else if an integer was entered, try to
-     * execute this number of cycles */
-    if (words_read == 0) {
-            sscanf(cmd_buffer,"%c", &cmd_char); 
-            done = execute_command(cmd_buffer, cmd_char, cpu);
-    } else {
-
-        /* If just a newline or 1, execute one instruction,
-         * else check if the number is out of bounds,
-         * if not execute multiple instructions as specified */
-        if (strcmp(cmd_buffer, "\n") == 0) {
-            one_instruction_cycle(cpu);
-        } else if (nbr_cycles < 1 || nbr_cycles > MEMLEN
-                                  || nbr_cycles >(MEMLEN-(cpu->pc))) {
-            printf("%d is an invalid number of cycles!!", nbr_cycles);
-        } else if (nbr_cycles == 1) {  
-            one_instruction_cycle(cpu);
-        } else {
-            manyInstructionCycles(cpu, nbr_cycles);
+        if (bigger == NULL) {
+            printf("error: Out of memory reading commands\n");
+            exit(EXIT_FAILURE);
         }
+        cmd->text = bigger;
+        cmd->text_cap = len + 1;
     }
+    memcpy(cmd->text, cmd->line, len + 1);
 
-    /* Command buffer not needed anymore */
-    free(cmd_buffer);
+    cmd->nwords = 0;
+    for (p = cmd->text; ; ) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        if (cmd->nwords < MAX_WORDS)
+            cmd->word[cmd->nwords] = p;
+        cmd->nwords++;
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        if (*p != '\0')
+            *p++ = '\0';
+    }
 
-    return done;
+    return cmd->nwords;
 }
 
-void one_instruction_cycle(CPU *cpu)
+/* A number in a command: xNNNN in hex, #N or N in decimal. Returns 0,
+ * or -1 if word is anything else */
+int command_number(const char *word, unsigned long *value)
 {
-    /* Check if program is running */
-    if (cpu->running == 0) {
-        printf("halted!\n");
-        return;
+    char *end;
+    int base = 10;
+
+    if (*word == 'x' || *word == 'X') {
+        word++;
+        base = 16;
+    } else if (*word == '#') {
+        word++;
     }
+    if (!isxdigit((unsigned char) *word))
+        return -1;
 
-   /* Check if PC is out of range */ 
-   if (cpu->pc >= MEMLEN) {
-       printf("Program counter out of range");
-       cpu->running = 0;
-   }
+    *value = strtoul(word, &end, base);
+    return *end == '\0' ? 0 : -1;
+}
 
-   /* Fetch instruction from the memory
-    * to the instruction register, get the opcode
-    * and then try to execute instruction */
-    cpu -> ir = cpu->mem[cpu->pc++];
-    printf("x%04X: x%04X ", (cpu->pc-1), (cpu->ir & 0xffff));
-    cpu->opcode = (cpu->ir & (0xF000)) >> 12;
-
-    switch(cpu->opcode) {
-    /* BRANCH */
-    case 0x0: branch_instr(cpu); break;
-    /* ADD */
-    case 0x1: add_instr(cpu); break;
-    /* LOAD */
-    case 0x2: load_instr(cpu); break;
-    /* STORE */
-    case 0x3: store_instr(cpu); break;
-    /* JSRR */
-    case 0x4: jump_subr_instr(cpu); break;
-    /* AND */
-    case 0x5: and_instr(cpu); break;
-    /* LDR */
-    case 0x6: ldr_instr(cpu); break;
-    /* STR */
-    case 0x7: str_instr(cpu); break;
-    /* RTI */
-    case 0x8: {
-        printf("unsupported \"RTI\" halting...");
-        halt_processor(cpu);         
-    }   break;
-    /* NOT */
-    case 0x9: not_instr(cpu); break;
-    /* LDI */
-    case 0xA: ldi_instr(cpu); break;
-    /* STI */
-    case 0xB: sti_instr(cpu); break;
-    /* JMP */
-    case 0xC: jump_instr(cpu); break;
-    /* ERR */
-    case 0xD: {
-        printf("unsupported \"err\" halting...");
-        halt_processor(cpu);
-    }   break;
-    /* LEA */
-    case 0xE: lea_instr(cpu); break;
-    /* TRAP */
-    case 0xF: trap_instr(cpu); break;
-    /* Unrecognized */
-    default:
-        printf("Sorry, opcode not recognized");
-        break;
+/* Is cmd a step command (an empty line or a number of instructions)?
+ * Returns 1 and the count in *nbr_cycles if so, 0 for a count out of
+ * range once it's been reported, and -1 for any other command */
+int step_count(Command *cmd, unsigned long *nbr_cycles)
+{
+    if (cmd->nwords == 0) {
+        *nbr_cycles = 1;
+        return 1;
     }
-}
+    if (cmd->nwords != 1 || !isdigit((unsigned char) cmd->word[0][0]) ||
+        command_number(cmd->word[0], nbr_cycles) != 0)
+        return -1;
 
-void manyInstructionCycles(CPU *cpu, int nbr_cycles)
-{   
-    int i;
-    for (i = 0; i < nbr_cycles; i++) {
-        one_instruction_cycle(cpu);
-        printf("\n");
+    if (*nbr_cycles < 1 || *nbr_cycles > MEMLEN) {
+        printf("%s is an invalid number of cycles!!", cmd->word[0]);
+        return 0;
     }
+    return 1;
 }
 
-void branch_instr(CPU *cpu)
+/* Read and execute commands from in until q or the end of the input.
+ * At the prompt every step command runs as it is typed; from a script
+ * consecutive ones are added up and run in one go, so that scripted
+ * sessions spend their time executing rather than going back and
+ * forth for every line. Not while a breakpoint is set, though: a stop
+ * ends only the step command it happened in. Returns once done */
+void command_loop(CPU *cpu, FILE *in, int interactive)
 {
-    int pcoffset, argu = ((cpu->ir& 0x0e00) >> 9);
+    Command cmd;
+    unsigned long steps = 0, nbr_cycles;
+    int done = 0, first = 1, is_step;
 
-    if(cpu->ir == 0x0000) {
-        generateCondition(cpu);
-        printf("NOP, no go to CC:%c", cpu->condition);
-    } else if((cpu->cc & argu) != 0 ) {
-        char *conditioncode;
+    memset(&cmd, 0, sizeof(cmd));
 
-        switch(argu) {
-        case 7:  conditioncode = "NZP"; break;
-        case 6:  conditioncode = "NZ";  break;
-        case 5:  conditioncode = "NP";  break;
-        case 4:  conditioncode = "N";   break;
-        case 3:  conditioncode = "ZP";  break;
-        case 2:  conditioncode = "Z";   break;
-        case 1:  conditioncode = "P";   break;
-        default: conditioncode = " ";   break;
+    while (!done) {
+        /* Prompt, after whatever the program printed */
+        console_flush(cpu);
+        if (interactive) {
+            printf(first ? "> " : "\n> ");
+            first = 0;
         }
 
-        pcoffset = (cpu->ir & 0x01FF);
-        int neg = pcoffset >> 8;
+        if (read_command(in, &cmd) < 0)
+            break;
+
+        is_step = step_count(&cmd, &nbr_cycles);
+        if (is_step == 0)
+            continue;
+        if (is_step == 1 && (interactive || (cpu->debug != NULL &&
+                                             cpu->debug->nbreakpoints > 0))) {
+            if (nbr_cycles == 1) {
+                one_instruction_cycle(cpu);
+                events_due(cpu);
+            } else {
+                manyInstructionCycles(cpu, nbr_cycles);
+            }
+            continue;
+        }
+        if (is_step == 1) {
+            steps += nbr_cycles;
+            continue;
+        }
 
-        if (neg == 1)
-            pcoffset =  pcoffset-512;
+        if (steps > 0) {
+            manyInstructionCycles(cpu, steps);
+            steps = 0;
+        }
+        done = execute_command(&cmd, cpu);
+    }
 
-        cpu->pc = cpu->pc + pcoffset;
+    if (steps > 0)
+        manyInstructionCycles(cpu, steps);
 
-        generateCondition(cpu);
+    free(cmd.line);
+    free(cmd.text);
+}
 
-        printf("BR%s %d, cc = %c  goto  to location x%X ",
-               conditioncode, pcoffset, cpu->condition, cpu->pc);
+/* Handler for each opcode, indexed by ir[15:12] */
+InstrHandler instr_handlers[16] = {
+    branch_instr,    add_instr, load_instr, store_instr,
+    jump_subr_instr, and_instr, ldr_instr,  str_instr,
+    rti_instr,       not_instr, ldi_instr,  sti_instr,
+    jump_instr, reserved_instr, lea_instr,  trap_instr
+};
+
+/* Each fused idiom, indexed by slot - SLOT_CONST */
+const Idiom idioms[] = {
+    { 0x5, 0x1, 2, const_fused }, { 0x9, 0x1, 2, negate_fused },
+    { 0x1, 0x0, 2, count_fused }, { 0x6, 0x7, 3, bump_fused }
+};
+
+/* Split an instruction into its fields. Which fields mean something
+ * depends on the opcode; offset holds whichever immediate it uses */
+void decode_instr(Word ir, Decoded *d)
+{
+    int opcode = (ir & 0xF000) >> 12;
+
+    d->op = opcode;
+    d->handler = instr_handlers[opcode];
+    d->dst = (ir & 0x0E00) >> 9;
+    d->src = (ir & 0x01C0) >> 6;
+    d->src2 = (ir & 0x0007);
+    d->imm = (ir & 0x0020) >> 5;
+
+    switch(opcode) {
+    /* ADD, AND: imm5 */
+    case 0x1:
+    case 0x5:
+        d->offset = (ir & 0x10) ? (ir & 0x1F) - 32 : (ir & 0x1F);
+        break;
+    /* JSR: PCoffset11, bit 11 selects JSR over JSRR */
+    case 0x4:
+        d->imm = (ir & 0x0800) >> 11;
+        d->offset = (ir & 0x400) ? (ir & 0x7FF) - 2048 : (ir & 0x7FF);
+        break;
+    /* LDR, STR: offset6 */
+    case 0x6:
+    case 0x7:
+        d->offset = (ir & 0x20) ? (ir & 0x3F) - 64 : (ir & 0x3F);
+        break;
+    /* TRAP: trapvect8 */
+    case 0xF:
+        d->offset = (ir & 0xFF);
+        break;
+    /* BR, LD, ST, LDI, STI, LEA: PCoffset9 */
+    default:
+        d->offset = (ir & 0x100) ? (ir & 0x1FF) - 512 : (ir & 0x1FF);
+        break;
     }
 }
 
-void add_instr(CPU *cpu)
+/* Every cache entry is decoded here. An idiom fused up to two words
+ * before addr was matched against the word that used to be there, so
+ * its first entry goes stale too, to be matched again */
+void decode_entry(CPU *cpu, Address addr)
 {
-    int mask = (1 << 5);
+    Decoded *prev;
 
-    /* Check if ADD contains 2 registers or is IMMED */
-    int ident = (mask & cpu->ir) >> 5;
+    decode_instr(cpu->mem[addr], &cpu->icache[addr]);
 
-    unsigned int dst, src1;
-    dst = ((7 << 9) & cpu->ir) >> 9;
-    src1 = ((7 << 6) & cpu->ir) >> 6;
+    prev = &cpu->icache[(Address) (addr - 1)];
+    if (prev->op > OP_FUSE)
+        prev->op = OP_FUSE;
+    prev = &cpu->icache[(Address) (addr - 2)];
+    if (prev->op == SLOT_BUMP)
+        prev->op = OP_FUSE;
+}
+
+/* Look for an idiom starting at the freshly decoded entry for addr
+ * and if there is one, put its slot in op. The instructions after it
+ * are decoded too; the threaded loop only runs the idiom while they
+ * stay valid, and decode_entry drops it when one is decoded again */
+void fuse_instr(CPU *cpu, Address addr)
+{
+    Decoded *d = &cpu->icache[addr];
+    int slot = 0, n = 2, x = d->dst;
+    Word next;
+
+    if ((FUSE_OPS & (1 << d->op)) == 0 || addr >= IO_BASE - 2)
+        return;
+    next = cpu->mem[addr + 1];
+
+    switch (d->op) {
+    /* ADD Rx,Rx,#n; BRnzp */
+    case 0x1:
+        if (d->imm && d->src == x && (next & 0xF000) == 0x0000 &&
+            (next & 0x0E00) != 0)
+            slot = SLOT_COUNT;
+        break;
+    /* AND Rx,Rx,#0; ADD Rx,Rx,#n */
+    case 0x5:
+        if (d->imm && d->src == x && d->offset == 0 &&
+            (next & 0xFFE0) == (0x1020 | x << 9 | x << 6))
+            slot = SLOT_CONST;
+        break;
+    /* NOT Rx,Ry; ADD Rx,Rx,#1 */
+    case 0x9:
+        if (next == (Word) (0x1021 | x << 9 | x << 6))
+            slot = SLOT_NEGATE;
+        break;
+    /* LDR Rt,Rb,#k; ADD Rt,Rt,#n; STR Rt,Rb,#k with Rb not Rt */
+    case 0x6:
+        if (d->src != x && (next & 0xFFE0) == (0x1020 | x << 9 | x << 6) &&
+            cpu->mem[addr + 2] == (Word) (0x7000 | (cpu->mem[addr] & 0x0FFF))) {
+            slot = SLOT_BUMP;
+            n = 3;
+        }
+        break;
+    }
+    if (slot == 0)
+        return;
+
+    if (STALE(d[1].op))
+        decode_entry(cpu, addr + 1);
+    if (n == 3 && STALE(d[2].op))
+        decode_entry(cpu, addr + 2);
+    d->op = slot;
+}
+
+/* Look up the predecoded form of mem[addr], decoding it on a miss.
+ * An idiom starting there is given up for its opcode, which is what
+ * everything outside the threaded loop goes by */
+Decoded *fetch_decoded(CPU *cpu, Address addr)
+{
+    Decoded *d = &cpu->icache[addr];
+
+    if (STALE(d->op))
+        decode_entry(cpu, addr);
+    else if (d->op > OP_FUSE)
+        d->op = idioms[d->op - SLOT_CONST].op;
+
+    return d;
+}
+
+/* Mark every cache entry stale, e.g. after loading a new image */
+void flush_icache(CPU *cpu)
+{
+    int i;
+    for (i = 0; i < MEMLEN; i++)
+        cpu->icache[i].op = OP_FUSE;
+
+    if (cpu->jit != NULL)
+        jit_flush(cpu->jit);
+}
+
+/* A store by the program: recorded for undo, written to memory and
+ * passed on to the device if it hits one of their registers */
+void store_word(CPU *cpu, Address addr, Word value)
+{
+    if (cpu->history != NULL && cpu->history->active)
+        history_store(cpu, addr);
+
+    write_word(cpu, addr, value);
+
+    if (addr >= IO_BASE)
+        device_write(cpu, addr, value);
+}
+
+/* Every write to memory goes through here so that self-modifying
+ * code never executes a stale predecoded instruction, and so that
+ * snapshots know which pages changed. Devices never see it: undo and
+ * trace replay put old values back without printing or halting */
+void write_word(CPU *cpu, Address addr, Word value)
+{
+    cpu->mem[addr] = value;
+    cpu->icache[addr].op = OP_DECODE;
+    MARK_DIRTY(cpu, addr);
+
+    if (cpu->jit != NULL && cpu->jit->codemap[addr])
+        jit_invalidate(cpu->jit, addr);
+}
+
+/* After a single instruction: service whatever device event is due */
+void events_due(CPU *cpu)
+{
+    if (cpu->stop || cpu->cycles >= cpu->next_event)
+        events_run(cpu);
+}
+
+/* Every load by an instruction goes through here */
+static inline Word load_word(CPU *cpu, Address addr)
+{
+    if (addr >= IO_BASE)
+        return device_read(cpu, addr);
+    return cpu->mem[addr];
+}
+
+/* Loads and stores at IO_BASE and up reach the device registers.
+ * Their current values are kept in memory too, where dumps and
+ * snapshots see them. A load from KBDR takes the waiting key */
+Word device_read(CPU *cpu, Address addr)
+{
+    Word *mem = cpu->mem;
+
+    switch (addr) {
+    case KBSR:
+        if (console_key_ready(cpu))
+            mem[KBSR] |= (Word) 0x8000;
+        else
+            mem[KBSR] &= 0x7FFF;
+        break;
+    case KBDR: {
+        int key = console_key(cpu);
+
+        if (key >= 0)
+            mem[KBDR] = key & 0xFF;
+        mem[KBSR] &= 0x7FFF;
+    }   break;
+    case DSR:
+        mem[DSR] = (Word) 0x8000;       /* the display is always ready */
+        break;
+    case TMR: {
+        Word value = mem[TMR];
+
+        mem[TMR] &= 0x7FFF;             /* acknowledges the interrupt */
+        MARK_DIRTY(cpu, addr);
+        return value;
+    }
+    case PSR:
+        mem[PSR] = psr_read(cpu);
+        break;
+    case MCR:
+        mem[MCR] = cpu->running ? (Word) 0x8000 : 0;
+        break;
+    default:
+        return mem[addr];
+    }
+
+    MARK_DIRTY(cpu, addr);
+    return mem[addr];
+}
+
+/* value was just stored at addr (IO_BASE and up). Stores that may
+ * let an interrupt through or move the timer stop the run loop, so
+ * that events_run looks at the devices again (cycles can be behind
+ * here, so the timer is restarted there) */
+void device_write(CPU *cpu, Address addr, Word value)
+{
+    switch (addr) {
+    case KBSR:
+    case TMR:
+        cpu->stop = 1;
+        break;
+    case TMI:
+        cpu->status.timer_reload = 1;
+        cpu->stop = 1;
+        break;
+    case PSR:
+        psr_write(cpu, value);
+        cpu->stop = 1;
+        break;
+    case DDR:
+        console_putc(cpu, value & 0xFF);
+        break;
+    case MCR:
+        if ((value & 0x8000) == 0)
+            halt_processor(cpu, HALT_MCR);
+        break;
+    }
+}
+
+/* Processor status register: privilege, priority and condition code */
+Word psr_read(CPU *cpu)
+{
+    return (Word) (cpu->status.user << 15 | cpu->status.priority << 8 | cpu->cc);
+}
+
+void psr_write(CPU *cpu, Word psr)
+{
+    cpu->status.priority = (psr >> 8) & 7;
+    cpu->cc = psr & 7;
+    if (cpu->cc != 1 && cpu->cc != 2 && cpu->cc != 4)
+        cpu->cc = 2;
+}
+
+/* Take an interrupt (or exception) through vector at the given
+ * priority: switch to the supervisor stack, push the PSR and PC
+ * there and continue at the vector's handler */
+void interrupt_enter(CPU *cpu, int vector, int priority)
+{
+    Status *st = &cpu->status;
+    Word psr = psr_read(cpu);
+
+    if (st->user) {
+        st->saved_usp = cpu->reg[6];
+        cpu->reg[6] = st->saved_ssp;
+        st->user = 0;
+    }
+    cpu->reg[6]--;
+    store_word(cpu, (Address) cpu->reg[6], psr);
+    cpu->reg[6]--;
+    store_word(cpu, (Address) cpu->reg[6], (Word) cpu->pc);
+
+    st->priority = priority;
+    cpu->cc = 2;
+    cpu->pc = (Address) cpu->mem[INT_TABLE + vector];
+}
+
+/* Take the most urgent pending device interrupt, if it is above the
+ * current priority. Both devices keep requesting until serviced: the
+ * timer until TMR is loaded, the keyboard until KBDR is */
+void interrupt_check(CPU *cpu)
+{
+    Word *mem = cpu->mem;
+    int vector, priority;
+    Address pc = cpu->pc;
+
+    if ((mem[TMR] & 0xC000) == 0xC000 && cpu->status.priority < PL_TIMER) {
+        vector = INT_TIMER;
+        priority = PL_TIMER;
+    } else if ((mem[KBSR] & KBSR_IE) && cpu->status.priority < PL_KEYBOARD &&
+               console_key_ready(cpu)) {
+        vector = INT_KEYBOARD;
+        priority = PL_KEYBOARD;
+    } else {
+        return;
+    }
+
+    interrupt_enter(cpu, vector, priority);
+    if (cpu->trace != TRACE_NONE)
+        printf("Interrupt x%02X at PL%d: x%04X -> x%04X\n",
+               vector, priority, pc, cpu->pc);
+
+    /* The undo records don't cover the stack and privilege switch */
+    history_reset(cpu);
+}
+
+/* Work out the cycle of the next device event: the timer firing,
+ * or with keyboard interrupts enabled, the next keyboard poll */
+void events_schedule(CPU *cpu)
+{
+    unsigned long next = cpu->status.timer_next;
+
+    if (cpu->mem[KBSR] & KBSR_IE) {
+        unsigned long poll = (cpu->cycles | (KEYBOARD_POLL - 1)) + 1;
+
+        if (poll < next)
+            next = poll;
+    }
+    cpu->next_event = next;
+}
+
+/* Called between instructions once next_event is reached or stop is
+ * set: advance the timer, deliver any interrupt that is due and
+ * schedule the next event */
+void events_run(CPU *cpu)
+{
+    Status *st = &cpu->status;
+    Word interval = cpu->mem[TMI];
+
+    cpu->stop = 0;
+
+    if (st->timer_reload) {
+        st->timer_reload = 0;
+        st->timer_next = interval ? cpu->cycles + (Address) interval
+                                  : ULONG_MAX;
+    } else if (cpu->cycles >= st->timer_next) {
+        cpu->mem[TMR] |= (Word) 0x8000;
+        MARK_DIRTY(cpu, TMR);
+        st->timer_next = interval ? cpu->cycles + (Address) interval
+                                  : ULONG_MAX;
+    }
+
+    if (cpu->running)
+        interrupt_check(cpu);
+    events_schedule(cpu);
+}
+
+void one_instruction_cycle(CPU *cpu)
+{
+    Decoded *d;
+    Address pc;
+
+    /* Check if program is running */
+    if (cpu->running == 0) {
+        printf("halted!\n");
+        return;
+    }
+
+   /* Check if PC is out of range */ 
+   if (cpu->pc < 0 || cpu->pc >= MEMLEN) {
+       printf("Program counter out of range");
+       halt_processor(cpu, HALT_PC_RANGE);
+       return;
+   }
+
+   /* Fetch the predecoded instruction and copy the raw one
+    * to the instruction register, then execute it */
+    if (cpu->history != NULL)
+        history_begin(cpu);
+
+    pc = cpu->pc;
+    d = fetch_decoded(cpu, pc);
+    cpu -> ir = cpu->mem[cpu->pc++];
+    cpu->opcode = d->op;
+    cpu->tracing = 0;
+    if (cpu->trace != TRACE_NONE)
+        trace_prefix(cpu, d);
+
+    d->handler(cpu, d);
+    cpu->cycles++;
+    cpu->stats.ops[cpu->opcode]++;
+
+    if (cpu->history != NULL) {
+        history_end(cpu);
+
+        /* RTI may switch stacks, which the undo records don't cover */
+        if (cpu->opcode == 0x8)
+            history_reset(cpu);
+    }
+
+    if (cpu->trace_ring != NULL)
+        trace_record(cpu, d, pc);
+}
+
+/* Decide whether the instruction just fetched is traced at the
+ * current trace level and if so, print its address and encoding */
+void trace_prefix(CPU *cpu, Decoded *d)
+{
+    if (STALE(d->op)) {
+        int fuse = d->op == OP_FUSE;
+
+        decode_entry(cpu, d - cpu->icache);
+        if (fuse)
+            fuse_instr(cpu, d - cpu->icache);
+    }
+
+    cpu->tracing = (cpu->trace == TRACE_FULL ||
+                    (cpu->trace == TRACE_BRANCHES &&
+                     (CONTROL_OPS & (1 << d->op)) != 0));
+
+    if (cpu->tracing)
+        printf("x%04X: x%04X ", (cpu->pc-1), (cpu->ir & 0xffff));
+}
+
+/* A fused idiom under a trace: its n instructions run one at a time
+ * so that each prints and records just what it would unfused. The
+ * first one's prefix is already out, and the loop finishes off the
+ * last like any other instruction */
+void fused_steps(CPU *cpu, Decoded *d, Address pc, int n)
+{
+    int k;
+
+    for (k = 0; ; k++) {
+        d[k].handler(cpu, &d[k]);
+        if (k == n - 1)
+            return;
+
+        /* by ir, the first op being the idiom's slot */
+        cpu->stats.ops[(cpu->ir >> 12) & 0xF]++;
+        if (cpu->tracing)
+            printf("\n");
+        if (cpu->trace_ring != NULL)
+            trace_record(cpu, &d[k], pc + k);
+
+        cpu->pc++;
+        cpu->ir = cpu->mem[pc + k + 1];
+        if (cpu->trace != TRACE_NONE)
+            trace_prefix(cpu, &d[k + 1]);
+    }
+}
+
+void manyInstructionCycles(CPU *cpu, unsigned long nbr_cycles)
+{
+    if (cpu->running == 0) {
+        printf("halted!\n");
+        return;
+    }
+
+    timed_run(cpu, nbr_cycles);
+}
+
+/* Run up to nbr_cycles instructions straight out of the instruction
+ * cache, returning how many were executed. With GCC each handler
+ * jumps directly to the handler of the next instruction (threaded
+ * code) instead of going back to a switch. With tracing off nothing
+ * is formatted at all */
+unsigned long run_cycles(CPU *cpu, unsigned long nbr_cycles)
+{
+    unsigned long i = 0;
+
+    if (nbr_cycles == 0 || cpu->running == 0)
+        return 0;
+
+    /* Breakpoints, and recording for reverse execution, are dealt
+     * with one instruction at a time, away from the fast loop */
+    if (cpu->debug != NULL && cpu->debug->nbreakpoints > 0)
+        return debug_cycles(cpu, nbr_cycles);
+    if (cpu->history != NULL)
+        return step_cycles(cpu, nbr_cycles);
+
+    cpu->tracing = 0;
+
+#ifdef __GNUC__
+    static void *dispatch[] = {
+        &&op_br,  &&op_add, &&op_ld,  &&op_st,
+        &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_rti, &&op_not, &&op_ldi, &&op_sti,
+        &&op_jmp, &&op_err, &&op_lea, &&op_trap,
+        &&op_decode, &&op_fuse,
+        [SLOT_CONST ... SLOT_BUMP] = &&op_fused
+    };
+    Decoded *d;
+    const Idiom *idiom;
+    Address pc = 0;
+    int traced = cpu->trace != TRACE_NONE || cpu->trace_ring != NULL;
+
+# define FETCH()                                                \
+    do {                                                        \
+        if (cpu->pc < 0 || cpu->pc >= MEMLEN) {                 \
+            if (cpu->trace != TRACE_NONE)                       \
+                printf("Program counter out of range\n");       \
+            halt_processor(cpu, HALT_PC_RANGE);                 \
+            goto done;                                          \
+        }                                                       \
+        pc = cpu->pc++;                                         \
+        d = &cpu->icache[pc];                                   \
+        cpu->ir = cpu->mem[pc];                                 \
+        if (cpu->trace != TRACE_NONE)                           \
+            trace_prefix(cpu, d);                               \
+        goto *dispatch[d->op];                                  \
+    } while (0)
+
+# define NEXT(op)                                               \
+    do {                                                        \
+        cpu->stats.ops[op]++;                                   \
+        if (cpu->tracing)                                       \
+            printf("\n");                                       \
+        if (cpu->trace_ring != NULL)                            \
+            trace_record(cpu, d, pc);                           \
+        if (++i >= nbr_cycles || cpu->stop)                     \
+            goto done;                                          \
+        FETCH();                                                \
+    } while (0)
+
+    FETCH();
+
+op_br:   branch_instr(cpu, d);    NEXT(0x0);
+op_add:  add_instr(cpu, d);       NEXT(0x1);
+op_ld:   load_instr(cpu, d);      NEXT(0x2);
+op_st:   store_instr(cpu, d);     NEXT(0x3);
+op_jsr:  jump_subr_instr(cpu, d); NEXT(0x4);
+op_and:  and_instr(cpu, d);       NEXT(0x5);
+op_ldr:  ldr_instr(cpu, d);       NEXT(0x6);
+op_str:  str_instr(cpu, d);       NEXT(0x7);
+op_rti:  rti_instr(cpu, d);       NEXT(0x8);
+op_not:  not_instr(cpu, d);       NEXT(0x9);
+op_ldi:  ldi_instr(cpu, d);       NEXT(0xA);
+op_sti:  sti_instr(cpu, d);       NEXT(0xB);
+op_jmp:  jump_instr(cpu, d);      NEXT(0xC);
+op_err:  reserved_instr(cpu, d);  NEXT(0xD);
+op_lea:  lea_instr(cpu, d);       NEXT(0xE);
+op_trap: trap_instr(cpu, d);      NEXT(0xF);
+
+    /* An idiom starts here: run it as one, or under a trace one
+     * instruction at a time. The first instruction runs on its own
+     * instead if the budget can't take the whole idiom, if one of
+     * the others has gone stale or if the handler declines */
+op_fused:
+    idiom = &idioms[d->op - SLOT_CONST];
+    if (nbr_cycles - i < (unsigned long) idiom->len ||
+        STALE(d[1].op) || STALE(d[idiom->len - 1].op))
+        goto *dispatch[idiom->op];
+    if (traced)
+        fused_steps(cpu, d, pc, idiom->len);
+    else if (!idiom->run(cpu, d))
+        goto *dispatch[idiom->op];
+    i += idiom->len - 1;
+    pc += idiom->len - 1;
+    d += idiom->len - 1;
+    NEXT(idiom->last);
+
+    /* Stale cache entry: decode it and dispatch again */
+op_decode:
+    decode_entry(cpu, pc);
+    goto *dispatch[d->op];
+op_fuse:
+    decode_entry(cpu, pc);
+    fuse_instr(cpu, pc);
+    goto *dispatch[d->op];
+
+# undef FETCH
+# undef NEXT
+
+done:
+    cpu->cycles += i;
+#else
+    i = step_cycles(cpu, nbr_cycles);
+#endif
+    return i;
+}
+
+/* The same through one_instruction_cycle */
+unsigned long step_cycles(CPU *cpu, unsigned long nbr_cycles)
+{
+    unsigned long start = cpu->cycles;
+
+    while (cpu->cycles - start < nbr_cycles && cpu->running != 0) {
+        one_instruction_cycle(cpu);
+        if (cpu->tracing)
+            printf("\n");
+        events_due(cpu);
+    }
+
+    return cpu->cycles - start;
+}
+
+/* Run up to nbr_cycles instructions, through the JIT if this cpu has
+ * one, and add the host time it took to the performance counters.
+ * The run goes in stretches up to the next device event, which is
+ * serviced in between, so the loops themselves only test cpu->stop */
+unsigned long timed_run(CPU *cpu, unsigned long nbr_cycles)
+{
+    struct timespec start, end;
+    unsigned long done = 0;
+
+    if (cpu->debug != NULL)
+        cpu->debug->stopped = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (done < nbr_cycles && cpu->running) {
+        unsigned long left = nbr_cycles - done;
+
+        if (cpu->next_event <= cpu->cycles)
+            left = 0;
+        else if (cpu->next_event - cpu->cycles < left)
+            left = cpu->next_event - cpu->cycles;
+
+        cpu->stop = 0;
+        if (cpu->jit != NULL)
+            done += jit_run(cpu, left);
+        else
+            done += run_cycles(cpu, left);
+
+        events_due(cpu);
+        if (cpu->debug != NULL && cpu->debug->stopped)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    cpu->stats.seconds += (end.tv_sec - start.tv_sec)
+                        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return done;
+}
+
+/* Print the performance counters: instructions retired and how fast,
+ * then where they went */
+void stats_report(CPU *cpu)
+{
+    static char *names[16] = {
+        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "err", "LEA", "TRAP"
+    };
+    Stats *stats = &cpu->stats;
+    unsigned long total = 0;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        total += stats->ops[i];
+
+    printf("Performance counters:\n");
+    printf("  %lu instructions in %.3f s", total, stats->seconds);
+    if (stats->seconds > 0)
+        printf(", %.1f MIPS", total / stats->seconds / 1e6);
+    printf("\n");
+    if (total == 0)
+        return;
+
+    printf("  branches: %lu taken, %lu not taken\n",
+           stats->taken, stats->ops[0x0] - stats->taken);
+    printf("  loads: %lu, stores: %lu\n",
+           stats->ops[0x2] + stats->ops[0x6] + stats->ops[0xA],
+           stats->ops[0x3] + stats->ops[0x7] + stats->ops[0xB]);
+
+    printf("  per opcode:");
+    for (i = 0; i < 16; i++)
+        if (stats->ops[i] != 0)
+            printf(" %s %lu (%.1f%%)", names[i], stats->ops[i],
+                   100.0 * stats->ops[i] / total);
+    printf("\n");
+
+    if (stats->ops[0xF] != 0) {
+        printf("  traps:");
+        for (i = 0; i < 256; i++)
+            if (stats->traps[i] != 0)
+                printf(" x%02X %lu", i, stats->traps[i]);
+        printf("\n");
+    }
+}
+
+/* p: show the performance counters, p r: and start them over */
+void stats_command(char *cmd_buffer, CPU *cpu)
+{
+    char arg = 0;
+
+    stats_report(cpu);
+    if (sscanf(cmd_buffer, "p %c", &arg) == 1 && arg == 'r') {
+        memset(&cpu->stats, 0, sizeof(Stats));
+        printf("Counters reset\n");
+    }
+}
+
+/* Readable reason for each HALT_* code */
+char *halt_reasons[] = {
+    "running",
+    "HALT trap (x25)",
+    "bad trap vector (x24)",
+    "RTI in user mode",
+    "reserved opcode",
+    "program counter out of range",
+    "machine control register cleared"
+};
+
+/* Headless run (--run): execute until the program halts or the
+ * cycle budget runs out, then report the final state. Returns
+ * the process exit status */
+int run_program(CPU *cpu, Options *opt)
+{
+    unsigned long budget = opt->max_cycles ? opt->max_cycles : ULONG_MAX;
+
+    /* Translated code doesn't trace, so tracing means interpreting */
+    if (opt->jit) {
+        if (cpu->trace != TRACE_NONE || cpu->trace_ring != NULL)
+            printf("warning: --jit ignored while tracing\n");
+        else if (jit_init(cpu) != 0)
+            printf("warning: --jit is not supported on this host\n");
+    }
+
+    timed_run(cpu, budget);
+    console_flush(cpu);
+
+    if (cpu->running)
+        printf("\nStopped: cycle limit reached after %lu instructions\n",
+               cpu->cycles);
+    else
+        printf("\nHalted: %s after %lu instructions\n",
+               halt_reasons[cpu->halt_reason], cpu->cycles);
+    dump_control_unit(cpu);
+    stats_report(cpu);
+
+    return cpu->halt_reason == HALT_TRAP || cpu->halt_reason == HALT_MCR
+           ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Lockstep differential testing (--lockstep[=N]): the program runs on
+ * two cpus side by side, the reference stepping one_instruction_cycle
+ * at a time and the other running the fast engine (the threaded loop,
+ * or translated code with --jit) over the same number of instructions.
+ * After every N of them (1 by default) the two are compared: registers,
+ * PC, condition code, status, every page either of them wrote and
+ * what the program printed. The first difference stops the run.
+ * Both read the same input, all of it read up front. Returns the
+ * process exit status */
+int lockstep_run(CPU *ref, Options *opt)
+{
+    static CPU fast_value;
+    CPU *fast = &fast_value;
+    Console ref_console, fast_console;
+    FILE *input = stdin;
+    char *input_text;
+    size_t input_len;
+    unsigned long budget = opt->max_cycles ? opt->max_cycles : ULONG_MAX;
+    unsigned long stride = opt->lockstep, start, n;
+    int input_mapped, differ = 0;
+
+    if (opt->input != NULL && (input = fopen(opt->input, "rb")) == NULL) {
+        printf("error: Could not open file %s\n", opt->input);
+        return EXIT_FAILURE;
+    }
+    input_text = map_datafile(input, &input_len, &input_mapped);
+    if (input != stdin)
+        fclose(input);
+    if (input_text == NULL) {
+        printf("error: Could not read the input\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The fast cpu starts as an exact copy of the loaded one */
+    if (ref->trace_ring != NULL)
+        printf("warning: --trace-file ignored with --lockstep\n");
+    ref->trace_ring = NULL;
+    *fast = *ref;
+    fast->trace = TRACE_NONE;
+    if (opt->jit && jit_init(fast) != 0)
+        printf("warning: --jit is not supported on this host\n");
+
+    console_init(&ref_console, input_text, input_len);
+    console_init(&fast_console, input_text, input_len);
+    ref->console = &ref_console;
+    fast->console = &fast_console;
+
+    while (ref->running && ref->cycles < budget && !differ) {
+        start = ref->cycles;
+        n = budget - start < stride ? budget - start : stride;
+
+        while (ref->cycles - start < n && ref->running) {
+            one_instruction_cycle(ref);
+            if (ref->tracing)
+                printf("\n");
+            events_due(ref);
+        }
+        timed_run(fast, ref->cycles - start);
+        /* A halt on fetch (PC out of range) retires nothing, so the
+         * fast engine stopped short of it: one more step runs it in */
+        if (!ref->running && fast->running)
+            timed_run(fast, 1);
+
+        differ = lockstep_compare(ref, fast, start);
+
+        /* What was printed matched, so it can go out */
+        fwrite(ref_console.out, 1, ref_console.out_len, stdout);
+        ref_console.out_len = 0;
+        fast_console.out_len = 0;
+    }
+
+    if (!differ)
+        printf("\nLockstep: %s engine matched the reference for %lu "
+               "instructions\n", fast->jit != NULL ? "jit" : "interp",
+               ref->cycles);
+    if (differ)
+        printf("\nStopped at the first difference, after %lu instructions\n",
+               ref->cycles);
+    else if (ref->running)
+        printf("\nStopped: cycle limit reached after %lu instructions\n",
+               ref->cycles);
+    else
+        printf("\nHalted: %s after %lu instructions\n",
+               halt_reasons[ref->halt_reason], ref->cycles);
+    dump_control_unit(ref);
+    stats_report(fast);
+
+    ref->console = NULL;
+    free(ref_console.out);
+    free(fast_console.out);
+    if (fast->jit != NULL)
+        jit_free(fast->jit);
+    unmap_datafile(input_text, input_len, input_mapped);
+
+    if (differ)
+        return EXIT_FAILURE;
+    return ref->halt_reason == HALT_TRAP || ref->halt_reason == HALT_MCR
+           ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Compare the state of the two cpus of a lockstep run after they both
+ * ran from cycle start, printing each difference. Only pages written
+ * by either since the last comparison are looked at, after which both
+ * dirty bitmaps are cleared. Returns the number of differences */
+int lockstep_compare(CPU *ref, CPU *fast, unsigned long start)
+{
+    Console *rc = ref->console, *fc = fast->console;
+    int differ = 0, page, i, shown = 0;
+
+# define LOCKSTEP_DIFF(what, fmt, a, b)                                 \
+    do {                                                                \
+        if (differ++ == 0)                                              \
+            lockstep_header(ref, start);                                \
+        printf("  %-12s " fmt "   " fmt "\n", what, a, b);             \
+    } while (0)
+
+    for (i = 0; i < NREG; i++) {
+        if (ref->reg[i] != fast->reg[i]) {
+            char name[4] = { 'R', '0' + i, '\0' };
+
+            LOCKSTEP_DIFF(name, "x%04X", (Address) ref->reg[i],
+                          (Address) fast->reg[i]);
+        }
+    }
+    if (ref->pc != fast->pc)
+        LOCKSTEP_DIFF("PC", "x%04X", ref->pc, fast->pc);
+    if (ref->cc != fast->cc)
+        LOCKSTEP_DIFF("CC", "%5d", ref->cc, fast->cc);
+    if (ref->running != fast->running)
+        LOCKSTEP_DIFF("running", "%5d", ref->running, fast->running);
+    if (ref->halt_reason != fast->halt_reason)
+        LOCKSTEP_DIFF("halt reason", "%5d", ref->halt_reason,
+                      fast->halt_reason);
+    if (ref->cycles != fast->cycles)
+        LOCKSTEP_DIFF("cycles", "%5lu", ref->cycles, fast->cycles);
+    if (ref->status.user != fast->status.user ||
+        ref->status.priority != fast->status.priority)
+        LOCKSTEP_DIFF("PSR", "x%04X", (Address) psr_read(ref),
+                      (Address) psr_read(fast));
+    if (ref->status.saved_ssp != fast->status.saved_ssp)
+        LOCKSTEP_DIFF("saved SSP", "x%04X", (Address) ref->status.saved_ssp,
+                      (Address) fast->status.saved_ssp);
+    if (ref->status.saved_usp != fast->status.saved_usp)
+        LOCKSTEP_DIFF("saved USP", "x%04X", (Address) ref->status.saved_usp,
+                      (Address) fast->status.saved_usp);
+
+    for (page = 0; page < NPAGES; page++) {
+        int base = page << PAGE_SHIFT;
+
+        if ((ref->dirty[page >> 3] | fast->dirty[page >> 3]) == 0) {
+            page |= 7;          /* none of these eight pages */
+            continue;
+        }
+        if (!PAGE_DIRTY(ref, page) && !PAGE_DIRTY(fast, page))
+            continue;
+        if (memcmp(ref->mem + base, fast->mem + base,
+                   PAGE_LEN * sizeof(Word)) == 0)
+            continue;
+        for (i = base; i < base + PAGE_LEN; i++) {
+            char name[16];
+
+            if (ref->mem[i] == fast->mem[i])
+                continue;
+            if (shown++ == 8)
+                printf("  ...\n");
+            if (shown > 8)
+                continue;
+            snprintf(name, sizeof(name), "x%04X", i);
+            LOCKSTEP_DIFF(name, "x%04X", (Address) ref->mem[i],
+                          (Address) fast->mem[i]);
+        }
+    }
+    memset(ref->dirty, 0, sizeof(ref->dirty));
+    memset(fast->dirty, 0, sizeof(fast->dirty));
+
+    if (rc->out_len != fc->out_len ||
+        memcmp(rc->out, fc->out, rc->out_len) != 0)
+        LOCKSTEP_DIFF("output", "%5lu bytes", (unsigned long) rc->out_len,
+                      (unsigned long) fc->out_len);
+
+# undef LOCKSTEP_DIFF
+
+    return differ;
+}
+
+/* First lines of a lockstep difference report */
+void lockstep_header(CPU *ref, unsigned long start)
+{
+    console_flush(ref);
+    if (ref->cycles == start)
+        printf("\nLockstep: the engines differ fetching instruction %lu\n",
+               start + 1);
+    else if (ref->cycles - start == 1)
+        printf("\nLockstep: the engines differ after instruction %lu\n",
+               ref->cycles);
+    else
+        printf("\nLockstep: the engines differ after instructions "
+               "%lu-%lu\n", start + 1, ref->cycles);
+    printf("  %-12s %-9s %s\n", "", "reference", "fast");
+}
+
+/* xorshift64*: fast, and the same seed always gives the same run */
+unsigned long fuzz_random(Fuzzer *fz)
+{
+    fz->rng ^= fz->rng >> 12;
+    fz->rng ^= fz->rng << 25;
+    fz->rng ^= fz->rng >> 27;
+    return (unsigned long) (fz->rng * 0x2545F4914F6CDD1DULL);
+}
+
+/* FNV-1a, to tell outcomes and findings apart */
+unsigned long fuzz_hash(unsigned long h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len-- > 0)
+        h = (h ^ *p++) * 0x100000001B3UL;
+    return h;
+}
+
+/* Remember hash. Returns 1 if it was seen before (or there is no room
+ * left to remember it), 0 the first time */
+int fuzz_seen(Fuzzer *fz, unsigned long hash)
+{
+    unsigned long i = hash & (FUZZ_SEEN - 1), n;
+
+    if (hash == 0)
+        hash = 1;
+    for (n = 0; n < FUZZ_SEEN; n++, i = (i + 1) & (FUZZ_SEEN - 1)) {
+        if (fz->seen[i] == hash)
+            return 1;
+        if (fz->seen[i] == 0) {
+            fz->seen[i] = hash;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Keep an input to mutate further, in place of a random one once the
+ * corpus is full */
+void fuzz_add(Fuzzer *fz, const char *data, size_t len)
+{
+    int i = fz->ncorpus < FUZZ_CORPUS ? fz->ncorpus++
+                                      : (int) (fuzz_random(fz) % FUZZ_CORPUS);
+    char *copy = malloc(len ? len : 1);
+
+    if (copy == NULL)
+        return;
+    memcpy(copy, data, len);
+    free(fz->corpus[i]);
+    fz->corpus[i] = copy;
+    fz->corpus_len[i] = len;
+}
+
+/* Fill buf (cap bytes) with a corpus entry after a few random
+ * mutations. Returns its length */
+size_t fuzz_mutate(Fuzzer *fz, char *buf, size_t cap)
+{
+    static const char *tokens[] = {
+        "x", "0", "1", "9", "F", "f", "-", "#", ";", " ", "\n", "\r\n",
+        "x3000", "xFFFF", "0x", ".ORIG", ".FILL", ".END", "\"", ",", "R7"
+    };
+    int i = fuzz_random(fz) % fz->ncorpus, n, k;
+    size_t len = fz->corpus_len[i] < cap ? fz->corpus_len[i] : cap;
+
+    memcpy(buf, fz->corpus[i], len);
+
+    for (n = 1 + fuzz_random(fz) % 8; n > 0; n--) {
+        size_t pos = len ? fuzz_random(fz) % len : 0, span;
+
+        switch (fuzz_random(fz) % 7) {
+        case 0:                 /* flip a bit */
+            if (len > 0)
+                buf[pos] ^= 1 << (fuzz_random(fz) % 8);
+            break;
+        case 1:                 /* any byte */
+            if (len > 0)
+                buf[pos] = fuzz_random(fz);
+            break;
+        case 2:                 /* insert a byte */
+            if (len < cap) {
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = fuzz_random(fz);
+                len++;
+            }
+            break;
+        case 3:                 /* delete a few */
+            span = 1 + fuzz_random(fz) % 8;
+            if (pos + span <= len) {
+                memmove(buf + pos, buf + pos + span, len - pos - span);
+                len -= span;
+            }
+            break;
+        case 4:                 /* insert a token of the formats read */
+            k = fuzz_random(fz) % (sizeof(tokens) / sizeof(tokens[0]));
+            span = strlen(tokens[k]);
+            if (len + span <= cap) {
+                memmove(buf + pos + span, buf + pos, len - pos);
+                memcpy(buf + pos, tokens[k], span);
+                len += span;
+            }
+            break;
+        case 5:                 /* repeat a chunk */
+            span = 1 + fuzz_random(fz) % 32;
+            if (pos + span <= len && len + span <= cap) {
+                memmove(buf + pos + span, buf + pos, len - pos);
+                len += span;
+            }
+            break;
+        case 6:                 /* cut it short */
+            len = pos;
+            break;
+        }
+    }
+
+    return len;
+}
+
+/* Report a finding the first time it comes up and save the input that
+ * caused it in the findings directory */
+void fuzz_finding(Fuzzer *fz, const char *kind, const char *detail,
+                  unsigned long where, const char *data, size_t len)
+{
+    char path[4096];
+    FILE *saved;
+    unsigned long hash = fuzz_hash(fuzz_hash(0xCBF29CE484222325UL, kind,
+                                             strlen(kind)),
+                                   &where, sizeof(where));
+
+    if (fuzz_seen(fz, hash))
+        return;
+
+    fz->findings++;
+    snprintf(path, sizeof(path), "%s/%03lu-%s", fz->out_dir, fz->findings,
+             kind);
+    saved = fopen(path, "wb");
+    if (saved != NULL) {
+        fwrite(data, 1, len, saved);
+        fclose(saved);
+    }
+    printf("finding %lu: %s: %s (input saved in %s)\n", fz->findings, kind,
+           detail, saved != NULL ? path : "nowhere, could not create it");
+}
+
+/* Look at the instruction about to run at the PC for accesses a correct
+ * program doesn't make: an effective address that wraps around the end
+ * of memory, a device access that reaches no device register, a PUTS
+ * whose string runs off the end of memory. Addresses are 16 bits, so
+ * none of these can touch anything outside the simulated memory, but
+ * they are almost always bugs in the program. Returns the kind of
+ * finding (with its description in detail) or NULL */
+const char *fuzz_check(CPU *cpu, char *detail, size_t size)
+{
+    Address pc = cpu->pc, addr;
+    Decoded *d = fetch_decoded(cpu, pc);
+    long ea;
+
+    switch (d->op) {
+    case 0x2: case 0x3: case 0xA: case 0xB:     /* LD ST LDI STI */
+        ea = (long) pc + 1 + d->offset;
+        break;
+    case 0x6: case 0x7:                         /* LDR STR */
+        ea = (long) (Address) cpu->reg[d->src] + d->offset;
+        break;
+    case 0xF:                                   /* PUTS */
+        if (d->offset != 0x22)
+            return NULL;
+        for (ea = (Address) cpu->reg[0]; ea < MEMLEN; ea++)
+            if (cpu->mem[ea] == 0)
+                return NULL;
+        snprintf(detail, size, "x%04X: PUTS string at x%04X runs past "
+                 "the end of memory", pc, (Address) cpu->reg[0]);
+        return "wrap";
+    default:
+        return NULL;
+    }
+
+    if (ea < 0 || ea >= MEMLEN) {
+        snprintf(detail, size, "x%04X: x%04X accesses %ld, outside "
+                 "x0000-xFFFF (wraps to x%04X)", pc, (Address) cpu->mem[pc],
+                 ea, (Address) ea);
+        return "wrap";
+    }
+
+    addr = ea;
+    if (d->op == 0xA || d->op == 0xB)
+        addr = cpu->mem[addr];
+    if (addr >= IO_BASE && addr != KBSR && addr != KBDR && addr != DSR &&
+        addr != DDR && addr != TMR && addr != TMI && addr != PSR &&
+        addr != MCR) {
+        snprintf(detail, size, "x%04X: x%04X accesses x%04X, which is "
+                 "no device register", pc, (Address) cpu->mem[pc], addr);
+        return "device";
+    }
+
+    return NULL;
+}
+
+/* Start a fuzzing session: the findings directory and the seed */
+void fuzz_init(Fuzzer *fz, Options *opt, const char *seed, size_t len)
+{
+    memset(fz, 0, sizeof(*fz));
+    fz->rng = opt->fuzz_seed ? opt->fuzz_seed : 1;
+    fz->out_dir = opt->fuzz_out;
+    if (mkdir(fz->out_dir, 0777) != 0 && errno != EEXIST)
+        printf("warning: Could not create %s\n", fz->out_dir);
+    fuzz_add(fz, seed, len);
+}
+
+void fuzz_done(Fuzzer *fz, unsigned long execs, struct timespec *start)
+{
+    struct timespec end;
+    double secs;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    printf("Fuzzed %lu inputs in %.3f s, %.0f execs/s: %lu findings, "
+           "%d inputs in the corpus\n", execs, secs,
+           secs > 0 ? execs / secs : 0.0, fz->findings, fz->ncorpus);
+
+    for (i = 0; i < fz->ncorpus; i++)
+        free(fz->corpus[i]);
+}
+
+/* --fuzz N: run the loaded program N times on mutations of its GETC/IN
+ * input (--input FILE is the seed, empty by default), each time from
+ * the state it was loaded in, for at most --max-cycles instructions.
+ * Inputs that end differently from all before (halt reason, PC, cycle
+ * count to a power of two, output length) are kept to mutate further.
+ * Besides fuzz_check, halting in any way but HALT or MCR is a finding */
+int fuzz_guest(CPU *cpu, Options *opt)
+{
+    static Snapshot base;
+    static char input[FUZZ_MAX_INPUT];
+    Fuzzer *fz = malloc(sizeof(Fuzzer));
+    Console console;
+    struct timespec start;
+    unsigned long budget = opt->max_cycles ? opt->max_cycles : 100000;
+    unsigned long i, instructions = 0;
+    char detail[256], *seed = "";
+    size_t seed_len = 0;
+    int seed_mapped = 0;
+    FILE *seed_file;
+
+    if (fz == NULL) {
+        printf("error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (opt->input != NULL) {
+        if ((seed_file = fopen(opt->input, "rb")) == NULL ||
+            (seed = map_datafile(seed_file, &seed_len, &seed_mapped)) == NULL) {
+            printf("error: Could not read %s\n", opt->input);
+            return EXIT_FAILURE;
+        }
+        fclose(seed_file);
+    }
+    fuzz_init(fz, opt, seed, seed_len < FUZZ_MAX_INPUT ? seed_len
+                                                        : FUZZ_MAX_INPUT);
+    if (opt->input != NULL)
+        unmap_datafile(seed, seed_len, seed_mapped);
+
+    cpu->trace = TRACE_NONE;
+    console_init(&console, input, 0);
+    cpu->console = &console;
+    snapshot_take(cpu, &base);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < opt->fuzz; i++) {
+        size_t len = fuzz_mutate(fz, input, FUZZ_MAX_INPUT);
+        const char *kind = NULL;
+        unsigned long outcome, bucket;
+
+        snapshot_restore(cpu, &base);
+        console.in_len = len;
+        console.in_pos = 0;
+        console.out_len = 0;
+        console.truncated = 0;
+
+        while (cpu->running && cpu->cycles - base.cycles < budget) {
+            if ((kind = fuzz_check(cpu, detail, sizeof(detail))) != NULL)
+                break;
+            one_instruction_cycle(cpu);
+            events_due(cpu);
+        }
+        instructions += cpu->cycles - base.cycles;
+
+        if (kind == NULL && !cpu->running &&
+            cpu->halt_reason != HALT_TRAP && cpu->halt_reason != HALT_MCR) {
+            kind = "halt";
+            snprintf(detail, sizeof(detail), "x%04X: %s", cpu->pc,
+                     halt_reasons[cpu->halt_reason]);
+        }
+        if (kind != NULL)
+            fuzz_finding(fz, kind, detail, cpu->pc, input, len);
+
+        for (bucket = 0; (cpu->cycles - base.cycles) >> bucket; bucket++)
+            ;
+        outcome = fuzz_hash(0x84222325UL, &cpu->halt_reason, sizeof(int));
+        outcome = fuzz_hash(outcome, &cpu->pc, sizeof(int));
+        outcome = fuzz_hash(outcome, &bucket, sizeof(bucket));
+        outcome = fuzz_hash(outcome, &console.out_len, sizeof(size_t));
+        if (!fuzz_seen(fz, outcome))
+            fuzz_add(fz, input, len);
+    }
+
+    fuzz_done(fz, opt->fuzz, &start);
+    printf("  %lu instructions run\n", instructions);
+    cpu->console = NULL;
+    free(console.out);
+    free(fz);
+    return EXIT_SUCCESS;
+}
+
+/* --fuzz-loader N: feed N mutations of the program file to the loader
+ * (the hex image, .obj or .asm reader, by the file's name). A child
+ * forked from this process, which has everything set up already,
+ * parses each one; a child killed by a signal is a crash, one still
+ * parsing after FUZZ_TIMEOUT seconds a hang. Inputs the loader
+ * answers with a word count not seen before go into the corpus */
+int fuzz_loader(Options *opt)
+{
+    static CPU cpu_value;
+    static char image[FUZZ_MAX_IMAGE];
+    CPU *cpu = &cpu_value;
+    Fuzzer *fz = malloc(sizeof(Fuzzer));
+    struct timespec start;
+    unsigned long i;
+    char *name = opt->datafile, *seed, detail[256];
+    size_t seed_len;
+    int seed_mapped, status, null;
+    FILE *seed_file;
+
+    if (fz == NULL) {
+        printf("error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (name == NULL || (seed_file = fopen(name, "rb")) == NULL ||
+        (seed = map_datafile(seed_file, &seed_len, &seed_mapped)) == NULL) {
+        printf("error: --fuzz-loader needs a program file to start from\n");
+        return EXIT_FAILURE;
+    }
+    fclose(seed_file);
+    fuzz_init(fz, opt, seed, seed_len < FUZZ_MAX_IMAGE ? seed_len
+                                                        : FUZZ_MAX_IMAGE);
+    unmap_datafile(seed, seed_len, seed_mapped);
+
+    initialize_control_unit(cpu);
+    null = open("/dev/null", O_WRONLY);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < opt->fuzz; i++) {
+        size_t len = fuzz_mutate(fz, image, FUZZ_MAX_IMAGE);
+        unsigned long outcome;
+        pid_t pid;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) {
+            printf("error: Could not fork\n");
+            break;
+        }
+        if (pid == 0) {
+            int words;
+
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            alarm(FUZZ_TIMEOUT);
+            words = load_program(cpu, image, len, name);
+            _exit(words < 0 ? 255 : words % 255);
+        }
+        if (waitpid(pid, &status, 0) < 0)
+            break;
+
+        if (WIFSIGNALED(status)) {
+            int sig = WTERMSIG(status);
+
+            snprintf(detail, sizeof(detail), "loading %lu bytes %s "
+                     "(signal %d)", (unsigned long) len,
+                     sig == SIGALRM ? "took too long" : "crashed", sig);
+            fuzz_finding(fz, sig == SIGALRM ? "hang" : "crash", detail,
+                         sig, image, len);
+            continue;
+        }
+
+        outcome = fuzz_hash(0x2325UL, &status, sizeof(status));
+        if (!fuzz_seen(fz, outcome))
+            fuzz_add(fz, image, len);
+    }
+
+    fuzz_done(fz, i, &start);
+    close(null);
+    free(fz);
+    return EXIT_SUCCESS;
+}
+
+/* Batch mode (--batch): run every job of a manifest on a pool of
+ * worker threads, each with a cpu of its own. Each worker starts out
+ * with an equal share of the jobs and, once it is done with them,
+ * steals jobs from the end of the other workers' shares. Results
+ * are written to one file in manifest order */
+int batch_run(Options *opt)
+{
+    Batch batch;
+    Worker *workers;
+    pthread_t *threads;
+    struct timespec start, end;
+    FILE *results = stdout;
+    int i, failed = 0;
+
+    batch.opt = opt;
+    if (batch_read_manifest(&batch, opt->batch) != 0)
+        return EXIT_FAILURE;
+
+    batch.nworkers = opt->jobs;
+    if (batch.nworkers <= 0)
+        batch.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (batch.nworkers > batch.njobs)
+        batch.nworkers = batch.njobs;
+    if (batch.nworkers < 1)
+        batch.nworkers = 1;
+
+    /* Split the jobs into one contiguous share per worker */
+    batch.queues = calloc(batch.nworkers, sizeof(JobQueue));
+    workers = calloc(batch.nworkers, sizeof(Worker));
+    threads = calloc(batch.nworkers, sizeof(pthread_t));
+    if (batch.queues == NULL || workers == NULL || threads == NULL) {
+        printf("error: Could not allocate %d workers\n", batch.nworkers);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < batch.nworkers; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].next = (long) batch.njobs * i / batch.nworkers;
+        batch.queues[i].end = (long) batch.njobs * (i + 1) / batch.nworkers;
+        workers[i].batch = &batch;
+        workers[i].id = i;
+    }
+
+    /* Shared by every loader; fill it in before there are threads */
+    init_hex_digits();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < batch.nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &workers[i]) != 0) {
+            printf("error: Could not start worker %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < batch.nworkers; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (opt->results != NULL) {
+        results = fopen(opt->results, "w");
+        if (results == NULL) {
+            printf("error: Could not open results file %s\n", opt->results);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < batch.njobs; i++) {
+        fputs(batch.jobs[i].result, results);
+        if (!batch.jobs[i].passed)
+            failed++;
+    }
+    if (results != stdout)
+        fclose(results);
+
+    printf("Ran %d jobs on %d threads in %.3f s, %d did not halt normally\n",
+           batch.njobs, batch.nworkers, (end.tv_sec - start.tv_sec) +
+           (end.tv_nsec - start.tv_nsec) / 1e9, failed);
+
+    for (i = 0; i < batch.njobs; i++) {
+        free(batch.jobs[i].program);
+        free(batch.jobs[i].input);
+        free(batch.jobs[i].result);
+    }
+    for (i = 0; i < batch.nworkers; i++)
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    free(batch.jobs);
+    free(batch.queues);
+    free(workers);
+    free(threads);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Cut line in place into its words, stopping at a word that starts
+ * with '#' (a comment). The first max are kept in field; returns how
+ * many there are in all */
+int split_fields(char *line, char **field, int max)
+{
+    int n = 0;
+
+    for (;;) {
+        line += strspn(line, " \t\r\n\v\f");
+        if (*line == '\0' || *line == '#')
+            return n;
+        if (n < max)
+            field[n] = line;
+        n++;
+        line += strcspn(line, " \t\r\n\v\f");
+        if (*line != '\0')
+            *line++ = '\0';
+    }
+}
+
+/* Manifest: one job per line, a program image optionally followed by
+ * a file whose bytes GETC/IN read. Blank lines and '#' comments are
+ * ignored. Returns 0, or -1 after printing what's wrong */
+int batch_read_manifest(Batch *batch, char *manifest_name)
+{
+    FILE *manifest = fopen(manifest_name, "r");
+    char *buffer = NULL;
+    size_t buffer_len = 0;
+    int line = 0, cap = 0;
+
+    if (manifest == NULL) {
+        printf("error: Could not open manifest %s\n", manifest_name);
+        return -1;
+    }
+
+    batch->jobs = NULL;
+    batch->njobs = 0;
+
+    while (getline(&buffer, &buffer_len, manifest) != -1) {
+        char *field[2];
+        int fields;
+        BatchJob *job;
+
+        line++;
+        fields = split_fields(buffer, field, 2);
+        if (fields == 0)
+            continue;
+        if (fields > 2) {
+            printf("%s:%d: error: expected a program and an input file\n",
+                   manifest_name, line);
+            free(buffer);
+            fclose(manifest);
+            return -1;
+        }
+
+        if (batch->njobs == cap) {
+            cap = cap ? 2 * cap : 64;
+            batch->jobs = realloc(batch->jobs, cap * sizeof(BatchJob));
+            if (batch->jobs == NULL) {
+                printf("error: Could not allocate %d jobs\n", cap);
+                exit(EXIT_FAILURE);
+            }
+        }
+        job = &batch->jobs[batch->njobs++];
+        job->program = strdup(field[0]);
+        job->input = fields == 2 ? strdup(field[1]) : NULL;
+        job->result = NULL;
+        job->passed = 0;
+    }
+
+    free(buffer);
+    fclose(manifest);
+    return 0;
+}
+
+/* Take the next job for worker id: its own next one, or else the
+ * last one of some other worker. Returns -1 once there are none */
+int batch_next_job(Batch *batch, int id)
+{
+    int i, job = -1;
+
+    for (i = 0; i < batch->nworkers && job < 0; i++) {
+        JobQueue *queue = &batch->queues[(id + i) % batch->nworkers];
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next < queue->end)
+            job = i == 0 ? queue->next++ : --queue->end;
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return job;
+}
+
+void *batch_worker(void *arg)
+{
+    Worker *worker = arg;
+    Batch *batch = worker->batch;
+    CPU *cpu = calloc(1, sizeof(CPU));
+    int job;
+
+    if (cpu == NULL) {
+        printf("error: Could not allocate a cpu for worker %d\n", worker->id);
+        exit(EXIT_FAILURE);
+    }
+
+    /* One translation buffer per worker, reused from job to job */
+    if (batch->opt->jit && jit_init(cpu) != 0)
+        cpu->jit = NULL;
+
+    while ((job = batch_next_job(batch, worker->id)) >= 0)
+        batch_run_job(cpu, &batch->jobs[job], job + 1, batch->opt);
+
+    if (cpu->jit != NULL)
+        jit_free(cpu->jit);
+    free(cpu);
+    return NULL;
+}
+
+/* Load, run and report one job. Everything it touches is in cpu
+ * and job, so any number of these can run at once */
+void batch_run_job(CPU *cpu, BatchJob *job, int number, Options *opt)
+{
+    Jit *jit = cpu->jit;
+    Console console;
+    FILE *program, *input = NULL, *result;
+    char *text = NULL, *input_text = NULL, *messages = NULL;
+    size_t len, input_len = 0, result_len, messages_len, i;
+    int mapped, input_mapped = 0, loaded = -1;
+
+    initialize_control_unit(cpu);
+    cpu->trace = TRACE_NONE;
+    cpu->jit = jit;
+
+    result = open_memstream(&job->result, &result_len);
+    if (result == NULL) {
+        printf("error: Could not allocate the result of job %d\n", number);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(result, "job=%d program=%s", number, job->program);
+
+    program = fopen(job->program, "r");
+    if (job->input != NULL)
+        input = fopen(job->input, "rb");
+
+    if (program == NULL) {
+        fprintf(result, " error=\"could not open program\"\n");
+    } else if (job->input != NULL && input == NULL) {
+        fprintf(result, " error=\"could not open input\"\n");
+    } else if ((text = map_datafile(program, &len, &mapped)) == NULL ||
+               (input != NULL &&
+                (input_text = map_datafile(input, &input_len,
+                                           &input_mapped)) == NULL)) {
+        fprintf(result, " error=\"could not read program or input\"\n");
+    } else {
+        /* What's wrong with the program goes on the job's line, not
+         * to stdout in between the lines of other workers */
+        cpu->messages = open_memstream(&messages, &messages_len);
+        if (cpu->messages == NULL) {
+            printf("error: Could not allocate the result of job %d\n",
+                   number);
+            exit(EXIT_FAILURE);
+        }
+        loaded = load_program(cpu, text, len, job->program);
+        fclose(cpu->messages);
+        cpu->messages = NULL;
+
+        /* The first error, which is on a line of its own */
+        if (loaded < 0) {
+            messages_len = strcspn(messages, "\n");
+            for (i = 0; i < messages_len; i++)
+                if (messages[i] == '"')
+                    messages[i] = '\'';
+            if (messages_len == 0)
+                fprintf(result, " error=\"malformed program\"\n");
+            else
+                fprintf(result, " error=\"%.*s\"\n", (int) messages_len,
+                        messages);
+        }
+        free(messages);
+    }
+
+    if (loaded >= 0) {
+        unsigned long budget = opt->max_cycles ? opt->max_cycles : ULONG_MAX;
+
+        console_init(&console, input_text, input_len);
+        cpu->console = &console;
+        timed_run(cpu, budget);
+        cpu->console = NULL;
+
+        job->passed = batch_report(result, cpu, &console);
+        free(console.out);
+    }
+
+    if (text != NULL)
+        unmap_datafile(text, len, mapped);
+    if (input_text != NULL)
+        unmap_datafile(input_text, input_len, input_mapped);
+    if (program != NULL)
+        fclose(program);
+    if (input != NULL)
+        fclose(input);
+    fclose(result);
+}
+
+/* The rest of a job's result line: how cpu stopped, where, and what
+ * it printed on console. Returns 1 if it stopped on HALT or MCR */
+int batch_report(FILE *result, CPU *cpu, Console *console)
+{
+    size_t i;
+
+    generateCondition(cpu);
+    fprintf(result, " halt=\"%s\" cycles=%lu pc=x%04X cc=%c regs=",
+            cpu->running ? "cycle limit" : halt_reasons[cpu->halt_reason],
+            cpu->cycles, cpu->pc, cpu->condition);
+    for (i = 0; i < NREG; i++)
+        fprintf(result, "%sx%04X", i ? "," : "", cpu->reg[i] & 0xFFFF);
+
+    fprintf(result, " output=\"");
+    for (i = 0; i < console->out_len; i++) {
+        unsigned char c = console->out[i];
+
+        if (c == '"' || c == '\\')
+            fprintf(result, "\\%c", c);
+        else if (c == '\n')
+            fprintf(result, "\\n");
+        else if (c < ' ' || c > '~')
+            fprintf(result, "\\x%02X", c);
+        else
+            fputc(c, result);
+    }
+    fprintf(result, "\"%s\n", console->truncated ? " truncated=1" : "");
+
+    return !cpu->running && (cpu->halt_reason == HALT_TRAP ||
+                             cpu->halt_reason == HALT_MCR);
+}
+
+/* Vector mode (--vector): one program run over many inputs, a gang of
+ * VECTOR_LANES at a time. The lanes' registers and condition codes are
+ * kept register by register across the lanes, so ADD, AND, NOT and LEA
+ * execute for all the lanes at the same PC in a few vector operations.
+ * Every step executes the instruction at the lowest PC any lane is at,
+ * which lets lanes that went different ways at a branch come together
+ * again. Loads, stores and traps go lane by lane, each lane's memory
+ * being the loaded image's pages until it writes one. A lane that
+ * touches the devices, executes RTI or a reserved opcode or leaves
+ * memory goes on by itself on a cpu of its own */
+int vector_run(CPU *base, Options *opt)
+{
+    Gang *gang;
+    CPU *cpu;
+    VectorInput *inputs;
+    struct timespec start, end;
+    FILE *results = stdout;
+    int ninputs, i, failed = 0;
+
+    if (vector_read_inputs(opt->vector, &inputs, &ninputs) != 0)
+        return EXIT_FAILURE;
+
+    cpu = calloc(1, sizeof(CPU));
+    if (cpu == NULL || posix_memalign((void **) &gang, sizeof(WordVector),
+                                      sizeof(Gang)) != 0) {
+        printf("error: Could not allocate the lanes\n");
+        return EXIT_FAILURE;
+    }
+
+    if (opt->results != NULL) {
+        results = fopen(opt->results, "w");
+        if (results == NULL) {
+            printf("error: Could not open results file %s\n", opt->results);
+            return EXIT_FAILURE;
+        }
+    }
+
+    base->trace = TRACE_NONE;
+    gang->base = base;
+    gang->cpu = cpu;
+    gang->budget = opt->max_cycles ? opt->max_cycles : ULONG_MAX;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ninputs; i += VECTOR_LANES) {
+        int n = ninputs - i < VECTOR_LANES ? ninputs - i : VECTOR_LANES;
+
+        gang_start(gang, inputs + i, n);
+        gang_run(gang);
+        failed += gang_report(gang, results, i + 1, opt->datafile);
+        gang_free(gang);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (results != stdout)
+        fclose(results);
+
+    printf("Ran %d inputs, %d at a time, in %.3f s, %d did not halt "
+           "normally\n", ninputs, VECTOR_LANES, (end.tv_sec - start.tv_sec) +
+           (end.tv_nsec - start.tv_nsec) / 1e9, failed);
+
+    for (i = 0; i < ninputs; i++)
+        free(inputs[i].file);
+    free(inputs);
+    free(gang);
+    free(cpu);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Inputs list: per line, the file GETC/IN read (- for none), then
+ * any registers to preset as Rn=VALUE, e.g. "in1 R0=x10 R1=#3". Blank
+ * lines and '#' comments are ignored. Returns 0, or -1 after printing
+ * what's wrong */
+int vector_read_inputs(char *list_name, VectorInput **inputs, int *ninputs)
+{
+    FILE *list = fopen(list_name, "r");
+    char *buffer = NULL;
+    size_t buffer_len = 0;
+    int line = 0, cap = 0, i;
+
+    if (list == NULL) {
+        printf("error: Could not open inputs list %s\n", list_name);
+        return -1;
+    }
+
+    *inputs = NULL;
+    *ninputs = 0;
+
+    while (getline(&buffer, &buffer_len, list) != -1) {
+        char *field[1 + NREG];
+        VectorInput *input;
+        unsigned long value;
+        int fields;
+
+        line++;
+        fields = split_fields(buffer, field, 1 + NREG);
+        if (fields == 0)
+            continue;
+        if (fields > 1 + NREG) {
+            printf("%s:%d: error: expected an input file and at most %d "
+                   "registers\n", list_name, line, NREG);
+            goto fail;
+        }
+
+        if (*ninputs == cap) {
+            cap = cap ? 2 * cap : 64;
+            *inputs = realloc(*inputs, cap * sizeof(VectorInput));
+            if (*inputs == NULL) {
+                printf("error: Could not allocate %d inputs\n", cap);
+                exit(EXIT_FAILURE);
+            }
+        }
+        input = &(*inputs)[*ninputs];
+        input->file = strcmp(field[0], "-") == 0 ? NULL : strdup(field[0]);
+        input->preset = 0;
+        (*ninputs)++;
+
+        for (i = 1; i < fields; i++) {
+            char *f = field[i];
+
+            if ((f[0] != 'R' && f[0] != 'r') || f[1] < '0' ||
+                f[1] >= '0' + NREG || f[2] != '=' ||
+                command_number(f + 3, &value) != 0 || value > 0xFFFF) {
+                printf("%s:%d: error: expected Rn=VALUE, found '%s'\n",
+                       list_name, line, f);
+                goto fail;
+            }
+            input->reg[f[1] - '0'] = value;
+            input->preset |= 1 << (f[1] - '0');
+        }
+    }
+
+    free(buffer);
+    fclose(list);
+    return 0;
+
+fail:
+    for (i = 0; i < *ninputs; i++)
+        free((*inputs)[i].file);
+    free(*inputs);
+    free(buffer);
+    fclose(list);
+    return -1;
+}
+
+/* Put the loaded program in the first n lanes, each reading its own
+ * input and starting with its own preset registers. A lane whose input
+ * can't be read doesn't run at all */
+void gang_start(Gang *g, VectorInput *inputs, int n)
+{
+    CPU *base = g->base;
+    int l, r, p;
+
+    memset(g->reg, 0, sizeof(g->reg));
+    memset(g->cc, 0, sizeof(g->cc));
+    memset(g->live, 0, sizeof(g->live));
+    memset(g->written, 0, sizeof(g->written));
+    g->nlanes = n;
+    g->nlive = 0;
+    g->converged = 0;
+
+    for (l = 0; l < n; l++) {
+        Lane *lane = &g->lane[l];
+        FILE *input;
+
+        lane->error = NULL;
+        lane->text = NULL;
+        lane->len = 0;
+        if (inputs[l].file != NULL) {
+            input = fopen(inputs[l].file, "rb");
+            if (input == NULL) {
+                lane->error = "could not open input";
+            } else {
+                lane->text = map_datafile(input, &lane->len, &lane->mapped);
+                if (lane->text == NULL)
+                    lane->error = "could not read program or input";
+                fclose(input);
+            }
+        }
+        console_init(&lane->console, lane->text, lane->len);
+        for (p = 0; p < NPAGES; p++)
+            lane->page[p] = base->mem + p * PAGE_LEN;
+
+        for (r = 0; r < NREG; r++)
+            LANE(g->reg[r], l) = inputs[l].preset & 1 << r
+                               ? inputs[l].reg[r] : base->reg[r];
+        LANE(g->cc, l) = base->cc;
+        lane->pc = base->pc;
+        lane->cycles = base->cycles;
+        lane->running = base->running;
+        lane->halt_reason = base->halt_reason;
+
+        if (lane->error == NULL && lane->running) {
+            LANE(g->live, l) = -1;
+            g->nlive++;
+        }
+    }
+}
+
+/* Step the gang until every lane has halted, used up its budget or
+ * gone on by itself */
+void gang_run(Gang *g)
+{
+    while (g->nlive > 0) {
+        WordVector mask[VECTOR_CHUNKS];
+        int next[VECTOR_LANES];
+        Decoded *d, local;
+        int pc, target, l;
+
+        /* The lanes that have run the most reach the budget first */
+        if (g->converged && g->steps >= g->limit)
+            gang_split(g);
+
+        if (g->converged) {
+            pc = g->pc;
+            memcpy(mask, g->live, sizeof(mask));
+        } else if ((pc = gang_schedule(g, mask)) == INT_MAX) {
+            break;
+        }
+
+        if (pc < 0 || pc >= MEMLEN) {
+            for (l = 0; l < g->nlanes; l++)
+                if (LANE(mask, l))
+                    lane_evict(g, l);
+            continue;
+        }
+
+        d = fetch_decoded(g->base, pc);
+        if (g->written[pc])
+            d = gang_fetch(g, pc, mask, &local);
+
+        switch (d->op) {
+        /* ADD, AND, NOT, LEA: every lane at once */
+        case 0x1:
+        case 0x5:
+        case 0x9:
+        case 0xE:
+            gang_alu(g, d, pc, mask);
+            gang_advance(g, mask, pc + 1);
+            break;
+        /* BR, JSR/JSRR, JMP: the lanes may part here */
+        case 0x0:
+        case 0x4:
+        case 0xC:
+            if ((target = gang_branch(g, d, pc, mask, next)) >= 0)
+                gang_advance(g, mask, target);
+            else
+                gang_diverge(g, mask, next);
+            break;
+        /* Loads and stores: lane by lane */
+        case 0x2:
+        case 0x3:
+        case 0x6:
+        case 0x7:
+        case 0xA:
+        case 0xB:
+            gang_memory(g, d, pc, mask);
+            gang_advance(g, mask, pc + 1);
+            break;
+        /* Traps return to R7, which is the next instruction */
+        case 0xF:
+            for (l = 0; l < g->nlanes; l++)
+                if (LANE(mask, l) && !lane_trap(g, l, d, pc))
+                    LANE(mask, l) = 0;
+            gang_advance(g, mask, (Word) (pc + 1));
+            break;
+        /* RTI and the reserved opcode */
+        default:
+            for (l = 0; l < g->nlanes; l++)
+                if (LANE(mask, l))
+                    lane_evict(g, l);
+            break;
+        }
+    }
+}
+
+/* Diverged: pick the lowest PC a lane is at and put the lanes there in
+ * mask, first stopping the lanes that have used up their budget. When
+ * that is all of them the gang is converged again. Returns the PC, or
+ * INT_MAX if no lane is left */
+int gang_schedule(Gang *g, WordVector *mask)
+{
+    unsigned long most = 0;
+    int l, pc = INT_MAX, n = 0;
+
+    for (l = 0; l < g->nlanes; l++) {
+        Lane *lane = &g->lane[l];
+
+        if (LANE(g->live, l) && lane->cycles >= g->budget)
+            lane_finish(g, l);
+        if (LANE(g->live, l) && lane->pc < pc)
+            pc = lane->pc;
+    }
+
+    memset(mask, 0, VECTOR_CHUNKS * sizeof(WordVector));
+    for (l = 0; l < g->nlanes; l++) {
+        Lane *lane = &g->lane[l];
+
+        if (LANE(g->live, l) && lane->pc == pc) {
+            LANE(mask, l) = -1;
+            if (lane->cycles > most)
+                most = lane->cycles;
+            n++;
+        }
+    }
+
+    if (n > 0 && n == g->nlive) {
+        g->converged = 1;
+        g->pc = pc;
+        g->steps = 0;
+        g->limit = g->budget - most;
+    }
+    return pc;
+}
+
+/* Converged: the live lanes are all at g->pc, each having run g->steps
+ * more instructions than its cycles says. Give each its own PC and
+ * cycle count again */
+void gang_split(Gang *g)
+{
+    int l;
+
+    for (l = 0; l < g->nlanes; l++)
+        if (LANE(g->live, l))
+            lane_sync(g, l);
+    g->converged = 0;
+}
+
+/* Where the lane keeps addr */
+static inline Word *lane_word(Gang *g, int l, Address addr)
+{
+    return &g->lane[l].page[addr >> PAGE_SHIFT][addr & (PAGE_LEN - 1)];
+}
+
+/* Some lane has stored to pc. The lanes of mask that find the same
+ * word there as the first of them execute it; the others are taken
+ * out of mask and wait for the next step */
+Decoded *gang_fetch(Gang *g, int pc, WordVector *mask, Decoded *local)
+{
+    Word word = 0;
+    int l, first = 1, parted = 0;
+
+    for (l = 0; l < g->nlanes; l++) {
+        if (!LANE(mask, l))
+            continue;
+        if (first) {
+            word = *lane_word(g, l, pc);
+            first = 0;
+        } else if (*lane_word(g, l, pc) != word) {
+            LANE(mask, l) = 0;
+            parted = 1;
+        }
+    }
+
+    if (parted && g->converged)
+        gang_split(g);
+    decode_instr(word, local);
+    return local;
+}
+
+/* ADD, AND, NOT and LEA for the lanes of mask, VECTOR_WIDTH at a time.
+ * The result only goes to the lanes in mask; the others keep their
+ * registers and condition codes */
+VECTOR_CLONES void gang_alu(Gang *g, const Decoded *d, int pc,
+                            const WordVector *mask)
+{
+    WordVector zero = { 0 };
+    int c;
+
+    for (c = 0; c < VECTOR_CHUNKS; c++) {
+        WordVector src = g->reg[d->src][c];
+        WordVector src2 = d->imm ? zero + d->offset : g->reg[d->src2][c];
+        WordVector m = mask[c], r, cc;
+
+        switch (d->op) {
+        case 0x1:
+            r = src + src2;
+            break;
+        case 0x5:
+            r = src & src2;
+            break;
+        case 0x9:
+            r = ~src;
+            break;
+        default:
+            r = zero + (Word) (Address) (pc + 1 + d->offset);
+            break;
+        }
+
+        cc = ((r > 0) & 1) | ((r == 0) & 2) | ((r < 0) & 4);
+        g->reg[d->dst][c] = (r & m) | (g->reg[d->dst][c] & ~m);
+        g->cc[c] = (cc & m) | (g->cc[c] & ~m);
+    }
+}
+
+/* Is any lane of v non-zero? */
+static inline int vector_any(const WordVector *v)
+{
+    unsigned long long words[sizeof(*v) / sizeof(unsigned long long)];
+    unsigned long long any = 0;
+    size_t i;
+
+    memcpy(words, v, sizeof(*v));
+    for (i = 0; i < sizeof(*v) / sizeof(unsigned long long); i++)
+        any |= words[i];
+    return any != 0;
+}
+
+/* BR, JSR/JSRR or JMP for the lanes of mask. Returns the PC they all
+ * go on to, or -1 if they part, with each lane's next PC in next */
+VECTOR_CLONES int gang_branch(Gang *g, const Decoded *d, int pc,
+                              const WordVector *mask, int *next)
+{
+    WordVector zero = { 0 }, parted = zero, link = zero + (Word) (pc + 1);
+    int c, l, target;
+
+    if (d->op == 0x0) {
+        WordVector taken = zero, not_taken = zero;
+
+        for (c = 0; c < VECTOR_CHUNKS; c++) {
+            WordVector t = (g->cc[c] & d->dst) != 0;
+
+            taken |= t & mask[c];
+            not_taken |= ~t & mask[c];
+        }
+        if (!vector_any(&not_taken))
+            return (Address) (pc + 1 + d->offset);
+        if (!vector_any(&taken))
+            return pc + 1;
+
+        for (l = 0; l < g->nlanes; l++)
+            if (LANE(mask, l))
+                next[l] = (LANE(g->cc, l) & d->dst) != 0 ?
+                          (Address) (pc + 1 + d->offset) : pc + 1;
+        return -1;
+    }
+
+    /* JSR goes to PC + offset; JSRR and JMP to a register, which must
+     * be the same in every lane for them to stay together */
+    if (d->op == 0x4 && d->imm) {
+        target = (Address) (pc + 1 + d->offset);
+    } else {
+        for (l = 0; !LANE(mask, l); l++)
+            ;
+        target = (Address) LANE(g->reg[d->src], l);
+        for (c = 0; c < VECTOR_CHUNKS; c++)
+            parted |= (g->reg[d->src][c] != (Word) target) & mask[c];
+        if (vector_any(&parted))
+            for (l = 0; l < g->nlanes; l++)
+                if (LANE(mask, l))
+                    next[l] = (Address) LANE(g->reg[d->src], l);
+    }
+
+    /* The target was read before R7 is overwritten (JSRR R7) */
+    if (d->op == 0x4)
+        for (c = 0; c < VECTOR_CHUNKS; c++)
+            g->reg[7][c] = (link & mask[c]) | (g->reg[7][c] & ~mask[c]);
+
+    return vector_any(&parted) ? -1 : target;
+}
+
+/* The lanes of mask have executed one more instruction and go on to pc */
+void gang_advance(Gang *g, const WordVector *mask, int pc)
+{
+    int l;
+
+    if (g->converged) {
+        g->pc = pc;
+        g->steps++;
+        return;
+    }
+
+    for (l = 0; l < g->nlanes; l++) {
+        if (LANE(mask, l) && LANE(g->live, l)) {
+            g->lane[l].pc = pc;
+            g->lane[l].cycles++;
+        }
+    }
+}
+
+/* The same when the lanes of mask go different ways, each on to its
+ * own next[lane]: the gang is split */
+void gang_diverge(Gang *g, const WordVector *mask, const int *next)
+{
+    int l;
+
+    if (g->converged)
+        gang_split(g);
+    for (l = 0; l < g->nlanes; l++) {
+        if (LANE(mask, l)) {
+            g->lane[l].pc = next[l];
+            g->lane[l].cycles++;
+        }
+    }
+}
+
+/* Bring a lane's PC and cycle count up to date with the gang's */
+void lane_sync(Gang *g, int l)
+{
+    if (g->converged) {
+        g->lane[l].pc = g->pc;
+        g->lane[l].cycles += g->steps;
+    }
+}
+
+/* The lane stops being stepped, with whatever state it has */
+void lane_finish(Gang *g, int l)
+{
+    LANE(g->live, l) = 0;
+    g->nlive--;
+}
+
+/* The lane halts executing the instruction at pc */
+void lane_halt(Gang *g, int l, int reason, int pc)
+{
+    Lane *lane = &g->lane[l];
+
+    lane_sync(g, l);
+    lane->pc = pc;
+    lane->cycles++;
+    lane->running = 0;
+    lane->halt_reason = reason;
+    lane_finish(g, l);
+}
+
+/* A store by the lane: its first one to a page gets it a copy */
+void lane_store(Gang *g, int l, Address addr, Word value)
+{
+    Word **page = &g->lane[l].page[addr >> PAGE_SHIFT];
+
+    if (*page == g->base->mem + (addr & ~(PAGE_LEN - 1))) {
+        Word *copy = malloc(PAGE_LEN * sizeof(Word));
+
+        if (copy == NULL) {
+            printf("error: Could not allocate a page of lane %d\n", l);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(copy, *page, PAGE_LEN * sizeof(Word));
+        *page = copy;
+    }
+
+    (*page)[addr & (PAGE_LEN - 1)] = value;
+    g->written[addr] = 1;
+}
+
+/* LD, LDR, LDI, ST, STR or STI for the lanes of mask, a lane at a
+ * time. A lane reaching for the devices goes on by itself instead,
+ * before anything is changed, and is taken out of mask */
+void gang_memory(Gang *g, const Decoded *d, int pc, WordVector *mask)
+{
+    int relative = d->op == 0x6 || d->op == 0x7;
+    int indirect = d->op == 0xA || d->op == 0xB;
+    int store = d->op == 0x3 || d->op == 0x7 || d->op == 0xB;
+    int l;
+
+    for (l = 0; l < g->nlanes; l++) {
+        Address addr;
+        Word value;
+
+        if (!LANE(mask, l))
+            continue;
+
+        addr = relative ? LANE(g->reg[d->src], l) + d->offset
+                        : pc + 1 + d->offset;
+        if (indirect && addr < IO_BASE)
+            addr = *lane_word(g, l, addr);
+        if (addr >= IO_BASE) {
+            lane_evict(g, l);
+            LANE(mask, l) = 0;
+            continue;
+        }
+
+        if (store) {
+            value = LANE(g->reg[d->dst], l);
+            lane_store(g, l, addr, value);
+        } else {
+            value = *lane_word(g, l, addr);
+            LANE(g->reg[d->dst], l) = value;
+        }
+        LANE(g->cc, l) = value > 0 ? 1 : value == 0 ? 2 : 4;
+    }
+}
+
+/* TRAP for one lane, as trap_instr does it. The console calls go
+ * through the gang's spare cpu, pointed at the lane's console.
+ * Returns 0 if the lane halted */
+int lane_trap(Gang *g, int l, const Decoded *d, int pc)
+{
+    Lane *lane = &g->lane[l];
+    CPU *cpu = g->cpu;
+    Address addr;
+
+    cpu->console = &lane->console;
+    cpu->trace = TRACE_NONE;
+    cpu->history = NULL;
+    LANE(g->reg[7], l) = pc + 1;
+
+    switch (d->offset) {
+    case 0x20:
+        LANE(g->reg[0], l) = console_read(&lane->console);
+        break;
+    case 0x21:
+        console_putc(cpu, LANE(g->reg[0], l));
+        break;
+    case 0x22:
+        addr = LANE(g->reg[0], l);
+        while (*lane_word(g, l, addr) != 0)
+            console_putc(cpu, *lane_word(g, l, addr++));
+        break;
+    case 0x23:
+        console_puts(cpu, "Input a character: ");
+        LANE(g->reg[0], l) = console_read(&lane->console);
+        break;
+    case 0x24:
+        lane_halt(g, l, HALT_BAD_TRAP, (Word) (pc + 1));
+        return 0;
+    case 0x25:
+        lane_halt(g, l, HALT_TRAP, (Word) (pc + 1));
+        return 0;
+    }
+    return 1;
+}
+
+/* The lane goes on by itself on the gang's spare cpu, from where it
+ * is, with what is left of its budget, and leaves the gang */
+void lane_evict(Gang *g, int l)
+{
+    Lane *lane = &g->lane[l];
+    CPU *cpu = g->cpu;
+    int p, r;
+
+    lane_sync(g, l);
+
+    *cpu = *g->base;
+    for (p = 0; p < NPAGES; p++)
+        if (lane->page[p] != g->base->mem + p * PAGE_LEN)
+            memcpy(cpu->mem + p * PAGE_LEN, lane->page[p],
+                   PAGE_LEN * sizeof(Word));
+    flush_icache(cpu);
+    for (r = 0; r < NREG; r++)
+        cpu->reg[r] = LANE(g->reg[r], l);
+    cpu->pc = lane->pc;
+    cpu->cc = LANE(g->cc, l);
+    cpu->cycles = lane->cycles;
+    cpu->console = &lane->console;
+
+    timed_run(cpu, g->budget - lane->cycles);
+
+    for (r = 0; r < NREG; r++)
+        LANE(g->reg[r], l) = cpu->reg[r];
+    LANE(g->cc, l) = cpu->cc;
+    lane->pc = cpu->pc;
+    lane->cycles = cpu->cycles;
+    lane->running = cpu->running;
+    lane->halt_reason = cpu->halt_reason;
+    lane_finish(g, l);
+}
+
+/* One result line per lane, as batch mode writes them, jobs being
+ * numbered from first. Returns how many didn't halt normally */
+int gang_report(Gang *g, FILE *results, int first, char *program)
+{
+    CPU *cpu = g->cpu;
+    int l, r, failed = 0;
+
+    for (l = 0; l < g->nlanes; l++) {
+        Lane *lane = &g->lane[l];
+
+        fprintf(results, "job=%d program=%s", first + l, program);
+        if (lane->error != NULL) {
+            fprintf(results, " error=\"%s\"\n", lane->error);
+            failed++;
+            continue;
+        }
+
+        for (r = 0; r < NREG; r++)
+            cpu->reg[r] = LANE(g->reg[r], l);
+        cpu->cc = LANE(g->cc, l);
+        cpu->pc = lane->pc;
+        cpu->cycles = lane->cycles;
+        cpu->running = lane->running;
+        cpu->halt_reason = lane->halt_reason;
+        if (!batch_report(results, cpu, &lane->console))
+            failed++;
+    }
+    return failed;
+}
+
+/* Give back the lanes' pages, output and inputs */
+void gang_free(Gang *g)
+{
+    int l, p;
+
+    for (l = 0; l < g->nlanes; l++) {
+        Lane *lane = &g->lane[l];
+
+        for (p = 0; p < NPAGES; p++)
+            if (lane->page[p] != g->base->mem + p * PAGE_LEN)
+                free(lane->page[p]);
+        free(lane->console.out);
+        if (lane->text != NULL)
+            unmap_datafile(lane->text, lane->len, lane->mapped);
+    }
+}
+
+/* Start recording a binary trace of everything executed from now on */
+void trace_open(CPU *cpu, char *trace_name)
+{
+    TraceHeader header;
+
+    cpu->trace_file = fopen(trace_name, "wb");
+    if (cpu->trace_file == NULL) {
+        printf("error: Could not open trace file %s\n", trace_name);
+        exit(EXIT_FAILURE);
+    }
+
+    cpu->trace_ring = malloc(TRACE_RING_LEN * sizeof(TraceRecord));
+    if (cpu->trace_ring == NULL) {
+        printf("error: Could not allocate the trace buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    cpu->trace_count = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, 4);
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    memcpy(header.reg, cpu->reg, sizeof(header.reg));
+    header.pc = cpu->pc;
+    header.cc = cpu->cc;
+    fwrite(&header, sizeof(header), 1, cpu->trace_file);
+}
+
+/* Append the instruction just executed (fetched from pc) to the
+ * trace ring, writing the ring out each time it fills up */
+void trace_record(CPU *cpu, const Decoded *d, Address pc)
+{
+    TraceRecord *r = &cpu->trace_ring[cpu->trace_count & (TRACE_RING_LEN-1)];
+
+    r->pc = pc;
+    r->ir = cpu->ir;
+    r->value = 0;
+    r->ea = 0;
+    r->cc = cpu->cc;
+    r->flags = 0;
+
+    /* d->op may already be stale if the instruction overwrote itself */
+    switch((cpu->ir & 0xF000) >> 12) {
+    /* BR */
+    case 0x0:
+        if ((cpu->cc & d->dst) != 0)
+            r->flags = TR_TAKEN;
+        r->ea = cpu->pc;
+        break;
+    /* LD, LDR, LDI */
+    case 0x2:
+    case 0x6:
+    case 0xA:
+        r->ea = cpu->ea;
+        r->value = cpu->reg[d->dst];
+        break;
+    /* ST, STR, STI */
+    case 0x3:
+    case 0x7:
+    case 0xB:
+        r->ea = cpu->ea;
+        r->value = cpu->mem[cpu->ea];
+        break;
+    /* JSR, JMP */
+    case 0x4:
+    case 0xC:
+        r->ea = cpu->pc;
+        r->value = cpu->reg[7];
+        break;
+    /* TRAP */
+    case 0xF:
+        r->ea = d->offset;
+        r->value = cpu->reg[0];
+        break;
+    /* RTI, reserved: nothing was written */
+    case 0x8:
+    case 0xD:
+        break;
+    /* ADD, AND, NOT, LEA */
+    default:
+        r->value = cpu->reg[d->dst];
+        break;
+    }
+
+    if ((++cpu->trace_count & (TRACE_RING_LEN-1)) == 0)
+        trace_flush(cpu, TRACE_RING_LEN);
+}
+
+/* Write the first nrecords records of the ring to the trace file */
+void trace_flush(CPU *cpu, size_t nrecords)
+{
+    if (fwrite(cpu->trace_ring, sizeof(TraceRecord), nrecords,
+               cpu->trace_file) != nrecords)
+        printf("error: Could not write the trace file\n");
+}
+
+/* Write out whatever is left in the ring and stop recording */
+void trace_close(CPU *cpu)
+{
+    if (cpu->trace_ring == NULL)
+        return;
+
+    trace_flush(cpu, cpu->trace_count & (TRACE_RING_LEN-1));
+    fclose(cpu->trace_file);
+    free(cpu->trace_ring);
+
+    cpu->trace_ring = NULL;
+    cpu->trace_file = NULL;
+}
+
+/* Print one record of a binary trace the way a full trace would
+ * have, then bring the shadow machine up to date with it */
+void replay_record(CPU *cpu, const TraceRecord *r)
+{
+    int opcode = (r->ir & 0xF000) >> 12;
+    Decoded d;
+
+    decode_instr(r->ir, &d);
+    cpu->ir = r->ir;
+    cpu->pc = (Address) (r->pc + 1);
+
+    printf("x%04X: x%04X ", r->pc, r->ir);
+
+    /* Input traps would read the console, take them from the record */
+    if (opcode == 0xF && (d.offset == 0x20 || d.offset == 0x23)) {
+        if (d.offset == 0x20)
+            printf("Trap x20(GETC): ");
+        else
+            printf("TRAP x23(IN) Input a character: ");
+        printf("Read:%c = %d", (Word) r->value, (Word) r->value);
+        cpu->reg[7] = cpu->pc;
+    } else {
+        d.handler(cpu, &d);
+    }
+    printf("\n");
+
+    /* Apply the recorded results in case the shadow machine got them
+     * wrong, e.g. because memory was changed from the command loop */
+    switch(opcode) {
+    case 0x3:
+    case 0x7:
+    case 0xB:
+        write_word(cpu, r->ea, r->value);
+        break;
+    case 0x4:
+    case 0xC:
+        cpu->reg[7] = r->value;
+        break;
+    case 0xF:
+        cpu->reg[0] = r->value;
+        break;
+    case 0x0:
+    case 0x8:
+    case 0xD:
+        break;
+    default:
+        cpu->reg[d.dst] = r->value;
+        break;
+    }
+    cpu->cc = r->cc;
+}
+
+/* --decode-trace: print a binary trace recorded from the loaded
+ * program as text. Every instruction is re-executed on a shadow
+ * machine (starting from the registers in the trace header) to
+ * produce the same text as --trace=full */
+int decode_trace(CPU *cpu, char *trace_name)
+{
+    TraceHeader header;
+    TraceRecord *records;
+    size_t nrecords, i;
+
+    FILE *trace = fopen(trace_name, "rb");
+    if (trace == NULL) {
+        printf("error: Could not open trace file %s\n", trace_name);
+        return EXIT_FAILURE;
+    }
+
+    if (fread(&header, sizeof(header), 1, trace) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, 4) != 0 ||
+        header.version != TRACE_VERSION ||
+        header.record_size != sizeof(TraceRecord)) {
+        printf("error: %s is not an LC-3 trace file\n", trace_name);
+        fclose(trace);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(cpu->reg, header.reg, sizeof(cpu->reg));
+    cpu->pc = header.pc;
+    cpu->cc = header.cc;
+    cpu->trace = TRACE_FULL;
+    cpu->tracing = 1;
+
+    records = malloc(TRACE_RING_LEN * sizeof(TraceRecord));
+    if (records == NULL) {
+        printf("error: Could not allocate the trace buffer\n");
+        fclose(trace);
+        return EXIT_FAILURE;
+    }
+
+    while ((nrecords = fread(records, sizeof(TraceRecord),
+                             TRACE_RING_LEN, trace)) > 0) {
+        for (i = 0; i < nrecords; i++)
+            replay_record(cpu, &records[i]);
+    }
+
+    free(records);
+    fclose(trace);
+    return EXIT_SUCCESS;
+}
+
+/* Copy the architectural state into snap. If snap is the snapshot
+ * the dirty pages are relative to, only those pages are copied */
+void snapshot_take(CPU *cpu, Snapshot *snap)
+{
+    int page;
+
+    if (snap == cpu->snap_base) {
+        for (page = 0; page < NPAGES; page++)
+            if (PAGE_DIRTY(cpu, page))
+                memcpy(snap->mem + (page << PAGE_SHIFT),
+                       cpu->mem + (page << PAGE_SHIFT), PAGE_LEN * sizeof(Word));
+    } else {
+        memcpy(snap->mem, cpu->mem, sizeof(snap->mem));
+    }
+
+    memcpy(snap->reg, cpu->reg, sizeof(snap->reg));
+    snap->pc = cpu->pc;
+    snap->running = cpu->running;
+    snap->cc = cpu->cc;
+    snap->ir = cpu->ir;
+    snap->origin = cpu->origin;
+    snap->halt_reason = cpu->halt_reason;
+    snap->cycles = cpu->cycles;
+    snap->status = cpu->status;
+
+    memset(cpu->dirty, 0, sizeof(cpu->dirty));
+    cpu->snap_base = snap;
+}
+
+/* Put the cpu back in the state saved in snap. Only the pages stored
+ * to since then are copied back if the dirty bitmap is relative to
+ * snap; otherwise all of memory is. Returns the number of pages copied */
+int snapshot_restore(CPU *cpu, Snapshot *snap)
+{
+    int page, i, copied = 0;
+
+    if (snap == cpu->snap_base) {
+        for (page = 0; page < NPAGES; page++) {
+            int base = page << PAGE_SHIFT;
+
+            if (!PAGE_DIRTY(cpu, page))
+                continue;
+
+            memcpy(cpu->mem + base, snap->mem + base, PAGE_LEN * sizeof(Word));
+            for (i = base; i < base + PAGE_LEN; i++) {
+                cpu->icache[i].op = OP_FUSE;
+                if (cpu->jit != NULL && cpu->jit->codemap[i])
+                    jit_invalidate(cpu->jit, i);
+            }
+            copied++;
+        }
+    } else {
+        memcpy(cpu->mem, snap->mem, sizeof(cpu->mem));
+        flush_icache(cpu);
+        copied = NPAGES;
+    }
+
+    memcpy(cpu->reg, snap->reg, sizeof(cpu->reg));
+    cpu->pc = snap->pc;
+    cpu->running = snap->running;
+    cpu->cc = snap->cc;
+    cpu->ir = snap->ir;
+    cpu->origin = snap->origin;
+    cpu->halt_reason = snap->halt_reason;
+    cpu->cycles = snap->cycles;
+    cpu->status = snap->status;
+    events_schedule(cpu);
+
+    memset(cpu->dirty, 0, sizeof(cpu->dirty));
+    cpu->snap_base = snap;
+
+    return copied;
+}
+
+/* Write a snapshot to disk. Returns 0, or -1 after printing why not */
+int snapshot_save(Snapshot *snap, char *snap_name)
+{
+    SnapshotHeader header;
+    FILE *file = fopen(snap_name, "wb");
+
+    if (file == NULL) {
+        printf("error: Could not open snapshot file %s\n", snap_name);
+        return -1;
+    }
+
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    header.version = SNAP_VERSION;
+    header.pad = 0;
+    header.size = sizeof(Snapshot);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(snap, sizeof(Snapshot), 1, file) != 1) {
+        printf("error: Could not write snapshot file %s\n", snap_name);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/* Read a snapshot written by snapshot_save. Returns 0, or -1 after
+ * printing why not */
+int snapshot_load(Snapshot *snap, char *snap_name)
+{
+    SnapshotHeader header;
+    FILE *file = fopen(snap_name, "rb");
+
+    if (file == NULL) {
+        printf("error: Could not open snapshot file %s\n", snap_name);
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, SNAP_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAP_VERSION || header.size != sizeof(Snapshot)) {
+        printf("error: %s is not a snapshot from this simulator\n", snap_name);
+        fclose(file);
+        return -1;
+    }
+
+    if (fread(snap, sizeof(Snapshot), 1, file) != 1) {
+        printf("error: %s is truncated\n", snap_name);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/* s [FILE]: take a snapshot, also saving it to FILE if given.
+ * l [FILE]: go back to the last snapshot, or to the one in FILE */
+void snapshot_command(Command *cmd, CPU *cpu)
+{
+    char *snap_name = NULL;
+    int named;
+
+    /* The name may follow the letter directly (sFILE) */
+    if (cmd->word[0][1] != '\0')
+        snap_name = cmd->word[0] + 1;
+    else if (cmd->nwords > 1)
+        snap_name = cmd->word[1];
+    named = snap_name != NULL;
+
+    if (cpu->snapshot == NULL) {
+        cpu->snapshot = calloc(1, sizeof(Snapshot));
+        if (cpu->snapshot == NULL) {
+            printf("error: Could not allocate a snapshot\n");
+            return;
+        }
+    }
+
+    if (cmd->word[0][0] == 's') {
+        snapshot_take(cpu, cpu->snapshot);
+        printf("Snapshot taken at x%04X after %lu instructions\n",
+               cpu->pc, cpu->cycles);
+        if (named && snapshot_save(cpu->snapshot, snap_name) == 0)
+            printf("Saved to %s\n", snap_name);
+    } else if (named) {
+        /* Never treat a snapshot read from disk as the dirty base */
+        if (cpu->snap_base == cpu->snapshot)
+            cpu->snap_base = NULL;
+        if (snapshot_load(cpu->snapshot, snap_name) == 0) {
+            snapshot_restore(cpu, cpu->snapshot);
+            printf("Restored %s: PC x%04X after %lu instructions\n",
+                   snap_name, cpu->pc, cpu->cycles);
+        }
+    } else if (cpu->snap_base != cpu->snapshot) {
+        printf("No snapshot to go back to; take one with s\n");
+    } else {
+        int copied = snapshot_restore(cpu, cpu->snapshot);
+        printf("Restored snapshot: PC x%04X, %d of %d pages copied\n",
+               cpu->pc, copied, NPAGES);
+    }
+}
+
+/* --snapshot: load the cpu from a snapshot file instead of a program */
+void start_from_snapshot(CPU *cpu, char *snap_name)
+{
+    Snapshot *snap = calloc(1, sizeof(Snapshot));
+
+    printf("Loading snapshot %s\n\n", snap_name);
+    if (snap == NULL || snapshot_load(snap, snap_name) != 0)
+        exit(EXIT_FAILURE);
+
+    snapshot_restore(cpu, snap);
+    cpu->snapshot = snap;
+}
+
+/* --save-snapshot: write the final state out. Returns 0 or -1 */
+int finish_snapshot(CPU *cpu, char *snap_name)
+{
+    if (cpu->snapshot == NULL)
+        cpu->snapshot = calloc(1, sizeof(Snapshot));
+    if (cpu->snapshot == NULL) {
+        printf("error: Could not allocate a snapshot\n");
+        return -1;
+    }
+
+    snapshot_take(cpu, cpu->snapshot);
+    if (snapshot_save(cpu->snapshot, snap_name) != 0)
+        return -1;
+
+    printf("Saved snapshot to %s\n", snap_name);
+    return 0;
+}
+
+/* Breakpoints and watchpoints. Each address has a byte of BP_* flags
+ * saying what kind of breakpoint covers it; the list is only searched
+ * when a flag matches. None of this is looked at unless a breakpoint
+ * exists: run_cycles then hands over to debug_cycles instead of the
+ * fast loop */
+
+/* Run like run_cycles, stopping at breakpoints and watchpoints. The
+ * instruction at the starting PC never triggers a breakpoint, so that
+ * continuing from one works */
+unsigned long debug_cycles(CPU *cpu, unsigned long nbr_cycles)
+{
+    Debug *debug = cpu->debug;
+    unsigned long start = cpu->cycles;
+    Breakpoint *bp;
+
+    debug->stopped = 0;
+
+    while (cpu->cycles - start < nbr_cycles && cpu->running != 0) {
+        Address pc = cpu->pc, addr[2];
+        int access[2], n = 0, i;
+
+        if (cpu->pc >= 0 && cpu->pc < MEMLEN) {
+            if ((debug->flags[pc] & BP_EXEC) && cpu->cycles != start &&
+                (bp = debug_match(cpu, pc, BP_EXEC)) != NULL) {
+                console_flush(cpu);
+                printf("Breakpoint %d at x%04X\n", bp->number, pc);
+                debug->stopped = bp->number;
+                break;
+            }
+            if (debug->nwatch > 0)
+                n = instr_accesses(cpu, pc, addr, access);
+        }
+
+        one_instruction_cycle(cpu);
+        if (cpu->tracing)
+            printf("\n");
+        events_due(cpu);
+
+        for (i = 0; i < n; i++) {
+            if ((debug->flags[addr[i]] & access[i]) &&
+                (bp = debug_match(cpu, addr[i], access[i])) != NULL) {
+                console_flush(cpu);
+                printf("Watchpoint %d: x%04X %s x%04X, now x%04X\n",
+                       bp->number, pc,
+                       access[i] == BP_READ ? "read" : "wrote",
+                       addr[i], cpu->mem[addr[i]] & 0xFFFF);
+                debug->stopped = bp->number;
+                break;
+            }
+        }
+        if (debug->stopped)
+            break;
+    }
+
+    return cpu->cycles - start;
+}
+
+/* The first breakpoint of the given kind covering addr whose
+ * condition holds, or NULL. Counts the hit */
+Breakpoint *debug_match(CPU *cpu, Address addr, int kind)
+{
+    Debug *debug = cpu->debug;
+    int i;
+
+    for (i = 0; i < MAX_BREAKPOINTS; i++) {
+        Breakpoint *bp = &debug->bp[i];
+        Word value;
+        int hit;
+
+        if (bp->number == 0 || !(bp->kind & kind) ||
+            addr < bp->lo || addr > bp->hi)
+            continue;
+
+        value = bp->cond_reg >= 0 ? cpu->reg[bp->cond_reg] : 0;
+        switch (bp->cond_op) {
+        case COND_EQ: hit = value == bp->cond_value; break;
+        case COND_NE: hit = value != bp->cond_value; break;
+        case COND_LT: hit = value <  bp->cond_value; break;
+        case COND_LE: hit = value <= bp->cond_value; break;
+        case COND_GT: hit = value >  bp->cond_value; break;
+        case COND_GE: hit = value >= bp->cond_value; break;
+        default:      hit = 1;                       break;
+        }
+
+        if (hit) {
+            bp->hits++;
+            return bp;
+        }
+    }
+
+    return NULL;
+}
+
+/* Memory locations the instruction at pc is about to access, with
+ * BP_READ or BP_WRITE for each. Returns how many (at most two) */
+int instr_accesses(CPU *cpu, Address pc, Address addr[2], int access[2])
+{
+    Decoded *d = fetch_decoded(cpu, pc);
+    Address next = pc + 1;
+
+    switch (d->op) {
+    case 0x2: /* LD */
+    case 0x3: /* ST */
+        addr[0] = next + d->offset;
+        access[0] = d->op == 0x2 ? BP_READ : BP_WRITE;
+        return 1;
+    case 0x6: /* LDR */
+    case 0x7: /* STR */
+        addr[0] = cpu->reg[d->src] + d->offset;
+        access[0] = d->op == 0x6 ? BP_READ : BP_WRITE;
+        return 1;
+    case 0xA: /* LDI */
+    case 0xB: /* STI */
+        addr[0] = next + d->offset;
+        access[0] = BP_READ;
+        addr[1] = cpu->mem[addr[0]];
+        access[1] = d->op == 0xA ? BP_READ : BP_WRITE;
+        return 2;
+    }
+
+    return 0;
+}
+
+/* Recompute the per-address flags from the breakpoint list */
+void debug_update_flags(Debug *debug)
+{
+    int i, addr;
+
+    memset(debug->flags, 0, sizeof(debug->flags));
+    debug->nbreakpoints = 0;
+    debug->nwatch = 0;
+
+    for (i = 0; i < MAX_BREAKPOINTS; i++) {
+        Breakpoint *bp = &debug->bp[i];
+
+        if (bp->number == 0)
+            continue;
+        for (addr = bp->lo; addr <= bp->hi; addr++)
+            debug->flags[addr] |= bp->kind;
+        debug->nbreakpoints++;
+        if (bp->kind != BP_EXEC)
+            debug->nwatch++;
+    }
+}
+
+/* Add a breakpoint, returning it, or NULL if all slots are taken */
+Breakpoint *debug_add(CPU *cpu, Address lo, Address hi, int kind)
+{
+    Debug *debug = cpu->debug;
+    int i;
+
+    if (debug == NULL) {
+        debug = cpu->debug = calloc(1, sizeof(Debug));
+        if (debug == NULL)
+            return NULL;
+    }
+
+    for (i = 0; i < MAX_BREAKPOINTS; i++) {
+        Breakpoint *bp = &debug->bp[i];
+
+        if (bp->number != 0)
+            continue;
+
+        bp->number = ++debug->last_number;
+        bp->lo = lo;
+        bp->hi = hi;
+        bp->kind = kind;
+        bp->cond_reg = -1;
+        bp->cond_op = COND_NONE;
+        bp->cond_value = 0;
+        bp->hits = 0;
+        return bp;
+    }
+
+    return NULL;
+}
+
+/* Parse " if RN OP VALUE" (VALUE as xNNNN or #N) into bp.
+ * Returns 0, or -1 if it doesn't look like that */
+int parse_condition(char *text, Breakpoint *bp)
+{
+    static char *ops[] = { "==", "!=", "<", "<=", ">", ">=" };
+    char op[3];
+    int reg, value, i;
+
+    if (sscanf(text, " if R%d %2[=!<>] x%x", &reg, op, &value) != 3 &&
+        sscanf(text, " if R%d %2[=!<>] #%d", &reg, op, &value) != 3)
+        return -1;
+    if (reg < 0 || reg >= NREG)
+        return -1;
+
+    for (i = 0; i < 6; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            bp->cond_reg = reg;
+            bp->cond_op = COND_EQ + i;
+            bp->cond_value = value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* b: list breakpoints and watchpoints
+ * b xNNNN [if RN OP VALUE]: break when the PC gets there
+ * w xNNNN [xMMMM] [r|w|rw] [if RN OP VALUE]: break on access to the
+ *     location or range (writes by default)
+ * x [N]: delete breakpoint N, or all of them */
+void breakpoint_command(char *cmd_buffer, CPU *cpu)
+{
+    static char *cond_ops[] = { "", "==", "!=", "<", "<=", ">", ">=" };
+    unsigned int lo, hi;
+    int kind = BP_EXEC, number, i, used = 0;
+    char mode[3] = "w", *rest;
+    Breakpoint *bp;
+
+    switch (cmd_buffer[0]) {
+    case 'b':
+        if (sscanf(cmd_buffer, "b x%x%n", &lo, &used) != 1) {
+            if (cpu->debug == NULL || cpu->debug->nbreakpoints == 0) {
+                printf("No breakpoints\n");
+                return;
+            }
+            for (i = 0; i < MAX_BREAKPOINTS; i++) {
+                bp = &cpu->debug->bp[i];
+                if (bp->number == 0)
+                    continue;
+                printf("%d: %s x%04X", bp->number,
+                       bp->kind == BP_EXEC ? "break at" : "watch", bp->lo);
+                if (bp->hi != bp->lo)
+                    printf("-x%04X", bp->hi);
+                if (bp->kind != BP_EXEC)
+                    printf(" %s%s", bp->kind & BP_READ ? "r" : "",
+                           bp->kind & BP_WRITE ? "w" : "");
+                if (bp->cond_reg >= 0)
+                    printf(" if R%d %s x%04X", bp->cond_reg,
+                           cond_ops[bp->cond_op], bp->cond_value & 0xFFFF);
+                printf(", hit %lu times\n", bp->hits);
+            }
+            return;
+        }
+        hi = lo;
+        break;
+    case 'w':
+        if (sscanf(cmd_buffer, "w x%x%n", &lo, &used) != 1) {
+            printf("Watch command should be w xNNNN [xMMMM] [r|w|rw]\n");
+            return;
+        }
+        hi = lo;
+        i = 0;
+        if (sscanf(cmd_buffer + used, " x%x%n", &hi, &i) == 1)
+            used += i;
+        i = 0;
+        if (sscanf(cmd_buffer + used, " %2[rw]%n", mode, &i) == 1)
+            used += i;
+        kind = (strchr(mode, 'r') ? BP_READ : 0) |
+               (strchr(mode, 'w') ? BP_WRITE : 0);
+        break;
+    default:
+        if (sscanf(cmd_buffer, "x %d", &number) != 1) {
+            if (cpu->debug != NULL) {
+                memset(cpu->debug->bp, 0, sizeof(cpu->debug->bp));
+                debug_update_flags(cpu->debug);
+            }
+            printf("Deleted all breakpoints\n");
+            return;
+        }
+        for (i = 0; cpu->debug != NULL && i < MAX_BREAKPOINTS; i++) {
+            if (cpu->debug->bp[i].number == number) {
+                cpu->debug->bp[i].number = 0;
+                debug_update_flags(cpu->debug);
+                printf("Deleted breakpoint %d\n", number);
+                return;
+            }
+        }
+        printf("No breakpoint %d\n", number);
+        return;
+    }
+
+    if (lo > 0xFFFF || hi > 0xFFFF || hi < lo) {
+        printf("Bad address range x%X-x%X\n", lo, hi);
+        return;
+    }
+
+    bp = debug_add(cpu, lo, hi, kind);
+    if (bp == NULL) {
+        printf("Too many breakpoints (%d at most)\n", MAX_BREAKPOINTS);
+        return;
+    }
+
+    rest = cmd_buffer + used;
+    while (*rest == ' ' || *rest == '\t')
+        rest++;
+    if (*rest != '\n' && *rest != '\0' && parse_condition(rest, bp) != 0) {
+        printf("Condition should be if RN ==|!=|<|<=|>|>= xNNNN (or #N)\n");
+        bp->number = 0;
+        return;
+    }
+
+    debug_update_flags(cpu->debug);
+    printf("%s %d at x%04X\n", kind == BP_EXEC ? "Breakpoint" : "Watchpoint",
+           bp->number, lo);
+}
+
+/* c [N]: run until a breakpoint, a watchpoint or a halt (or until N
+ * instructions have executed) */
+void continue_command(char *cmd_buffer, CPU *cpu)
+{
+    unsigned long nbr_cycles = ULONG_MAX, done;
+
+    if (sscanf(cmd_buffer, "c %lu", &nbr_cycles) == 0) {
+        printf("Continue command should be c [N]\n");
+        return;
+    }
+    if (cpu->running == 0) {
+        printf("halted!\n");
+        return;
+    }
+
+    done = timed_run(cpu, nbr_cycles);
+
+    if (cpu->running == 0)
+        printf("Halted: %s after %lu instructions\n",
+               halt_reasons[cpu->halt_reason], done);
+    else if (cpu->debug == NULL || cpu->debug->stopped == 0)
+        printf("Stopped after %lu instructions\n", done);
+}
+
+/* Reverse execution. While the command loop runs a program, every
+ * instruction leaves an UndoRecord with whatever it overwrote, so
+ * stepping back N instructions just undoes the last N records. The
+ * records live in a ring, so the oldest ones are eventually lost;
+ * for those a full checkpoint is kept every CHECKPOINT_INTERVAL
+ * instructions, and going back further than the ring reaches means
+ * restoring the checkpoint before the target and re-executing up to
+ * it. Input read by GETC/IN is journaled, so re-executed (and redone)
+ * instructions read the same characters again */
+
+/* Start recording from the current state */
+void history_init(CPU *cpu)
+{
+    cpu->history = calloc(1, sizeof(History));
+    if (cpu->history == NULL) {
+        printf("warning: no memory for reverse execution\n");
+        return;
+    }
+    history_reset(cpu);
+}
+
+/* Forget the past, e.g. after a command changed the state in a way
+ * no instruction did */
+void history_reset(CPU *cpu)
+{
+    History *history = cpu->history;
+
+    if (history == NULL)
+        return;
+
+    history->nundo = 0;
+    history->ncheckpoints = 0;
+    history->start_cycles = cpu->cycles;
+}
+
+/* Called before each instruction is fetched: note what it may change */
+void history_begin(CPU *cpu)
+{
+    History *history = cpu->history;
+    UndoRecord *rec = &history->cur;
+    unsigned long done = cpu->cycles - history->start_cycles;
+
+    if (done % CHECKPOINT_INTERVAL == 0)
+        history_checkpoint(cpu);
+
+    rec->pc = cpu->pc;
+    rec->ir = cpu->ir;
+    rec->cc = cpu->cc;
+    rec->flags = 0;
+    rec->reg[0] = rec->reg[1] = UNDO_NOREG;
+    memcpy(history->reg, cpu->reg, sizeof(history->reg));
+    history->active = 1;
+}
+
+/* Called after it executed: keep the registers it changed */
+void history_end(CPU *cpu)
+{
+    History *history = cpu->history;
+    UndoRecord *rec = &history->cur;
+    int r, n = 0;
+
+    for (r = 0; r < NREG && n < 2; r++) {
+        if (cpu->reg[r] != history->reg[r]) {
+            rec->reg[n] = r;
+            rec->old[n++] = history->reg[r];
+        }
+    }
+
+    history->undo[history->undo_end++ & (UNDO_LEN - 1)] = *rec;
+    if (history->nundo < UNDO_LEN)
+        history->nundo++;
+    history->active = 0;
+}
+
+/* A store is about to overwrite mem[addr] */
+void history_store(CPU *cpu, Address addr)
+{
+    UndoRecord *rec = &cpu->history->cur;
+
+    rec->flags |= UNDO_STORE;
+    rec->addr = addr;
+    rec->mem = cpu->mem[addr];
+}
+
+/* Input for GETC/IN: from the journal if this point was reached
+ * before, from the terminal (and into the journal) otherwise */
+int history_getc(CPU *cpu)
+{
+    History *history = cpu->history;
+    char input = 0;
+
+    if (history->active)
+        history->cur.flags |= UNDO_INPUT;
+
+    if (history->input_pos < history->input_len)
+        return history->input[history->input_pos++];
+
+    input = console_read(&terminal);
+    if (history->input_len == history->input_cap) {
+        char *bigger = realloc(history->input, history->input_cap =
+                               history->input_cap ? 2 * history->input_cap
+                                                  : 256);
+        if (bigger == NULL) {
+            printf("error: Could not grow the input journal\n");
+            exit(EXIT_FAILURE);
+        }
+        history->input = bigger;
+    }
+    history->input[history->input_len++] = input;
+    history->input_pos++;
+
+    return input;
+}
+
+/* Remember the whole state every CHECKPOINT_INTERVAL instructions,
+ * the oldest checkpoint making room for the newest */
+void history_checkpoint(CPU *cpu)
+{
+    History *history = cpu->history;
+    Checkpoint *cp;
+
+    if (history->ncheckpoints > 0 &&
+        history->checkpoint[(history->first_checkpoint +
+                             history->ncheckpoints - 1) % NCHECKPOINTS]
+                                 .state.cycles == cpu->cycles)
+        return;
+
+    if (history->ncheckpoints == NCHECKPOINTS) {
+        history->first_checkpoint = (history->first_checkpoint + 1)
+                                    % NCHECKPOINTS;
+        history->ncheckpoints--;
+    }
+    cp = &history->checkpoint[(history->first_checkpoint +
+                               history->ncheckpoints++) % NCHECKPOINTS];
+
+    memcpy(cp->state.mem, cpu->mem, sizeof(cp->state.mem));
+    memcpy(cp->state.reg, cpu->reg, sizeof(cp->state.reg));
+    cp->state.pc = cpu->pc;
+    cp->state.running = cpu->running;
+    cp->state.cc = cpu->cc;
+    cp->state.ir = cpu->ir;
+    cp->state.origin = cpu->origin;
+    cp->state.halt_reason = cpu->halt_reason;
+    cp->state.cycles = cpu->cycles;
+    cp->state.status = cpu->status;
+    cp->input_pos = history->input_pos;
+}
+
+/* Undo the most recent instruction */
+void history_undo(CPU *cpu)
+{
+    History *history = cpu->history;
+    UndoRecord *rec = &history->undo[--history->undo_end & (UNDO_LEN - 1)];
+    int n;
+
+    history->nundo--;
+
+    if (rec->flags & UNDO_STORE)
+        write_word(cpu, rec->addr, rec->mem);
+    if (rec->flags & UNDO_INPUT)
+        history->input_pos--;
+    for (n = 0; n < 2 && rec->reg[n] != UNDO_NOREG; n++)
+        cpu->reg[rec->reg[n]] = rec->old[n];
+
+    cpu->pc = rec->pc;
+    cpu->ir = rec->ir;
+    cpu->cc = rec->cc;
+    cpu->running = 1;
+    cpu->halt_reason = HALT_NONE;
+    cpu->cycles--;
+}
+
+/* Go back nbr_cycles instructions. Returns 0, or -1 (with the state
+ * unchanged) if the history doesn't reach that far */
+int history_back(CPU *cpu, unsigned long nbr_cycles)
+{
+    History *history = cpu->history;
+    unsigned long target;
+    Checkpoint *cp;
+    int i, trace;
+    TraceRecord *trace_ring;
+
+    if (nbr_cycles > cpu->cycles - history->start_cycles)
+        return -1;
+    target = cpu->cycles - nbr_cycles;
+
+    if (nbr_cycles <= history->nundo) {
+        while (cpu->cycles > target)
+            history_undo(cpu);
+    } else {
+        /* Past the undo records: newest checkpoint before the target */
+        for (i = history->ncheckpoints - 1; i >= 0; i--) {
+            cp = &history->checkpoint[(history->first_checkpoint + i)
+                                      % NCHECKPOINTS];
+            if (cp->state.cycles <= target)
+                break;
+        }
+        if (i < 0)
+            return -1;
+        history->ncheckpoints = i + 1;
+
+        memcpy(cpu->mem, cp->state.mem, sizeof(cpu->mem));
+        memcpy(cpu->reg, cp->state.reg, sizeof(cpu->reg));
+        cpu->pc = cp->state.pc;
+        cpu->running = cp->state.running;
+        cpu->cc = cp->state.cc;
+        cpu->ir = cp->state.ir;
+        cpu->halt_reason = cp->state.halt_reason;
+        cpu->cycles = cp->state.cycles;
+        cpu->status = cp->state.status;
+        events_schedule(cpu);
+        history->input_pos = cp->input_pos;
+        flush_icache(cpu);
+        memset(cpu->dirty, 0xFF, sizeof(cpu->dirty));
+
+        /* Re-execute up to the target quietly, recording as usual */
+        history->nundo = 0;
+        trace = cpu->trace;
+        trace_ring = cpu->trace_ring;
+        cpu->trace = TRACE_NONE;
+        cpu->trace_ring = NULL;
+        history->replaying = 1;
+        while (cpu->cycles < target) {
+            one_instruction_cycle(cpu);
+            events_due(cpu);
+        }
+        history->replaying = 0;
+        cpu->trace = trace;
+        cpu->trace_ring = trace_ring;
+    }
+
+    /* Checkpoints of the future that was just undone */
+    while (history->ncheckpoints > 0 &&
+           history->checkpoint[(history->first_checkpoint +
+                                history->ncheckpoints - 1) % NCHECKPOINTS]
+                                    .state.cycles > cpu->cycles)
+        history->ncheckpoints--;
+
+    return 0;
+}
+
+/* Go back to just before the most recent instruction that wrote
+ * mem[addr]. Returns how many instructions that undid, or 0 (with
+ * the state unchanged) if no recorded instruction did */
+unsigned long history_back_to_write(CPU *cpu, Address addr)
+{
+    History *history = cpu->history;
+    unsigned long n;
+
+    for (n = 1; n <= history->nundo; n++) {
+        UndoRecord *rec = &history->undo[(history->undo_end - n)
+                                         & (UNDO_LEN - 1)];
+
+        if ((rec->flags & UNDO_STORE) && rec->addr == addr) {
+            history_back(cpu, n);
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+/* u [N]: step back N instructions (1 by default).
+ * u w xNNNN: go back to the last write of mem[xNNNN] */
+void undo_command(char *cmd_buffer, CPU *cpu)
+{
+    unsigned long nbr_cycles = 1, n;
+    unsigned int addr;
+
+    if (cpu->history == NULL) {
+        printf("Reverse execution is not available\n");
+    } else if (sscanf(cmd_buffer, "u w x%x", &addr) == 1) {
+        n = history_back_to_write(cpu, addr);
+        if (n == 0)
+            printf("No recorded instruction wrote x%04X\n", addr & 0xFFFF);
+        else
+            printf("Went back %lu instructions to x%04X, "
+                   "which writes x%04X\n", n, cpu->pc, addr & 0xFFFF);
+    } else if (sscanf(cmd_buffer, "u %lu", &nbr_cycles) == 0 ||
+               strncmp(cmd_buffer, "u w", 3) == 0) {
+        printf("Undo command should be u [N] or u w xNNNN\n");
+    } else if (history_back(cpu, nbr_cycles) != 0) {
+        printf("The history doesn't reach back %lu instructions\n",
+               nbr_cycles);
+    } else {
+        printf("Went back %lu instructions to x%04X\n", nbr_cycles, cpu->pc);
+    }
+}
+
+/* Assembler (--assemble): LC-3 assembly source to a .obj image.
+ *
+ * A single tokenizer makes one pass over the source, turning every
+ * line into a Statement with its address and operands, and entering
+ * labels into an open-addressing hash table. The second pass then
+ * walks the statements (not the text) and encodes them, now that
+ * every label's address is known. Labels are case sensitive;
+ * mnemonics, directives and registers are not */
+
+/* Mnemonics, filled in on first use */
+static SymbolTable mnemonic_table;
+static pthread_once_t mnemonic_once = PTHREAD_ONCE_INIT;
+
+/* Formats of the operands, with the fixed bits of the instruction */
+static const Mnemonic mnemonics[] = {
+    { "ADD",   FMT_ADD,   0x1000 }, { "AND",   FMT_ADD,   0x5000 },
+    { "NOT",   FMT_NOT,   0x903F },
+    { "LD",    FMT_PC9,   0x2000 }, { "ST",    FMT_PC9,   0x3000 },
+    { "LDI",   FMT_PC9,   0xA000 }, { "STI",   FMT_PC9,   0xB000 },
+    { "LEA",   FMT_PC9,   0xE000 },
+    { "LDR",   FMT_OFF6,  0x6000 }, { "STR",   FMT_OFF6,  0x7000 },
+    { "BR",    FMT_BR,    0x0E00 }, { "BRNZP", FMT_BR,    0x0E00 },
+    { "BRN",   FMT_BR,    0x0800 }, { "BRZ",   FMT_BR,    0x0400 },
+    { "BRP",   FMT_BR,    0x0200 }, { "BRNZ",  FMT_BR,    0x0C00 },
+    { "BRNP",  FMT_BR,    0x0A00 }, { "BRZP",  FMT_BR,    0x0600 },
+    { "JMP",   FMT_BASE,  0xC000 }, { "JSRR",  FMT_BASE,  0x4000 },
+    { "JSR",   FMT_PC11,  0x4800 },
+    { "RET",   FMT_NONE,  0xC1C0 }, { "RTI",   FMT_NONE,  0x8000 },
+    { "TRAP",  FMT_TRAP,  0xF000 },
+    { "GETC",  FMT_NONE,  0xF020 }, { "OUT",   FMT_NONE,  0xF021 },
+    { "PUTS",  FMT_NONE,  0xF022 }, { "IN",    FMT_NONE,  0xF023 },
+    { "PUTSP", FMT_NONE,  0xF024 }, { "HALT",  FMT_NONE,  0xF025 },
+    { ".ORIG", FMT_ORIG,  0 },      { ".FILL", FMT_FILL,  0 },
+    { ".BLKW", FMT_BLKW,  0 },      { ".STRINGZ", FMT_STRINGZ, 0 },
+    { ".END",  FMT_END,   0 }
+};
+
+/* Operands each format takes */
+static const int format_nargs[] = {
+    0, 3, 2, 2, 3, 1, 1, 1, 1, 1, 1, 1, 1, 0
+};
+
+# define NMNEMONICS (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+/* FNV-1a */
+static unsigned int symbol_hash(const char *name, int len)
+{
+    unsigned int h = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+/* The symbol called name, entered (undefined) if it isn't there yet
+ * and insert is set. Returns its index, or -1 */
+int symbol_lookup(SymbolTable *table, const char *name, int len, int insert)
+{
+    unsigned int hash = symbol_hash(name, len);
+    unsigned int i;
+    Symbol *sym;
+
+    /* Keep the table at most half full */
+    if (insert && 2 * (table->count + 1) > table->mask + 1) {
+        int nslots = table->mask ? 2 * (table->mask + 1) : 1024, j;
+        int *slots = calloc(nslots, sizeof(int));
+
+        if (slots == NULL) {
+            printf("error: out of memory for the symbol table\n");
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < table->count; j++) {
+            i = table->sym[j].hash & (nslots - 1);
+            while (slots[i] != 0)
+                i = (i + 1) & (nslots - 1);
+            slots[i] = j + 1;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->mask = nslots - 1;
+    }
+    if (table->mask == 0)
+        return -1;
+
+    for (i = hash & table->mask; table->slots[i] != 0;
+         i = (i + 1) & table->mask) {
+        sym = &table->sym[table->slots[i] - 1];
+        if (sym->hash == hash && sym->len == len &&
+            memcmp(sym->name, name, len) == 0)
+            return table->slots[i] - 1;
+    }
+    if (!insert)
+        return -1;
+
+    if (table->count == table->cap) {
+        int cap = table->cap ? 2 * table->cap : 1024;
+        Symbol *bigger = realloc(table->sym, cap * sizeof(Symbol));
+
+        if (bigger == NULL) {
+            printf("error: out of memory for the symbol table\n");
+            exit(EXIT_FAILURE);
+        }
+        table->sym = bigger;
+        table->cap = cap;
+    }
+    sym = &table->sym[table->count];
+    sym->name = name;
+    sym->len = len;
+    sym->hash = hash;
+    sym->address = -1;
+    sym->line = 0;
+    table->slots[i] = ++table->count;
+    return table->count - 1;
+}
+
+static void init_mnemonics(void)
+{
+    size_t i;
+
+    for (i = 0; i < NMNEMONICS; i++) {
+        int n = symbol_lookup(&mnemonic_table, mnemonics[i].name,
+                              strlen(mnemonics[i].name), 1);
+        mnemonic_table.sym[n].address = i;
+    }
+}
+
+/* The mnemonic or directive a word names, or NULL */
+static const Mnemonic *find_mnemonic(const char *word, int len)
+{
+    char upper[10];
+    int i, n;
+
+    if (len > 8)
+        return NULL;
+    for (i = 0; i < len; i++)
+        upper[i] = (word[i] >= 'a' && word[i] <= 'z')
+                 ? word[i] - 'a' + 'A' : word[i];
+
+    n = symbol_lookup(&mnemonic_table, upper, len, 0);
+    return n < 0 ? NULL : &mnemonics[mnemonic_table.sym[n].address];
+}
+
+static void asm_error(Assembler *as, int line, const char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(as->messages, "%s:%d: error: ", as->name, line);
+    va_start(args, fmt);
+    vfprintf(as->messages, fmt, args);
+    va_end(args);
+    fprintf(as->messages, "\n");
+    as->errors++;
+}
+
+# define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == ',')
+# define IS_END(c) ((c) == '\n' || (c) == ';')
+# define IS_WORD(c) (((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z') || \
+                     ((c) >= '0' && (c) <= '9') || (c) == '_' || (c) == '.')
+
+/* A number: #-12, 12, -12, x1F, X1F or 0x1F. Returns 1 and its value
+ * if the whole word is one */
+static int parse_number(const unsigned char *p, int len, int *value)
+{
+    int base = 10, neg = 0, v = 0, i = 0;
+
+    if (len > 0 && p[0] == '#') {
+        i = 1;
+    } else if (len > 1 && (p[0] == 'x' || p[0] == 'X')) {
+        base = 16;
+        i = 1;
+    } else if (len > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        i = 2;
+    }
+    if (i < len && (p[i] == '-' || p[i] == '+'))
+        neg = p[i++] == '-';
+    if (i == len)
+        return 0;
+
+    for (; i < len; i++) {
+        int digit = base == 16 ? hex_digit[p[i]] : p[i] - '0';
+
+        if (digit < 0 || digit >= base)
+            return 0;
+        if (v < 0x100000)
+            v = v * base + digit;
+    }
+
+    *value = neg ? -v : v;
+    return 1;
+}
+
+/* Characters of a string literal once its escapes are replaced,
+ * storing them if out is not NULL. Returns -1 for a bad escape */
+static int unescape(const unsigned char *p, int len, Word *out)
+{
+    int i, n = 0;
+
+    for (i = 0; i < len; i++, n++) {
+        int c = p[i];
+
+        if (c == '\\') {
+            if (++i == len)
+                return -1;
+            switch (p[i]) {
+            case 'n':  c = '\n'; break;
+            case 't':  c = '\t'; break;
+            case 'r':  c = '\r'; break;
+            case '0':  c = 0;    break;
+            case 'e':  c = 27;   break;
+            case '\\': c = '\\'; break;
+            case '"':  c = '"';  break;
+            case '\'': c = '\''; break;
+            default:
+                return -1;
+            }
+        }
+        if (out != NULL)
+            out[n] = c;
+    }
+
+    return n;
+}
+
+/* The next token of the line at *pp, leaving *pp after it. Returns
+ * 0 at the end of the line (*pp is then at the newline, if any) */
+static int next_token(Assembler *as, const unsigned char **pp,
+                      const unsigned char *end, int line, Operand *tok)
+{
+    const unsigned char *p = *pp, *start;
+
+    while (p < end && IS_SPACE(*p))
+        p++;
+    if (p == end || IS_END(*p)) {
+        *pp = p;
+        return 0;
+    }
+
+    start = p;
+    tok->text = (const char *) p;
+    if (*p == '"') {
+        for (p++; p < end && *p != '"' && *p != '\n'; p++)
+            if (*p == '\\' && p + 1 < end && p[1] != '\n')
+                p++;
+        if (p == end || *p != '"') {
+            asm_error(as, line, "unterminated string");
+            tok->kind = ARG_NONE;
+        } else {
+            tok->kind = ARG_STRING;
+            tok->text++;
+            tok->len = p - start - 1;
+            p++;
+        }
+    } else {
+        while (p < end && !IS_SPACE(*p) && !IS_END(*p) && *p != '"')
+            p++;
+        tok->len = p - start;
+        if (parse_number(start, tok->len, &tok->value)) {
+            tok->kind = ARG_NUMBER;
+        } else if (tok->len == 2 && (start[0] == 'R' || start[0] == 'r') &&
+                   start[1] >= '0' && start[1] <= '7') {
+            tok->kind = ARG_REG;
+            tok->value = start[1] - '0';
+        } else {
+            int i;
+
+            tok->kind = ARG_LABEL;
+            for (i = 0; i < tok->len; i++)
+                if (!IS_WORD(start[i])) {
+                    asm_error(as, line, "unexpected '%c' in '%.*s'",
+                              start[i], tok->len, tok->text);
+                    tok->kind = ARG_NONE;
+                    break;
+                }
+        }
+    }
+
+    *pp = p;
+    return 1;
+}
+
+/* First pass: tokenize every line into a Statement with its address,
+ * defining labels as they are found */
+static void assemble_pass1(Assembler *as, const unsigned char *p,
+                           const unsigned char *end)
+{
+    int line = 1, address = -1, ended = 0;
+
+    while (p < end) {
+        const Mnemonic *mn = NULL;
+        Statement *s;
+        Operand tok;
+        int have;
+
+        have = next_token(as, &p, end, line, &tok);
+        if (have && tok.kind == ARG_LABEL &&
+            (mn = find_mnemonic(tok.text, tok.len)) == NULL) {
+            /* A label, on its own or before a statement */
+            int n = symbol_lookup(&as->symbols, tok.text, tok.len, 1);
+            Symbol *sym = &as->symbols.sym[n];
+
+            if (tok.text[0] >= '0' && tok.text[0] <= '9')
+                asm_error(as, line, "bad label '%.*s'", tok.len, tok.text);
+            else if (address < 0)
+                asm_error(as, line, "label '%.*s' before .ORIG",
+                          tok.len, tok.text);
+            else if (sym->address >= 0)
+                asm_error(as, line, "'%.*s' already defined on line %d",
+                          tok.len, tok.text, sym->line);
+            sym->address = address < 0 ? 0 : address;
+            sym->line = line;
+
+            have = next_token(as, &p, end, line, &tok);
+            if (have && tok.kind == ARG_LABEL)
+                mn = find_mnemonic(tok.text, tok.len);
+            if (have && mn == NULL) {
+                asm_error(as, line, "expected an instruction after '%.*s', "
+                          "found '%.*s'", sym->len, sym->name,
+                          tok.len, tok.text);
+                goto next_line;
+            }
+        }
+
+        if (!have)
+            goto next_line;
+        if (mn == NULL) {
+            asm_error(as, line, "expected an instruction, found '%.*s'",
+                      tok.len, tok.text);
+            goto next_line;
+        }
+        if (mn->format == FMT_END) {
+            ended = 1;
+            break;
+        }
+
+        if (as->nstatements == as->cap) {
+            int cap = as->cap ? 2 * as->cap : 4096;
+            Statement *bigger = realloc(as->statements,
+                                        cap * sizeof(Statement));
+            if (bigger == NULL) {
+                printf("error: out of memory assembling %s\n", as->name);
+                exit(EXIT_FAILURE);
+            }
+            as->statements = bigger;
+            as->cap = cap;
+        }
+        s = &as->statements[as->nstatements];
+        s->mnemonic = mn;
+        s->line = line;
+        s->address = address;
+        s->nargs = 0;
+        while (next_token(as, &p, end, line, &tok)) {
+            if (s->nargs == MAX_OPERANDS) {
+                asm_error(as, line, "too many operands");
+                goto next_line;
+            }
+            if (tok.kind == ARG_LABEL)
+                tok.value = symbol_lookup(&as->symbols, tok.text, tok.len, 1);
+            s->arg[s->nargs++] = tok;
+        }
+        if (s->nargs != format_nargs[mn->format]) {
+            asm_error(as, line, "%s takes %d operand%s", mn->name,
+                      format_nargs[mn->format],
+                      format_nargs[mn->format] == 1 ? "" : "s");
+            goto next_line;
+        }
+
+        /* Where the next statement goes */
+        if (mn->format == FMT_ORIG) {
+            if (address >= 0) {
+                asm_error(as, line, "only one .ORIG is supported");
+            } else if (s->arg[0].kind != ARG_NUMBER ||
+                       s->arg[0].value < 0 || s->arg[0].value >= MEMLEN) {
+                asm_error(as, line, ".ORIG needs an address");
+            } else {
+                as->origin = address = s->arg[0].value;
+            }
+            goto next_line;
+        }
+        if (address < 0) {
+            asm_error(as, line, "%s before .ORIG", mn->name);
+            goto next_line;
+        }
+        if (mn->format == FMT_BLKW) {
+            if (s->arg[0].kind != ARG_NUMBER || s->arg[0].value < 0)
+                asm_error(as, line, ".BLKW needs a count");
+            else
+                address += s->arg[0].value;
+        } else if (mn->format == FMT_STRINGZ) {
+            int n = s->arg[0].kind == ARG_STRING
+                  ? unescape((const unsigned char *) s->arg[0].text,
+                             s->arg[0].len, NULL) : -1;
+            /* Not kept for pass 2, which would store its characters */
+            if (n < 0) {
+                asm_error(as, line, ".STRINGZ needs a string");
+                goto next_line;
+            }
+            address += n + 1;
+        } else {
+            address++;
+        }
+        if (address > MEMLEN) {
+            asm_error(as, line, "program runs past the end of memory");
+            break;
+        }
+        as->nstatements++;
+
+    next_line:
+        p = memchr(p, '\n', end - p);
+        if (p == NULL)
+            break;
+        p++;
+        line++;
+    }
+
+    if (address < 0 && as->errors == 0)
+        asm_error(as, line, "no .ORIG");
+    else if (!ended && as->errors == 0)
+        asm_error(as, end[-1] == '\n' ? line - 1 : line,
+                  "no .END");
+    as->end = address < 0 ? 0 : address;
+}
+
+/* Operand i of s as a register */
+static int asm_reg(Assembler *as, Statement *s, int i)
+{
+    if (s->arg[i].kind != ARG_REG) {
+        asm_error(as, s->line, "%s: operand %d should be a register",
+                  s->mnemonic->name, i + 1);
+        return 0;
+    }
+    return s->arg[i].value;
+}
+
+/* Operand i of s as a signed field of bits bits: a number, or a label
+ * as an offset from the incremented PC if pc_relative */
+static int asm_field(Assembler *as, Statement *s, int i, int bits,
+                     int pc_relative)
+{
+    Operand *arg = &s->arg[i];
+    int value, lo = -(1 << (bits - 1)), hi = (1 << (bits - 1)) - 1;
+
+    if (arg->kind == ARG_NUMBER) {
+        value = arg->value;
+    } else if (arg->kind == ARG_LABEL && pc_relative) {
+        Symbol *sym = &as->symbols.sym[arg->value];
+
+        if (sym->address < 0) {
+            asm_error(as, s->line, "undefined label '%.*s'",
+                      sym->len, sym->name);
+            return 0;
+        }
+        value = sym->address - (s->address + 1);
+    } else {
+        asm_error(as, s->line, "%s: operand %d should be a %s",
+                  s->mnemonic->name, i + 1,
+                  pc_relative ? "label or offset" : "number");
+        return 0;
+    }
+
+    if (value < lo || value > hi) {
+        asm_error(as, s->line, "%s: %.*s is out of range (%d to %d)",
+                  s->mnemonic->name, arg->len, arg->text, lo, hi);
+        return 0;
+    }
+    return value & ((1 << bits) - 1);
+}
+
+/* Second pass: encode every statement into as->image */
+static void assemble_pass2(Assembler *as)
+{
+    int i;
+
+    as->image = calloc(as->end - as->origin + 1, sizeof(Word));
+    if (as->image == NULL) {
+        printf("error: out of memory assembling %s\n", as->name);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < as->nstatements; i++) {
+        Statement *s = &as->statements[i];
+        Word *w = &as->image[s->address - as->origin];
+        int bits = s->mnemonic->bits;
+
+        switch (s->mnemonic->format) {
+        case FMT_ADD:
+            bits |= asm_reg(as, s, 0) << 9 | asm_reg(as, s, 1) << 6;
+            if (s->arg[2].kind == ARG_REG)
+                bits |= asm_reg(as, s, 2);
+            else
+                bits |= 0x20 | asm_field(as, s, 2, 5, 0);
+            break;
+        case FMT_NOT:
+            bits |= asm_reg(as, s, 0) << 9 | asm_reg(as, s, 1) << 6;
+            break;
+        case FMT_PC9:
+            bits |= asm_reg(as, s, 0) << 9 | asm_field(as, s, 1, 9, 1);
+            break;
+        case FMT_OFF6:
+            bits |= asm_reg(as, s, 0) << 9 | asm_reg(as, s, 1) << 6
+                  | asm_field(as, s, 2, 6, 0);
+            break;
+        case FMT_BR:
+            bits |= asm_field(as, s, 0, 9, 1);
+            break;
+        case FMT_BASE:
+            bits |= asm_reg(as, s, 0) << 6;
+            break;
+        case FMT_PC11:
+            bits |= asm_field(as, s, 0, 11, 1);
+            break;
+        case FMT_TRAP:
+            if (s->arg[0].kind != ARG_NUMBER ||
+                s->arg[0].value < 0 || s->arg[0].value > 0xFF)
+                asm_error(as, s->line, "TRAP needs a vector from x00 to xFF");
+            else
+                bits |= s->arg[0].value;
+            break;
+        case FMT_FILL:
+            if (s->arg[0].kind == ARG_LABEL) {
+                Symbol *sym = &as->symbols.sym[s->arg[0].value];
+
+                if (sym->address < 0)
+                    asm_error(as, s->line, "undefined label '%.*s'",
+                              sym->len, sym->name);
+                bits = sym->address;
+            } else if (s->arg[0].kind != ARG_NUMBER ||
+                       s->arg[0].value < -0x8000 || s->arg[0].value > 0xFFFF) {
+                asm_error(as, s->line, ".FILL needs a 16 bit value or a label");
+            } else {
+                bits = s->arg[0].value;
+            }
+            break;
+        case FMT_BLKW:
+            continue;
+        case FMT_STRINGZ:
+            unescape((const unsigned char *) s->arg[0].text, s->arg[0].len, w);
+            continue;
+        }
+
+        *w = bits;
+    }
+}
+
+/* Assemble len bytes of source. Returns 0, or -1 after printing the
+ * errors to messages; as is filled in either way and has to be freed */
+int assemble(Assembler *as, const char *text, size_t len, const char *name,
+             FILE *messages)
+{
+    const unsigned char *p = (const unsigned char *) text;
+
+    memset(as, 0, sizeof(Assembler));
+    as->name = name;
+    as->messages = messages;
+    if (hex_digit[0] == 0)
+        init_hex_digits();
+    pthread_once(&mnemonic_once, init_mnemonics);
+
+    /* The second pass runs even after errors, to report its own */
+    assemble_pass1(as, p, p + len);
+    assemble_pass2(as);
+
+    return as->errors ? -1 : 0;
+}
+
+void assembler_free(Assembler *as)
+{
+    free(as->statements);
+    free(as->symbols.slots);
+    free(as->symbols.sym);
+    free(as->image);
+}
+
+/* out_name with its extension (if any) replaced by ext */
+static char *replace_extension(const char *out_name, const char *ext)
+{
+    const char *dot = strrchr(out_name, '.'), *slash = strrchr(out_name, '/');
+    size_t base = (dot != NULL && (slash == NULL || dot > slash))
+                ? (size_t) (dot - out_name) : strlen(out_name);
+    char *name = malloc(base + strlen(ext) + 1);
+
+    if (name == NULL) {
+        printf("error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(name, out_name, base);
+    strcpy(name + base, ext);
+    return name;
+}
+
+/* .obj: the origin and then every word, big endian */
+int write_object(Assembler *as, char *obj_name)
+{
+    int n = as->end - as->origin, i;
+    unsigned char *bytes = malloc(2 * (n + 1));
+    FILE *obj;
+
+    if (bytes == NULL) {
+        printf("error: out of memory\n");
+        return -1;
+    }
+    bytes[0] = as->origin >> 8;
+    bytes[1] = as->origin & 0xFF;
+    for (i = 0; i < n; i++) {
+        bytes[2 * i + 2] = (as->image[i] >> 8) & 0xFF;
+        bytes[2 * i + 3] = as->image[i] & 0xFF;
+    }
+
+    obj = fopen(obj_name, "wb");
+    if (obj == NULL || fwrite(bytes, 2, n + 1, obj) != (size_t) n + 1) {
+        printf("error: Could not write %s\n", obj_name);
+        if (obj != NULL)
+            fclose(obj);
+        free(bytes);
+        return -1;
+    }
+
+    free(bytes);
+    return fclose(obj) == 0 ? 0 : -1;
+}
+
+/* .sym: every label with its address, in the usual LC-3 layout */
+int write_symbols(Assembler *as, char *sym_name)
+{
+    FILE *sym = fopen(sym_name, "w");
+    int i;
+
+    if (sym == NULL) {
+        printf("error: Could not write %s\n", sym_name);
+        return -1;
+    }
+
+    fprintf(sym, "// Symbol table\n// Scope level 0:\n"
+                 "//\tSymbol Name       Page Address\n"
+                 "//\t----------------  ------------\n");
+    for (i = 0; i < as->symbols.count; i++) {
+        Symbol *s = &as->symbols.sym[i];
+        fprintf(sym, "//\t%-16.*s  %04X\n", s->len, s->name, s->address);
+    }
+    fprintf(sym, "\n");
+
+    return fclose(sym) == 0 ? 0 : -1;
+}
+
+/* --assemble: write the .obj and .sym for a source file. Returns the
+ * process exit status */
+int assemble_file(char *source_name, char *obj_name)
+{
+    FILE *source = fopen(source_name, "r");
+    struct timespec start, end;
+    char *text, *sym_name, *obj_alloc = NULL;
+    size_t len;
+    int mapped, status;
+    Assembler as;
+    double secs;
+
+    if (source == NULL) {
+        printf("error: Could not open file %s\n", source_name);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    text = map_datafile(source, &len, &mapped);
+    if (text == NULL) {
+        printf("error: Could not read %s\n", source_name);
+        fclose(source);
+        return EXIT_FAILURE;
+    }
+    status = assemble(&as, text, len, source_name, stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (status == 0) {
+        secs = (end.tv_sec - start.tv_sec)
+             + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (obj_name == NULL)
+            obj_name = obj_alloc = replace_extension(source_name, ".obj");
+        sym_name = replace_extension(obj_name, ".sym");
+
+        printf("Assembled %d words, %d symbols from %s in %.3f ms\n",
+               as.end - as.origin, as.symbols.count, source_name, secs * 1e3);
+        if (write_object(&as, obj_name) != 0 ||
+            write_symbols(&as, sym_name) != 0)
+            status = -1;
+        else
+            printf("Wrote %s and %s\n", obj_name, sym_name);
+        free(sym_name);
+        free(obj_alloc);
+    } else {
+        printf("%d error%s, nothing written\n", as.errors,
+               as.errors == 1 ? "" : "s");
+    }
 
-    switch(ident) {
-    case 0:{
-        unsigned int src2;
-        src2 = (7 & cpu->ir); 
+    assembler_free(&as);
+    unmap_datafile(text, len, mapped);
+    fclose(source);
+    return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-        printf("ADD R%d, R%d, R%d;", dst, src1, src2);
-        printf(" R%d <- x%X + x%X ",
-               dst, cpu->reg[src1], cpu->reg[src2]);
+/* JIT: translate straight-line runs of LC-3 instructions ending at a
+ * BR/JSR/JMP (or before a TRAP/RTI) into x86-64 code.
+ *
+ * While in translated code, guest R0-R7 live in r8d-r15d as
+ * sign-extended 16 bit values, rdi holds the cpu, rbp the Jit and rbx
+ * the remaining instruction budget. The condition code is kept lazily:
+ * esi holds a value with the sign of the last result (P > 0, Z == 0,
+ * N < 0) and is only brought up to date where a BR or an exit needs
+ * it, and edx holds the last instruction executed (for cpu->ir).
+ * Blocks jump to each other directly through jit->entry; anything
+ * not translated (TRAP, RTI, stale targets, an exhausted budget) exits
+ * back to jit_run, which lets the interpreter take over. The opcode
+ * counters are only brought up to date where a block is left, by
+ * however many of each opcode ran on the way there */
+
+#ifdef LC3_JIT
+
+/* Host registers */
+# define RAX 0
+# define RCX 1
+# define RDX 2
+# define RBX 3
+# define RBP 5
+# define RSI 6
+# define RDI 7
+# define HREG(r) (8 + (r)) /* host register holding guest register r */
+
+/* Flags for emit_reg/emit_mem/emit_idx */
+# define JW  1 /* REX.W: 64 bit operands */
+# define J16 2 /* 0x66 prefix: 16 bit operands */
+
+/* x86 condition codes used with Jcc */
+# define X86_B  0x2
+# define X86_E  0x4
+# define X86_NE 0x5
+# define X86_L  0xC
+# define X86_GE 0xD
+# define X86_LE 0xE
+# define X86_G  0xF
+
+/* Worst case bytes of code for one guest instruction (plus exits) */
+# define JIT_MAX_INSTR_BYTES 512
+
+static void emit_byte(Jit *jit, int b)
+{
+    jit->code[jit->used++] = b;
+}
 
-        cpu->reg[dst] = (cpu->reg[src1] + cpu->reg[src2]);
+static void emit_long(Jit *jit, int v)
+{
+    memcpy(jit->code + jit->used, &v, 4);
+    jit->used += 4;
+}
 
-        printf("= x%X", cpu->reg[dst]);
+/* Prefixes and opcode (one byte, or two if it starts with 0x0F) */
+static void emit_opcode(Jit *jit, int flags, int opcode,
+                        int reg, int index, int base)
+{
+    int rex = 0x40 | ((flags & JW) ? 8 : 0) | ((reg >> 3) << 2)
+                   | ((index >> 3) << 1) | (base >> 3);
+
+    if (flags & J16)
+        emit_byte(jit, 0x66);
+    if (rex != 0x40)
+        emit_byte(jit, rex);
+    if (opcode > 0xFF)
+        emit_byte(jit, opcode >> 8);
+    emit_byte(jit, opcode & 0xFF);
+}
 
-        calculateCondition(cpu->reg[dst], cpu);
-        generateCondition(cpu);
+/* op reg, rm (both registers) */
+static void emit_reg(Jit *jit, int flags, int opcode, int reg, int rm)
+{
+    emit_opcode(jit, flags, opcode, reg, 0, rm);
+    emit_byte(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
 
-        printf(" CC: %c", cpu->condition);
-    }   break;
-    case 1:{
-        int imm = (31 & cpu->ir);
-        int sign = imm >> 4;
+/* op reg, [base + disp32] */
+static void emit_mem(Jit *jit, int flags, int opcode,
+                     int reg, int base, int disp)
+{
+    emit_opcode(jit, flags, opcode, reg, 0, base);
+    emit_byte(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+    emit_long(jit, disp);
+}
 
-        /* Convert to a negative integer if needed */
-        if (sign == 1)
-            imm -= 32;
+/* op reg, [base + index << scale + disp32] */
+static void emit_idx(Jit *jit, int flags, int opcode, int reg,
+                     int base, int index, int scale, int disp)
+{
+    emit_opcode(jit, flags, opcode, reg, index, base);
+    emit_byte(jit, 0x84 | ((reg & 7) << 3));
+    emit_byte(jit, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    emit_long(jit, disp);
+}
 
-        cpu->reg[dst] = (cpu->reg[src1] + imm);
+/* mov reg32, imm32 */
+static void emit_mov_imm(Jit *jit, int reg, int imm)
+{
+    if (reg >= 8)
+        emit_byte(jit, 0x41);
+    emit_byte(jit, 0xB8 + (reg & 7));
+    emit_long(jit, imm);
+}
 
-        printf("ADD R%d, R%d, %d;", dst, src1, imm);
-        printf(" R%d <- x%X+%d ", dst, cpu->reg[src1], imm);
+/* Jcc/JMP rel32 to a known address */
+static void emit_jump_to(Jit *jit, int cond, unsigned char *target)
+{
+    if (cond < 0) {
+        emit_byte(jit, 0xE9);
+    } else {
+        emit_byte(jit, 0x0F);
+        emit_byte(jit, 0x80 | cond);
+    }
+    emit_long(jit, (int) (target - (jit->code + jit->used + 4)));
+}
 
-        cpu->reg[dst] = (cpu->reg[src1]+imm);
+/* Jcc rel32 to a label defined later: returns where to patch */
+static size_t emit_jump_fwd(Jit *jit, int cond)
+{
+    emit_byte(jit, 0x0F);
+    emit_byte(jit, 0x80 | cond);
+    emit_long(jit, 0);
+    return jit->used - 4;
+}
 
-        printf("= x%X", cpu->reg[dst]);
+/* Point a forward jump at the current position */
+static void patch_jump(Jit *jit, size_t at)
+{
+    int rel = (int) (jit->used - (at + 4));
+    memcpy(jit->code + at, &rel, 4);
+}
 
-        calculateCondition(cpu->reg[dst], cpu);
-        generateCondition(cpu);
+/* Lazy condition code: cc_reg is the guest register holding the last
+ * result, or -1 if esi is already up to date */
+static void emit_sync_cc(Jit *jit, int *cc_reg)
+{
+    if (*cc_reg >= 0)
+        emit_reg(jit, 0, 0x89, HREG(*cc_reg), RSI);  /* mov esi, rN */
+    *cc_reg = -1;
+}
 
-        printf(" CC: %c", cpu->condition);
-    }   break;
-    default:
-            printf("instruction not recognized\n");
-            break;
-    }
+/* The instruction register as of the next exit */
+static void emit_set_ir(Jit *jit, Word ir)
+{
+    emit_mov_imm(jit, RDX, (Address) ir);
 }
 
-void load_instr(CPU *cpu)
+/* Continue at a constant guest address: jump straight into its block
+ * if it is translated, otherwise leave with eax = target */
+static void emit_exit_to(Jit *jit, Address target)
 {
-    int pcoffset = (511 & cpu->ir);
-    unsigned int dst = ((7 << 9) & cpu->ir) >> 9;
-    int flag = pcoffset >> 8;
+    /* mov rax, [rbp + entry[target]]; test rax, rax; jz +2; jmp rax */
+    emit_mem(jit, JW, 0x8B, RAX, RBP,
+             offsetof(Jit, entry) + target * sizeof(unsigned char *));
+    emit_reg(jit, JW, 0x85, RAX, RAX);
+    emit_byte(jit, 0x74);
+    emit_byte(jit, 0x02);
+    emit_byte(jit, 0xFF);
+    emit_byte(jit, 0xE0);
+
+    emit_mov_imm(jit, RAX, target);
+    emit_jump_to(jit, -1, jit->code + jit->exit_offset);
+}
 
-    /* Negative integer calculation? */
-    if (flag == 1)
-        pcoffset -= 512;
+/* Same for a target computed into eax at run time */
+static void emit_exit_dynamic(Jit *jit)
+{
+    /* mov rcx, [rbp + rax*8 + entry]; test rcx, rcx; jz +2; jmp rcx */
+    emit_idx(jit, JW, 0x8B, RCX, RBP, RAX, 3, offsetof(Jit, entry));
+    emit_reg(jit, JW, 0x85, RCX, RCX);
+    emit_byte(jit, 0x74);
+    emit_byte(jit, 0x02);
+    emit_byte(jit, 0xFF);
+    emit_byte(jit, 0xE1);
+
+    emit_jump_to(jit, -1, jit->code + jit->exit_offset);
+}
 
-    printf("LD R%d, %d; ", dst, pcoffset);
+/* Count the instructions of the block executed so far: counts[] of
+ * each opcode, plus one op (-1 for none), plus a taken BR if taken */
+static void emit_counts(Jit *jit, const int *counts, int op, int taken)
+{
+    int i;
 
-    int sum = (cpu->pc + pcoffset);
+    for (i = 0; i < 16; i++) {
+        int n = counts[i] + (i == op);
 
-    printf(" R%d <- M[PC+%d] = M[x%X]", dst, pcoffset, sum);
+        if (n == 0)
+            continue;
+        /* add qword [rdi + stats.ops[i]], n */
+        emit_mem(jit, JW, 0x83, 0, RDI, offsetof(CPU, stats.ops)
+                 + i * sizeof(unsigned long));
+        emit_byte(jit, n);
+    }
+    if (taken) {
+        emit_mem(jit, JW, 0x83, 0, RDI, offsetof(CPU, stats.taken));
+        emit_byte(jit, 1);
+    }
+}
 
-    cpu->reg[dst] = cpu->mem[(cpu->pc) + pcoffset];
+/* After a store to the address in eax (or the constant addr if
+ * addr >= 0): mark the predecoded copy stale and the page dirty, and
+ * if the word belongs
+ * to translated code, leave with the rest of the block unexecuted.
+ * The budget refund is patched in once the block length is known */
+static void emit_store_check(Jit *jit, int addr, Address next_pc, Word ir,
+                             int *cc_reg, size_t *refund_at,
+                             const int *counts, int op)
+{
+    size_t skip;
+    int op_offset = offsetof(CPU, icache) + offsetof(Decoded, op);
+
+    if (addr >= 0) {
+        /* or byte [rdi + dirty + addr/2048], 1 << page%8 */
+        emit_mem(jit, 0, 0x80, 1, RDI, offsetof(CPU, dirty)
+                 + (addr >> (PAGE_SHIFT + 3)));
+        emit_byte(jit, 1 << ((addr >> PAGE_SHIFT) & 7));
+        emit_mem(jit, 0, 0xC6, 0, RDI, op_offset + addr * sizeof(Decoded));
+        emit_byte(jit, OP_DECODE);
+        emit_mem(jit, 0, 0x80, 7, RBP, offsetof(Jit, codemap) + addr);
+        emit_byte(jit, 0);
+    } else {
+        /* mov ecx, eax; shr ecx, PAGE_SHIFT; bts [rdi + dirty], ecx */
+        emit_reg(jit, 0, 0x89, RAX, RCX);
+        emit_reg(jit, 0, 0xC1, 5, RCX);
+        emit_byte(jit, PAGE_SHIFT);
+        emit_mem(jit, 0, 0x0FAB, RCX, RDI, offsetof(CPU, dirty));
+
+        /* imul ecx, eax, sizeof(Decoded); mov byte [rdi+rcx+op], x */
+        emit_reg(jit, 0, 0x69, RCX, RAX);
+        emit_long(jit, sizeof(Decoded));
+        emit_idx(jit, 0, 0xC6, 0, RDI, RCX, 0, op_offset);
+        emit_byte(jit, OP_DECODE);
+        emit_idx(jit, 0, 0x80, 7, RBP, RAX, 0, offsetof(Jit, codemap));
+        emit_byte(jit, 0);
+    }
+    skip = emit_jump_fwd(jit, X86_E);
 
-    calculateCondition(cpu->reg[dst], cpu);
-    generateCondition(cpu); 
+    if (addr >= 0) {
+        emit_mem(jit, 0, 0xC7, 0, RBP, offsetof(Jit, smc_addr));
+        emit_long(jit, addr);
+    } else {
+        emit_mem(jit, 0, 0x89, RAX, RBP, offsetof(Jit, smc_addr));
+    }
+    if (*cc_reg >= 0)
+        emit_reg(jit, 0, 0x89, HREG(*cc_reg), RSI);
+    emit_reg(jit, JW, 0x81, 0, RBX);                  /* add rbx, imm32 */
+    *refund_at = jit->used;
+    emit_long(jit, 0);
+    emit_counts(jit, counts, op, 0);
+    emit_set_ir(jit, ir);
+    emit_mov_imm(jit, RAX, next_pc);
+    emit_jump_to(jit, -1, jit->code + jit->exit_offset);
+
+    patch_jump(jit, skip);
+}
 
-    printf(" = x%04X CC:%c", cpu->reg[dst], cpu->condition);
+/* Before a load or store through the address in eax: the device
+ * registers are left to the interpreter, so from IO_BASE up leave
+ * with the instruction at pc (the n+1st of the block, after one
+ * encoded as last_ir) not executed */
+static void emit_device_check(Jit *jit, Address pc, Word last_ir, int n,
+                              int *cc_reg, size_t *refund_at,
+                              const int *counts)
+{
+    size_t skip;
+
+    emit_byte(jit, 0x3D);                             /* cmp eax, IO_BASE */
+    emit_long(jit, IO_BASE);
+    skip = emit_jump_fwd(jit, X86_B);
+
+    if (*cc_reg >= 0)
+        emit_reg(jit, 0, 0x89, HREG(*cc_reg), RSI);
+    emit_reg(jit, JW, 0x81, 0, RBX);                  /* add rbx, imm32 */
+    *refund_at = jit->used;
+    emit_long(jit, 0);
+    emit_counts(jit, counts, -1, 0);
+    if (n > 0)
+        emit_set_ir(jit, last_ir);
+    emit_mov_imm(jit, RAX, pc);
+    emit_jump_to(jit, -1, jit->code + jit->exit_offset);
+
+    patch_jump(jit, skip);
 }
 
-void store_instr(CPU *cpu)
+/* Emit the entry and exit trampolines at the start of the buffer:
+ *   long enter(CPU *cpu, code, long budget, Jit *jit)
+ * returns the budget left. Translated code leaves through the exit
+ * trampoline with the next guest pc in eax */
+static void jit_emit_trampolines(Jit *jit)
 {
-    int pcoffset = (511 & cpu->ir);
-    int flag = pcoffset >> 8;
+    int r;
 
-    if (flag ==1)
-        pcoffset -= 512;
+    jit->used = 0;
 
-    unsigned int dst = ((7 << 9) &cpu->ir) >> 9;
+    /* push rbx, rbp, r12-r15 */
+    emit_byte(jit, 0x53);
+    emit_byte(jit, 0x55);
+    for (r = 12; r <= 15; r++) {
+        emit_byte(jit, 0x41);
+        emit_byte(jit, 0x50 + (r & 7));
+    }
+    emit_reg(jit, JW, 0x89, RSI, RAX);             /* mov rax, rsi */
+    emit_reg(jit, JW, 0x89, RDX, RBX);             /* mov rbx, rdx */
+    emit_reg(jit, JW, 0x89, RCX, RBP);             /* mov rbp, rcx */
+    for (r = 0; r < NREG; r++)
+        emit_mem(jit, 0, 0x0FBF, HREG(r), RDI,
+                 offsetof(CPU, reg) + r * sizeof(Word));
+
+    /* esi = (cc == P) - (cc == N) */
+    emit_mem(jit, 0, 0x8B, RCX, RDI, offsetof(CPU, cc));
+    emit_reg(jit, 0, 0x31, RSI, RSI);              /* xor esi, esi */
+    emit_reg(jit, 0, 0x31, RDX, RDX);              /* xor edx, edx */
+    emit_reg(jit, 0, 0x83, 7, RCX);                /* cmp ecx, 1 */
+    emit_byte(jit, 1);
+    emit_byte(jit, 0x40);                          /* sete sil */
+    emit_byte(jit, 0x0F);
+    emit_byte(jit, 0x94);
+    emit_byte(jit, 0xC6);
+    emit_reg(jit, 0, 0x83, 7, RCX);                /* cmp ecx, 4 */
+    emit_byte(jit, 4);
+    emit_byte(jit, 0x0F);                          /* sete dl */
+    emit_byte(jit, 0x94);
+    emit_byte(jit, 0xC2);
+    emit_reg(jit, 0, 0x29, RDX, RSI);              /* sub esi, edx */
+    emit_mem(jit, 0, 0x0FB7, RDX, RDI, offsetof(CPU, ir));
+    emit_byte(jit, 0xFF);                          /* jmp rax */
+    emit_byte(jit, 0xE0);
+
+    jit->exit_offset = jit->used;
+    emit_mem(jit, 0, 0x89, RAX, RDI, offsetof(CPU, pc));
+    emit_mem(jit, J16, 0x89, RDX, RDI, offsetof(CPU, ir));
+    for (r = 0; r < NREG; r++)
+        emit_mem(jit, J16, 0x89, HREG(r), RDI,
+                 offsetof(CPU, reg) + r * sizeof(Word));
+
+    /* cc = esi > 0 ? 1 : esi == 0 ? 2 : 4 */
+    emit_reg(jit, 0, 0x85, RSI, RSI);              /* test esi, esi */
+    emit_mov_imm(jit, RAX, 1);
+    emit_mov_imm(jit, RCX, 2);
+    emit_reg(jit, 0, 0x0F44, RAX, RCX);            /* cmove eax, ecx */
+    emit_mov_imm(jit, RCX, 4);
+    emit_reg(jit, 0, 0x0F4C, RAX, RCX);            /* cmovl eax, ecx */
+    emit_mem(jit, 0, 0x89, RAX, RDI, offsetof(CPU, cc));
+
+    emit_reg(jit, JW, 0x89, RBX, RAX);             /* mov rax, rbx */
+    for (r = 15; r >= 12; r--) {
+        emit_byte(jit, 0x41);
+        emit_byte(jit, 0x58 + (r & 7));
+    }
+    emit_byte(jit, 0x5D);
+    emit_byte(jit, 0x5B);
+    emit_byte(jit, 0xC3);
 
-    printf("ST R%d, %x; ",dst, pcoffset);
+    jit->start_offset = jit->used;
+}
 
-    cpu->mem[(cpu->pc) + pcoffset] = cpu->reg[dst];
+/* Set up the JIT for this cpu. Returns 0, or -1 if it can't run here */
+int jit_init(CPU *cpu)
+{
+    Jit *jit = calloc(1, sizeof(Jit));
 
-    int add = (cpu->pc) + pcoffset;   
+    if (jit == NULL)
+        return -1;
 
-    calculateCondition(cpu->reg[dst], cpu);
-    generateCondition(cpu);
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return -1;
+    }
 
-    printf("M[PC+%d] = M[x%04x] <- x%04x CC:%c",
-           pcoffset,add,cpu->mem[add], cpu->condition);
+    jit->smc_addr = -1;
+    jit_emit_trampolines(jit);
+    cpu->jit = jit;
+    return 0;
 }
 
-void jump_subr_instr(CPU *cpu)
+/* Translate the block starting at start. Returns its code, or NULL
+ * if the very first instruction has to be left to the interpreter */
+unsigned char *jit_translate(CPU *cpu, Address start)
 {
-    int switchJump = ((cpu->ir & (1 << 11)) >> 11);
+    Jit *jit = cpu->jit;
+    unsigned char *code;
+    size_t budget_at[2], refund_at[2 * JIT_MAX_BLOCK];
+    int refund_len[2 * JIT_MAX_BLOCK], nrefunds = 0;
+    int n = 0, cc_reg = -1, done = 0, i;
+    int counts[16] = { 0 };  /* opcodes translated so far */
+    Address pc = start;
+    size_t ok;
+
+    /* Out of room: throw every translation away and start over */
+    if (jit->used + (JIT_MAX_BLOCK + 4) * JIT_MAX_INSTR_BYTES > JIT_CODE_SIZE)
+        jit_flush(jit);
+
+    code = jit->code + jit->used;
+
+    /* Block header: leave unless the budget covers the whole block
+     * (cmp rbx, n; jge ok; mov eax, start; jmp exit; ok: sub rbx, n) */
+    emit_reg(jit, JW, 0x81, 7, RBX);
+    budget_at[0] = jit->used;
+    emit_long(jit, 0);
+    ok = emit_jump_fwd(jit, X86_GE);
+    emit_mov_imm(jit, RAX, start);
+    emit_jump_to(jit, -1, jit->code + jit->exit_offset);
+    patch_jump(jit, ok);
+    emit_reg(jit, JW, 0x81, 5, RBX);
+    budget_at[1] = jit->used;
+    emit_long(jit, 0);
 
-    switch(switchJump) {
-    case 1: {
-        cpu->reg[7] = cpu->pc;
+    while (!done) {
+        Decoded d;
+        Address next = pc + 1;
+
+        decode_instr(cpu->mem[pc], &d);
+
+        /* Blocks stop at the size limit and before the last word of
+         * memory (running off its end is left to the interpreter) */
+        if (n == JIT_MAX_BLOCK || pc == MEMLEN - 1)
+            d.op = OP_DECODE;
+
+        /* So are LD, ST and the pointers of LDI/STI that are device
+         * registers */
+        if ((d.op == 0x2 || d.op == 0x3 || d.op == 0xA || d.op == 0xB) &&
+            (Address) (next + d.offset) >= IO_BASE)
+            d.op = OP_DECODE;
+
+        switch(d.op) {
+        /* BR */
+        case 0x0: {
+            Address target = next + d.offset;
+            static const int taken_if[8] = {
+                -1, X86_G, X86_E, X86_GE, X86_L, X86_NE, X86_LE, -1
+            };
+
+            /* BR with no nzp bits never branches */
+            if (d.dst == 0)
+                break;
+
+            emit_set_ir(jit, cpu->mem[pc]);
+            emit_sync_cc(jit, &cc_reg);
+            if (d.dst == 7) {
+                emit_counts(jit, counts, d.op, 1);
+                emit_exit_to(jit, target);
+            } else {
+                size_t taken;
+
+                emit_reg(jit, 0, 0x85, RSI, RSI);  /* test esi, esi */
+                taken = emit_jump_fwd(jit, taken_if[d.dst]);
+                emit_counts(jit, counts, d.op, 0);
+                emit_exit_to(jit, next);
+                patch_jump(jit, taken);
+                emit_counts(jit, counts, d.op, 1);
+                emit_exit_to(jit, target);
+            }
+            done = 1;
+        }   break;
+        /* ADD, AND */
+        case 0x1:
+        case 0x5:
+            emit_reg(jit, 0, 0x89, HREG(d.src), RAX);      /* mov eax, rS */
+            if (d.imm) {
+                emit_byte(jit, d.op == 0x1 ? 0x05 : 0x25); /* op eax, imm */
+                emit_long(jit, d.offset);
+            } else {
+                emit_reg(jit, 0, d.op == 0x1 ? 0x01 : 0x21, HREG(d.src2), RAX);
+            }
+            emit_reg(jit, 0, 0x0FBF, HREG(d.dst), RAX);    /* movsx rD, ax */
+            cc_reg = d.dst;
+            break;
+        /* NOT */
+        case 0x9:
+            emit_reg(jit, 0, 0x89, HREG(d.src), RAX);
+            emit_reg(jit, 0, 0xF7, 2, RAX);                /* not eax */
+            emit_reg(jit, 0, 0x0FBF, HREG(d.dst), RAX);
+            cc_reg = d.dst;
+            break;
+        /* LEA */
+        case 0xE:
+            emit_mov_imm(jit, HREG(d.dst), (Word) (Address) (next + d.offset));
+            cc_reg = d.dst;
+            break;
+        /* LD */
+        case 0x2:
+            emit_mem(jit, 0, 0x0FBF, HREG(d.dst), RDI, offsetof(CPU, mem)
+                     + (Address) (next + d.offset) * sizeof(Word));
+            cc_reg = d.dst;
+            break;
+        /* LDR, LDI: address into eax first */
+        case 0x6:
+        case 0xA:
+            if (d.op == 0x6) {
+                emit_reg(jit, 0, 0x89, HREG(d.src), RAX);
+                emit_byte(jit, 0x05);                      /* add eax, off */
+                emit_long(jit, d.offset);
+                emit_reg(jit, 0, 0x0FB7, RAX, RAX);        /* movzx eax, ax */
+            } else {
+                emit_mem(jit, 0, 0x0FB7, RAX, RDI, offsetof(CPU, mem)
+                         + (Address) (next + d.offset) * sizeof(Word));
+            }
+            emit_device_check(jit, pc, cpu->mem[(Address) (pc - 1)], n,
+                              &cc_reg, &refund_at[nrefunds], counts);
+            refund_len[nrefunds++] = n;
+            emit_idx(jit, 0, 0x0FBF, HREG(d.dst), RDI, RAX, 1,
+                     offsetof(CPU, mem));
+            cc_reg = d.dst;
+            break;
+        /* ST */
+        case 0x3: {
+            Address addr = next + d.offset;
+
+            emit_mem(jit, J16, 0x89, HREG(d.dst), RDI,
+                     offsetof(CPU, mem) + addr * sizeof(Word));
+            cc_reg = d.dst;
+            emit_store_check(jit, addr, next, cpu->mem[pc],
+                             &cc_reg, &refund_at[nrefunds], counts, d.op);
+            refund_len[nrefunds++] = n + 1;
+        }   break;
+        /* STR, STI */
+        case 0x7:
+        case 0xB:
+            if (d.op == 0x7) {
+                emit_reg(jit, 0, 0x89, HREG(d.src), RAX);
+                emit_byte(jit, 0x05);
+                emit_long(jit, d.offset);
+                emit_reg(jit, 0, 0x0FB7, RAX, RAX);
+            } else {
+                emit_mem(jit, 0, 0x0FB7, RAX, RDI, offsetof(CPU, mem)
+                         + (Address) (next + d.offset) * sizeof(Word));
+            }
+            emit_device_check(jit, pc, cpu->mem[(Address) (pc - 1)], n,
+                              &cc_reg, &refund_at[nrefunds], counts);
+            refund_len[nrefunds++] = n;
+            emit_idx(jit, J16, 0x89, HREG(d.dst), RDI, RAX, 1,
+                     offsetof(CPU, mem));
+            cc_reg = d.dst;
+            emit_store_check(jit, -1, next, cpu->mem[pc],
+                             &cc_reg, &refund_at[nrefunds], counts, d.op);
+            refund_len[nrefunds++] = n + 1;
+            break;
+        /* JSR, JSRR */
+        case 0x4:
+            emit_set_ir(jit, cpu->mem[pc]);
+            emit_sync_cc(jit, &cc_reg);
+            emit_counts(jit, counts, d.op, 0);
+            if (d.imm) {
+                emit_mov_imm(jit, HREG(7), (Word) next);
+                emit_exit_to(jit, next + d.offset);
+            } else {
+                emit_reg(jit, 0, 0x0FB7, RAX, HREG(d.src)); /* movzx eax, rBw */
+                emit_mov_imm(jit, HREG(7), (Word) next);
+                emit_exit_dynamic(jit);
+            }
+            done = 1;
+            break;
+        /* JMP */
+        case 0xC:
+            emit_set_ir(jit, cpu->mem[pc]);
+            emit_sync_cc(jit, &cc_reg);
+            emit_counts(jit, counts, d.op, 0);
+            emit_reg(jit, 0, 0x0FB7, RAX, HREG(d.src));
+            emit_exit_dynamic(jit);
+            done = 1;
+            break;
+        /* TRAP, RTI, reserved (and the end of a block): the
+         * interpreter runs these */
+        default:
+            if (n == 0) {
+                jit->used = code - jit->code;
+                return NULL;
+            }
+            emit_set_ir(jit, cpu->mem[pc - 1]);
+            emit_sync_cc(jit, &cc_reg);
+            emit_counts(jit, counts, -1, 0);
+            emit_exit_to(jit, pc);
+            done = 2;
+            break;
+        }
 
-        int jumpoffset = (cpu->ir & 0x7FF);
-        int flag = jumpoffset >> 10;
+        if (done == 2)
+            break;
+        counts[d.op]++;
+        n++;
+        pc = next;
+    }
 
-        if (flag == 1)
-            jumpoffset -= 2048;
+    /* Now that the length is known, fill in the budget charged on
+     * entry and what the early exits after stores give back */
+    memcpy(jit->code + budget_at[0], &n, 4);
+    memcpy(jit->code + budget_at[1], &n, 4);
+    for (i = 0; i < nrefunds; i++) {
+        int refund = n - refund_len[i];
+        memcpy(jit->code + refund_at[i], &refund, 4);
+    }
 
-        printf("JSR to x%X+%x", cpu->pc, jumpoffset);
+    jit->entry[start] = code;
+    jit->length[start] = n;
+    for (i = 0; i < n; i++)
+        jit->codemap[(Address) (start + i)]++;
 
-        cpu->pc = cpu->pc + jumpoffset;
+    return code;
+}
 
-        printf(" = x%X (R7 = x%X)", cpu->pc,cpu->reg[7]);
-    }   break;
-    case 0: {
-        unsigned int base, pcHolder;
-        base = cpu->ir & 0x1c0; 
+/* Run up to nbr_cycles instructions, translated code first and the
+ * interpreter for whatever can't be translated. Returns how many
+ * instructions were executed */
+unsigned long jit_run(CPU *cpu, unsigned long nbr_cycles)
+{
+    typedef long (*JitEnter)(CPU *cpu, unsigned char *code,
+                             long budget, Jit *jit);
+    Jit *jit = cpu->jit;
+    JitEnter enter = (JitEnter) (void *) jit->code;
+    unsigned long done = 0;
+
+    while (done < nbr_cycles && !cpu->stop) {
+        unsigned long left = nbr_cycles - done;
+        unsigned char *code = NULL;
+        long budget, executed;
+
+        if (cpu->pc >= 0 && cpu->pc < MEMLEN) {
+            code = jit->entry[cpu->pc];
+            if (code == NULL && jit->drops[cpu->pc] < JIT_MAX_DROPS)
+                code = jit_translate(cpu, cpu->pc);
+        }
 
-        if (base == 7) {
-            pcHolder = cpu->pc;
+        /* Code that keeps storing into itself would be translated
+         * again after every store: interpret a block's worth of it */
+        if (code == NULL) {
+            if (cpu->pc >= 0 && cpu->pc < MEMLEN &&
+                jit->drops[cpu->pc] >= JIT_MAX_DROPS)
+                done += run_cycles(cpu, left < JIT_MAX_BLOCK ?
+                                        left : JIT_MAX_BLOCK);
+            else
+                done += run_cycles(cpu, 1);
+            continue;
+        }
 
-            printf("JSRR R%d = x%X(R7 = x%X)",
-                   base, cpu->reg[base], cpu->reg[7]);
+        budget = left > LONG_MAX ? LONG_MAX : (long) left;
+        executed = budget - enter(cpu, code, budget, jit);
+        cpu->cycles += executed;
+        done += executed;
 
-            cpu->pc = cpu->reg[base];   
-            cpu->reg[base] = pcHolder;
-        } else {
-            cpu->reg[7] = cpu->pc;
+        /* A store hit translated code: drop the blocks holding it */
+        if (jit->smc_addr >= 0) {
+            jit_invalidate(jit, jit->smc_addr);
+            jit->smc_addr = -1;
+        }
 
-            printf("JSRR R%d = x%X(R7 = x%X)",
-                   base, cpu->reg[base], cpu->reg[7]);
+        /* Not enough budget left for a whole block: single-step */
+        if (executed == 0)
+            done += run_cycles(cpu, 1);
+    }
+
+    return done;
+}
+
+void jit_free(Jit *jit)
+{
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+#else
+
+int jit_init(CPU *cpu)
+{
+    return -1;
+}
+
+void jit_free(Jit *jit)
+{
+}
+
+unsigned long jit_run(CPU *cpu, unsigned long nbr_cycles)
+{
+    return run_cycles(cpu, nbr_cycles);
+}
 
-            cpu->pc = cpu->reg[base];   
+#endif
+
+/* Forget every translation, e.g. when a new image is loaded */
+void jit_flush(Jit *jit)
+{
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->length, 0, sizeof(jit->length));
+    memset(jit->codemap, 0, sizeof(jit->codemap));
+    memset(jit->drops, 0, sizeof(jit->drops));
+    jit->used = jit->start_offset;
+}
+
+/* addr was written: drop every block that contains it */
+void jit_invalidate(Jit *jit, Address addr)
+{
+    int start = addr - (JIT_MAX_BLOCK - 1), i;
+
+    if (start < 0)
+        start = 0;
+
+    for (; start <= addr; start++) {
+        if (jit->entry[start] != NULL && start + jit->length[start] > addr) {
+            jit->entry[start] = NULL;
+            for (i = 0; i < jit->length[start]; i++)
+                jit->codemap[start + i]--;
+            jit->length[start] = 0;
+            if (jit->drops[start] < JIT_MAX_DROPS)
+                jit->drops[start]++;
         }
-    } break;
     }
 }
 
-void and_instr(CPU *cpu)
+/* The fused idioms (see fuse_instr) without a trace: d is the first
+ * of the instructions, which are known to be valid. The loop counts
+ * the last one and the PC is left after it, as if each had run */
+
+/* AND Rx,Rx,#0; ADD Rx,Rx,#n */
+int const_fused(CPU *cpu, const Decoded *d)
 {
-    int mask = (1 << 5);
-    int ident = (mask & cpu->ir) >> 5;
+    cpu->reg[d->dst] = d[1].offset;
+    calculateCondition(d[1].offset, cpu);
+    cpu->stats.ops[0x5]++;
+    cpu->ir = cpu->mem[cpu->pc++];
+    return 1;
+}
 
-    unsigned int dst, src1;
-    dst = ((7 << 9) & cpu->ir) >> 9;
-    src1 = ((7 << 6) & cpu->ir) >> 6;
+/* NOT Rx,Ry; ADD Rx,Rx,#1 */
+int negate_fused(CPU *cpu, const Decoded *d)
+{
+    Word value = ~cpu->reg[d->src];
 
-    switch(ident) {
-    case 0: {
-         unsigned int src2;
-         src2 = (7 & cpu->ir);
-         cpu->reg[dst] = cpu->reg[src2] & cpu->reg[src1];
+    cpu->reg[d->dst] = value + 1;
+    calculateCondition(cpu->reg[d->dst], cpu);
+    cpu->stats.ops[0x9]++;
+    cpu->ir = cpu->mem[cpu->pc++];
+    return 1;
+}
 
-         printf("AND R%d, R%d, R%d;", dst, src1, src2);
-         printf(" R%d <- x%X & x%X", dst, cpu->reg[src1], cpu->reg[src2]);
+/* ADD Rx,Rx,#n; BR */
+int count_fused(CPU *cpu, const Decoded *d)
+{
+    cpu->reg[d->dst] = cpu->reg[d->src] + d->offset;
+    calculateCondition(cpu->reg[d->dst], cpu);
+    cpu->stats.ops[0x1]++;
+    cpu->ir = cpu->mem[cpu->pc++];
+
+    if ((cpu->cc & d[1].dst) != 0) {
+        cpu->pc = (Address) (cpu->pc + d[1].offset);
+        cpu->stats.taken++;
+    }
+    return 1;
+}
 
-         cpu->reg[dst] = (cpu->reg[src1] & cpu->reg[src2]);
+/* LDR Rt,Rb,#k; ADD Rt,Rt,#n; STR Rt,Rb,#k, unless it is a device
+ * register, which has to see the load and the store on their own */
+int bump_fused(CPU *cpu, const Decoded *d)
+{
+    Address addr = cpu->reg[d->src] + d->offset;
+
+    if (addr >= IO_BASE)
+        return 0;
+    cpu->ea = addr;
+    cpu->reg[d->dst] = cpu->mem[addr] + d[1].offset;
+    cpu->stats.ops[0x6]++;
+    cpu->stats.ops[0x1]++;
+    cpu->ir = cpu->mem[cpu->pc + 1];
+    cpu->pc += 2;
+    store_word(cpu, addr, cpu->reg[d->dst]);
+    calculateCondition(cpu->mem[addr], cpu);
+    return 1;
+}
 
-         calculateCondition(cpu->reg[dst], cpu);
-         generateCondition(cpu);
+void branch_instr(CPU *cpu, const Decoded *d)
+{
+    /* Readable nzp mask, indexed by the instruction's nzp field */
+    static char *conditioncode[8] = {
+        " ", "P", "Z", "ZP", "N", "NP", "NZ", "NZP"
+    };
+
+    if ((cpu->cc & d->dst) != 0) {
+        cpu->pc = (Address) (cpu->pc + d->offset);
+        cpu->stats.taken++;
+
+        if (cpu->tracing) {
+            generateCondition(cpu);
+            printf("BR%s %d, cc = %c  goto  to location x%X ",
+                   conditioncode[d->dst], d->offset,
+                   cpu->condition, cpu->pc);
+        }
+    } else if (cpu->tracing && cpu->ir == 0x0000) {
+        generateCondition(cpu);
+        printf("NOP, no go to CC:%c", cpu->condition);
+    }
+}
 
-         printf(" = x%X; CC = %c", cpu->reg[dst], cpu->condition); 
-    }    break;
-    case 1: {
-         int imm = (31 & cpu->ir);
-         int flag = imm >> 4;
+void add_instr(CPU *cpu, const Decoded *d)
+{
+    Word src1 = cpu->reg[d->src];
 
-         if (flag ==1)
-             imm -= 32;
+    /* Check if ADD contains 2 registers or is IMMED */
+    switch(d->imm) {
+    case 0:{
+        Word src2 = cpu->reg[d->src2];
 
-         cpu->reg[dst] = (cpu->reg[src1] & imm);
+        cpu->reg[d->dst] = (src1 + src2);
+        calculateCondition(cpu->reg[d->dst], cpu);
 
-         printf("AND R%d, R%d, %d;", dst,src1,imm);
-         printf(" R%d <- x%X & %d = ", dst, src1, imm); 
+        if (cpu->tracing) {
+            generateCondition(cpu);
+            printf("ADD R%d, R%d, R%d;", d->dst, d->src, d->src2);
+            printf(" R%d <- x%X + x%X = x%X CC: %c",
+                   d->dst, src1, src2, cpu->reg[d->dst], cpu->condition);
+        }
+    }   break;
+    case 1:{
+        cpu->reg[d->dst] = (src1 + d->offset);
+        calculateCondition(cpu->reg[d->dst], cpu);
+
+        if (cpu->tracing) {
+            generateCondition(cpu);
+            printf("ADD R%d, R%d, %d;", d->dst, d->src, d->offset);
+            printf(" R%d <- x%X+%d = x%X CC: %c",
+                   d->dst, src1, d->offset, cpu->reg[d->dst], cpu->condition);
+        }
+    }   break;
+    }
+}
 
-         cpu->reg[dst] = (cpu->reg[src1] & imm);
+void load_instr(CPU *cpu, const Decoded *d)
+{
+    Address sum = cpu->pc + d->offset;
 
-         calculateCondition(cpu->reg[dst], cpu);
-         generateCondition(cpu);
+    cpu->ea = sum;
+    cpu->reg[d->dst] = load_word(cpu, sum);
+    calculateCondition(cpu->reg[d->dst], cpu);
 
-         printf("x%X; CC = %c", cpu->reg[dst], cpu->condition);
-    }    break;
-    default:
-         printf("instruction not recognized\n"); //error code 
-         break;
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("LD R%d, %d; ", d->dst, d->offset);
+        printf(" R%d <- M[PC+%d] = M[x%X] = x%04X CC:%c",
+               d->dst, d->offset, sum, cpu->reg[d->dst], cpu->condition);
     }
 }
 
-void ldr_instr(CPU *cpu)
+void store_instr(CPU *cpu, const Decoded *d)
 {
-    unsigned int dst, base;
-    dst = ((7 << 9) & cpu->ir) >> 9;
-    base = ((7 << 6) & cpu->ir) >> 6;
+    Address add = cpu->pc + d->offset;
 
-    int offset;
-    offset = (63 & cpu->ir);
+    cpu->ea = add;
+    store_word(cpu, add, cpu->reg[d->dst]);
+    calculateCondition(cpu->reg[d->dst], cpu);
+
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("ST R%d, %x; ", d->dst, d->offset);
+        printf("M[PC+%d] = M[x%04x] <- x%04x CC:%c",
+               d->offset, add, cpu->mem[add], cpu->condition);
+    }
+}
 
-    int flag = offset >> 5;
-    if (flag == 1)
-        offset -= 64;
+void jump_subr_instr(CPU *cpu, const Decoded *d)
+{
+    Address from = cpu->pc;
 
-    printf("LDR R%d R%d %d; R%d <- mem[x%X + %X] = ",
-           dst, base, offset, dst, cpu->reg[base], offset);
+    switch(d->imm) {
+    case 1: {
+        cpu->reg[7] = from;
+        cpu->pc = (Address) (from + d->offset);
 
-    cpu->reg[dst] = cpu->mem[(cpu->reg[base] + offset)];
+        if (cpu->tracing)
+            printf("JSR to x%X+%x = x%X (R7 = x%X)",
+                   from, d->offset, cpu->pc, cpu->reg[7]);
+    }   break;
+    case 0: {
+        /* Read the target before R7 is overwritten (JSRR R7) */
+        Address target = cpu->reg[d->src];
 
-    calculateCondition(cpu->reg[dst],cpu);
-    generateCondition(cpu);
+        cpu->reg[7] = from;
+        cpu->pc = target;
 
-    printf("x%x; CC = %c", cpu->reg[dst],cpu->condition);
+        if (cpu->tracing)
+            printf("JSRR R%d = x%X(R7 = x%X)",
+                   d->src, target, cpu->reg[7]);
+    } break;
+    }
 }
 
-void str_instr(CPU *cpu)
+void and_instr(CPU *cpu, const Decoded *d)
 {
-    unsigned int src, base;
-    src = ((7 << 9) & cpu->ir) >> 9;
-    base = ((7 << 6) & cpu->ir) >> 6;
+    Word src1 = cpu->reg[d->src];
 
-    int offset = (63&cpu->ir);
+    switch(d->imm) {
+    case 0: {
+         Word src2 = cpu->reg[d->src2];
 
-    int flag = offset >> 5;
-    if(flag == 1)
-        offset -= 64;
+         cpu->reg[d->dst] = (src1 & src2);
+         calculateCondition(cpu->reg[d->dst], cpu);
 
-    printf("STR R%d R%d %d; M[x%X + %d] = ",
-           src, base, offset, base, offset);
+         if (cpu->tracing) {
+             generateCondition(cpu);
+             printf("AND R%d, R%d, R%d;", d->dst, d->src, d->src2);
+             printf(" R%d <- x%X & x%X = x%X; CC = %c",
+                    d->dst, src1, src2, cpu->reg[d->dst], cpu->condition);
+         }
+    }    break;
+    case 1: {
+         cpu->reg[d->dst] = (src1 & d->offset);
+         calculateCondition(cpu->reg[d->dst], cpu);
+
+         if (cpu->tracing) {
+             generateCondition(cpu);
+             printf("AND R%d, R%d, %d;", d->dst, d->src, d->offset);
+             printf(" R%d <- x%X & %d = x%X; CC = %c",
+                    d->dst, src1, d->offset, cpu->reg[d->dst], cpu->condition);
+         }
+    }    break;
+    }
+}
 
-    cpu->mem[(cpu->reg[base] + offset)] = cpu->reg[src];
+void ldr_instr(CPU *cpu, const Decoded *d)
+{
+    Word base = cpu->reg[d->src];
+    Address addr = base + d->offset;
 
-    calculateCondition(cpu->mem[(cpu->reg[base] + offset)], cpu);
-    generateCondition(cpu);
+    cpu->ea = addr;
+    cpu->reg[d->dst] = load_word(cpu, addr);
+    calculateCondition(cpu->reg[d->dst],cpu);
 
-    printf("x%X; CC = %c",
-           cpu->mem[(cpu->reg[base] + offset)], cpu->condition);
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("LDR R%d R%d %d; R%d <- mem[x%X + %X] = x%x; CC = %c",
+               d->dst, d->src, d->offset, d->dst, base, d->offset,
+               cpu->reg[d->dst], cpu->condition);
+    }
 }
 
-void not_instr(CPU *cpu)
+void str_instr(CPU *cpu, const Decoded *d)
 {
-    unsigned int dst, src;
-    dst = ((7 << 9) & cpu->ir) >> 9;
-    src = ((7 << 6) & cpu->ir) >> 6;
+    Word base = cpu->reg[d->src];
+    Address addr = base + d->offset;
 
-    printf("NOT R%d, R%d; R%d <- Not x%X = ",
-           dst, src, dst, cpu->reg[src]);
+    cpu->ea = addr;
+    store_word(cpu, addr, cpu->reg[d->dst]);
+    calculateCondition(cpu->mem[addr], cpu);
 
-    cpu->reg[dst] = ~cpu->reg[src];
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("STR R%d R%d %d; M[x%X + %d] = x%X; CC = %c",
+               d->dst, d->src, d->offset, base, d->offset,
+               cpu->mem[addr], cpu->condition);
+    }
+}
 
-    calculateCondition(cpu->reg[dst], cpu);
-    generateCondition(cpu);
+void not_instr(CPU *cpu, const Decoded *d)
+{
+    Word src = cpu->reg[d->src];
 
-    printf("x%X; CC = %c", cpu->reg[dst], cpu->condition);
+    cpu->reg[d->dst] = ~src;
+    calculateCondition(cpu->reg[d->dst], cpu);
 
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("NOT R%d, R%d; R%d <- Not x%X = x%X; CC = %c",
+               d->dst, d->src, d->dst, src,
+               cpu->reg[d->dst], cpu->condition);
+    }
 }
 
-void ldi_instr(CPU *cpu)
+void ldi_instr(CPU *cpu, const Decoded *d)
 {
-    unsigned int dst = ((cpu->ir & 0x0e00) >> 9);
+    Address pointer = cpu->pc + d->offset;
+    Address addr = load_word(cpu, pointer);
 
-    int pcoffset1, pcoffset;
-    pcoffset = (cpu->ir & 0x01FF);
+    cpu->ea = addr;
+    cpu->reg[d->dst] = load_word(cpu, addr);
+    calculateCondition(cpu->reg[d->dst], cpu);
 
-    int flag = pcoffset >> 8;
-    if (flag == 1)
-        pcoffset -= 512;
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("LDI R%d, x%X; R%d <-M[M[PC+%X]] = M[M[x%X]] = M[x%x] = ",
+               d->dst, d->offset & 0xffff, d->dst, d->offset, pointer, addr);
+        printf("x%X; CC = %c", cpu->reg[d->dst], cpu->condition);
+    }
+}
 
-    pcoffset1= cpu->pc + pcoffset;
+void sti_instr(CPU *cpu, const Decoded *d)
+{
+    Address pointer = cpu->pc + d->offset;
+    Address addr = load_word(cpu, pointer);
 
-    printf("LDI R%d, x%X; R%d <-M[M[PC+%X]] = M[M[x%X]] = M[x%x] = ",
-           dst, cpu->mem[cpu->pc], dst, pcoffset,
-           pcoffset1, cpu->mem[cpu->pc]);
+    cpu->ea = addr;
+    store_word(cpu, addr, cpu->reg[d->dst]);
+    calculateCondition(cpu->mem[addr], cpu);
 
-    cpu->reg[dst] = cpu->mem[cpu->mem[pcoffset]];
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("STI R%d, %d; M[M[PC+%d]] = M[M[x%X]] = M[x%X] = x%X; ",
+               d->dst, d->offset, d->offset, pointer, addr, cpu->mem[addr]);
+        printf("CC = %c", cpu->condition);
+    }
+}
 
-    calculateCondition(cpu->reg[dst], cpu);
-    generateCondition(cpu);
+void jump_instr(CPU *cpu, const Decoded *d)
+{
+    cpu->pc = (Address) cpu->reg[d->src];
 
-    printf("x%X; CC = %c", cpu->reg[dst], cpu->condition);
+    if (cpu->tracing)
+        printf("JMP R%d, goto x%X", d->src, cpu->pc);
 }
 
-void sti_instr(CPU *cpu)
+void lea_instr(CPU *cpu, const Decoded *d)
 {
-    unsigned int src = ((cpu->ir & 0x0e00) >> 9);
+    Address k = cpu->pc + d->offset;
 
-    int pcoffset, pcoffset1;
-    pcoffset = (cpu->ir & 0x01FF);
+    cpu->reg[d->dst] = k;
+    calculateCondition(cpu->reg[d->dst], cpu);
 
-    int flag = pcoffset >> 8;
-    if (flag == 1)
-        pcoffset -= 512;
+    if (cpu->tracing) {
+        generateCondition(cpu);
+        printf("LEA R%d, %d; R%d <- PC+%d = x%X; CC = %c",
+               d->dst, d->offset, d->dst, d->offset,
+               cpu->reg[d->dst], cpu->condition);
+    }
+}
 
-    pcoffset1 = cpu->pc + pcoffset;
+/* Console of a cpu that isn't attached to the terminal: input comes
+ * from a buffer and output is captured in memory */
+void console_init(Console *console, const char *in, size_t in_len)
+{
+    console->in = in;
+    console->in_len = in_len;
+    console->in_pos = 0;
+    console->in_fd = -1;
+    console->in_file = NULL;
+    console->out = NULL;
+    console->out_len = 0;
+    console->out_cap = 0;
+    console->out_file = NULL;
+    console->line_buffered = 0;
+    console->truncated = 0;
+    console->keyboard = NULL;
+}
 
-    printf("STI R%d, %d; M[M[PC+%d]] = M[M[x%X]] = M[x%X] = x%X; ",
-           src, pcoffset, pcoffset, pcoffset1,
-           cpu->mem[cpu->pc], cpu->mem[cpu->mem[cpu->pc]]);
+/* Set up the terminal: output goes to stdout, a line at a time if it
+ * is a tty and a buffer at a time otherwise. Input comes from the
+ * file called input_name or else stdin, refilled a block at a time.
+ * When stdin also carries the command loop's commands (shared_stdin)
+ * it is read through stdio instead, a character at a time, so the
+ * two don't take each other's input */
+void terminal_init(char *input_name, int shared_stdin)
+{
+    console_init(&terminal, terminal_in, 0);
+    terminal.out = terminal_out;
+    terminal.out_cap = CONSOLE_BUF_LEN;
+    terminal.out_file = stdout;
+    terminal.line_buffered = isatty(STDOUT_FILENO);
+
+    if (input_name != NULL) {
+        terminal.in_fd = open(input_name, O_RDONLY);
+        if (terminal.in_fd < 0) {
+            printf("error: Could not open file %s\n", input_name);
+            exit(EXIT_FAILURE);
+        }
+    } else if (shared_stdin) {
+        terminal.in_file = stdin;
+    } else {
+        terminal.in_fd = STDIN_FILENO;
+    }
+}
 
-    cpu->mem[cpu->mem[cpu->pc]] = cpu->reg[src];
+/* Next character from the console's input, 0 once it is exhausted */
+int console_read(Console *console)
+{
+    char input;
 
-    calculateCondition(cpu->mem[cpu->mem[cpu->pc]], cpu);
-    generateCondition(cpu);
+    if (console->keyboard != NULL)
+        return keyboard_wait(console->keyboard);
 
-    printf("CC = %c", cpu->condition);
+    if (console->in_pos == console->in_len) {
+        ssize_t n = 0;
 
+        if (console->in_file != NULL) {
+            int c = getc(console->in_file);
+            return c == EOF ? 0 : (char) c;
+        }
+        /* Only the terminal refills, into its own buffer */
+        if (console->in_fd >= 0)
+            n = read(console->in_fd, (char *) console->in, CONSOLE_BUF_LEN);
+        if (n <= 0)
+            return 0;
+        console->in_len = n;
+        console->in_pos = 0;
+    }
+
+    input = console->in[console->in_pos++];
+    return input;
+}
+
+/* Next character for GETC/IN, 0 once the input is exhausted. Anything
+ * printed so far (a prompt) goes out before it blocks */
+int console_getc(CPU *cpu)
+{
+    Console *console = cpu->console;
+
+    if (console == NULL) {
+        console_flush(cpu);
+        fflush(stdout);
+        if (cpu->history != NULL)
+            return history_getc(cpu);
+        console = &terminal;
+    }
+
+    return console_read(console);
 }
 
-void jump_instr(CPU *cpu)
+void console_putc(CPU *cpu, int c)
 {
-    unsigned int base = (cpu->ir & 0xe0) >> 6;
-    cpu->reg[base] = cpu->pc;
+    Console *console = cpu->console;
+
+    if (console == NULL) {
+        if (cpu->history != NULL && cpu->history->replaying)
+            return;
+        console = &terminal;
+    }
+
+    if (console->out_len == console->out_cap) {
+        char *bigger;
 
-    printf("JMP R%d, goto ", base);
+        if (console->out_file != NULL) {
+            console_flush(cpu);
+        } else if (console->out_cap >= CONSOLE_MAX_OUTPUT) {
+            console->truncated = 1;
+            return;
+        } else {
+            console->out_cap = console->out_cap ? 2 * console->out_cap : 256;
+            bigger = realloc(console->out, console->out_cap);
+            if (bigger == NULL) {
+                console->truncated = 1;
+                return;
+            }
+            console->out = bigger;
+        }
+    }
+    console->out[console->out_len++] = c;
 
-    cpu->pc = cpu->reg[base];
+    /* A trace is printed as it goes, so while tracing every character
+     * goes out at once */
+    if ((c == '\n' && console->line_buffered) || cpu->trace != TRACE_NONE)
+        console_flush(cpu);
+}
 
-    printf("x%X", cpu->pc);
+void console_puts(CPU *cpu, const char *s)
+{
+    while (*s != '\0')
+        console_putc(cpu, *s++);
 }
 
-void lea_instr(CPU *cpu)
+/* Write out the terminal's buffered output (a batch job keeps its) */
+void console_flush(CPU *cpu)
 {
-    unsigned int dst = ((cpu->ir & 0x0e00) >> 9);
+    Console *console = cpu->console ? cpu->console : &terminal;
 
-    int pcoffset = (cpu->ir & 0x01FF);
+    if (console->out_file == NULL || console->out_len == 0)
+        return;
+    fwrite(console->out, 1, console->out_len, console->out_file);
+    console->out_len = 0;
+}
 
-    int flag = pcoffset >> 8;
-    if (flag == 1)
-        pcoffset -= 512;
+/* PUTS: the string at addr, copied into the terminal's buffer a run
+ * at a time rather than through console_putc */
+void console_put_string(CPU *cpu, Address addr)
+{
+    Console *console = cpu->console;
+
+    if (console == NULL && cpu->trace == TRACE_NONE &&
+        (cpu->history == NULL || !cpu->history->replaying)) {
+        console = &terminal;
+        while (cpu->mem[addr] != 0) {
+            char *out = console->out + console->out_len;
+            char *end = console->out + console->out_cap;
+            Word c;
+
+            while (out < end && (c = cpu->mem[addr]) != 0) {
+                *out++ = c;
+                addr++;
+                if (c == '\n' && console->line_buffered)
+                    break;
+            }
+            console->out_len = out - console->out;
+            if (out == end || (console->line_buffered && out[-1] == '\n'))
+                console_flush(cpu);
+        }
+        return;
+    }
 
-    int k = cpu->pc + pcoffset;
+    while (cpu->mem[addr] != 0)
+        console_putc(cpu, cpu->mem[addr++]);
+}
 
-    cpu->reg[dst] = cpu->pc + pcoffset;
+/* Reader thread of the keyboard: everything read from fd goes into
+ * the ring, waiting while it is full, until the end of the input */
+void *keyboard_reader(void *arg)
+{
+    Keyboard *kb = arg;
+    unsigned char buf[CONSOLE_BUF_LEN];
+    ssize_t n, i;
+
+    while ((n = read(kb->fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            unsigned int tail = atomic_load_explicit(&kb->tail,
+                                                     memory_order_relaxed);
+
+            while (tail - atomic_load_explicit(&kb->head,
+                                               memory_order_acquire)
+                   == KEYBOARD_LEN)
+                nanosleep(&keyboard_nap, NULL);
+            kb->keys[tail % KEYBOARD_LEN] = buf[i];
+            atomic_store_explicit(&kb->tail, tail + 1, memory_order_release);
+        }
+    }
 
-    printf("LEA R%d, %d; R%d <- PC+%d = ",
-           dst,pcoffset, dst, k);
+    atomic_store_explicit(&kb->eof, 1, memory_order_release);
+    return NULL;
+}
 
-    calculateCondition(cpu->reg[dst], cpu);
-    generateCondition(cpu);
+/* Start reading the console's input in the background, beginning with
+ * whatever it has buffered already. Returns 0, or -1 if it can't */
+int keyboard_start(Console *console)
+{
+    Keyboard *kb = calloc(1, sizeof(Keyboard));
+    pthread_t thread;
+    unsigned int n = 0;
+
+    if (kb == NULL)
+        return -1;
+    while (console->in_pos < console->in_len && n < KEYBOARD_LEN)
+        kb->keys[n++] = console->in[console->in_pos++];
+    atomic_store(&kb->tail, n);
+    kb->fd = console->in_fd;
+
+    if (pthread_create(&thread, NULL, keyboard_reader, kb) != 0) {
+        free(kb);
+        return -1;
+    }
+    pthread_detach(thread);
+    console->keyboard = kb;
+    return 0;
+}
+
+/* Next key, or -1 if none has arrived (yet) */
+int keyboard_pop(Keyboard *kb)
+{
+    unsigned int head = atomic_load_explicit(&kb->head, memory_order_relaxed);
+    int key;
+
+    if (head == atomic_load_explicit(&kb->tail, memory_order_acquire))
+        return -1;
+    key = kb->keys[head % KEYBOARD_LEN];
+    atomic_store_explicit(&kb->head, head + 1, memory_order_release);
+    return key;
+}
+
+/* Next key, waiting for it; 0 at the end of the input */
+int keyboard_wait(Keyboard *kb)
+{
+    for (;;) {
+        int eof = atomic_load_explicit(&kb->eof, memory_order_acquire);
+        int key = keyboard_pop(kb);
+
+        if (key >= 0)
+            return (char) key;
+        if (eof)
+            return 0;
+        nanosleep(&keyboard_nap, NULL);
+    }
+}
+
+/* KBSR: has a key arrived? The terminal's input is read in the
+ * background from the first time a program asks, so that polling
+ * never blocks; in the command loop, which shares stdin, a key is
+ * only read when KBDR is */
+int console_key_ready(CPU *cpu)
+{
+    Console *console = cpu->console;
+
+    if (console != NULL)
+        return console->in_pos < console->in_len;
+    if (terminal.in_file != NULL)
+        return 1;
+    if (terminal.keyboard == NULL && keyboard_start(&terminal) != 0)
+        return 1;
+
+    return atomic_load_explicit(&terminal.keyboard->head, memory_order_relaxed)
+        != atomic_load_explicit(&terminal.keyboard->tail,
+                                memory_order_acquire);
+}
 
-    printf("x%X; CC = %c",
-           cpu->reg[dst], cpu->condition);
+/* KBDR: take the key that has arrived, -1 if there is none */
+int console_key(CPU *cpu)
+{
+    if (!console_key_ready(cpu))
+        return -1;
+    return console_getc(cpu) & 0xFF;
 }
 
-void trap_instr(CPU *cpu)
+/* Trap routines. The guest's own console output (OUT, PUTS and the
+ * IN prompt) is always printed; the rest only when tracing */
+void trap_instr(CPU *cpu, const Decoded *d)
 {
     cpu->reg[7] = cpu->pc;
-    int trapCode = cpu->ir & (0xFF);
+    cpu->stats.traps[d->offset]++;
+
+    if (cpu->tracing)
+        generateCondition(cpu);
 
-    switch(trapCode){
+    switch(d->offset){
     /* GETCHAR */
     case 0x20: {
-        printf("Trap x20(GETC): ");
+        if (cpu->tracing)
+            printf("Trap x20(GETC): ");
 
-        char input;
-        cpu->reg[0] = cpu->reg[0] & 0;
-        scanf("%c", &input);
-        cpu->reg[0] = input;
+        cpu->reg[0] = console_getc(cpu);
 
-        printf("Read:%c = %d",cpu->reg[0],cpu->reg[0]);
+        if (cpu->tracing)
+            printf("Read:%c = %d",cpu->reg[0],cpu->reg[0]);
     }   break;
     /* OUT */
     case 0x21: {
-        printf("TRAP x21(OUT): %d = %c; CC = %c",
-               cpu->reg[0],cpu->reg[0], cpu->condition);
+        if (cpu->tracing)
+            printf("TRAP x21(OUT): %d = %c; CC = %c",
+                   cpu->reg[0],cpu->reg[0], cpu->condition);
+        else
+            console_putc(cpu, cpu->reg[0]);
     }   break;
     /* PUTS */
     case 0x22: {
-        int location = cpu->reg[0];
+        Address location = cpu->reg[0];
 
-        printf("TRAP x22 (PUTS): ");
+        if (cpu->tracing)
+            printf("TRAP x22 (PUTS): ");
 
-        while(cpu->mem[location] != 0) {
-            printf("%c",cpu->mem[location++]);
-        }
+        console_put_string(cpu, location);
 
-        printf("\n\nCC = %c", cpu->condition);
+        if (cpu->tracing) {
+            console_flush(cpu);
+            printf("\n\nCC = %c", cpu->condition);
+        }
     }   break;
     /* IN */
     case 0x23: {
-        printf("TRAP x23(IN) Input a character: ");
+        if (cpu->tracing)
+            printf("TRAP x23(IN) ");
+        console_puts(cpu, "Input a character: ");
 
-        char input;
-        cpu->reg[0] = cpu->reg[0] & 0;
-        scanf("%c", &input);
-        cpu->reg[0] = input;
+        cpu->reg[0] = console_getc(cpu);
 
-        printf("Read:%c = %d",cpu->reg[0],cpu->reg[0]);
+        if (cpu->tracing)
+            printf("Read:%c = %d",cpu->reg[0],cpu->reg[0]);
     }   break;
     /* BAD VECTOR TRAP */
     case 0x24:{
-        printf("TRAP x24, bad trap vector; halting");   
-        halt_processor(cpu);
+        if (cpu->tracing)
+            printf("TRAP x24, bad trap vector; halting");   
+        halt_processor(cpu, HALT_BAD_TRAP);
     }   break;
     /* HALT */
     case 0x25:{
-        printf("halted");
-        halt_processor(cpu);
+        if (cpu->tracing)
+            printf("halted");
+        halt_processor(cpu, HALT_TRAP);
     }   break;
     /* BAD TRAP */
     default: {
-        printf("Bad Trap code");
+        if (cpu->tracing)
+            printf("Bad Trap code");
     }   break;
     }
 
@@ -886,46 +7486,103 @@ void trap_instr(CPU *cpu)
     cpu->pc = cpu->reg[7];
 }
 
-void halt_processor(CPU *cpu)
+/* Return from an interrupt: pop the PC and PSR off the supervisor
+ * stack, going back to the user stack if returning to user mode.
+ * In user mode it is a privilege exception, or halts if the program
+ * has no handler for that */
+void rti_instr(CPU *cpu, const Decoded *d)
+{
+    Status *st = &cpu->status;
+    Word psr;
+
+    if (st->user) {
+        if (cpu->mem[INT_TABLE + INT_PRIVILEGE] == 0) {
+            if (cpu->tracing)
+                printf("\"RTI\" in user mode, halting...");
+            halt_processor(cpu, HALT_RTI);
+            return;
+        }
+        if (cpu->tracing)
+            printf("RTI in user mode: exception x00");
+        interrupt_enter(cpu, INT_PRIVILEGE, st->priority);
+        return;
+    }
+
+    cpu->pc = (Address) load_word(cpu, (Address) cpu->reg[6]);
+    cpu->reg[6]++;
+    psr = load_word(cpu, (Address) cpu->reg[6]);
+    cpu->reg[6]++;
+    psr_write(cpu, psr);
+    if (psr & 0x8000) {
+        st->saved_ssp = cpu->reg[6];
+        cpu->reg[6] = st->saved_usp;
+        st->user = 1;
+    }
+    if (cpu->tracing)
+        printf("RTI to x%04X, PL%d", cpu->pc, st->priority);
+
+    /* The priority may have dropped below a waiting interrupt */
+    cpu->stop = 1;
+}
+
+void reserved_instr(CPU *cpu, const Decoded *d)
+{
+    if (cpu->tracing)
+        printf("unsupported \"err\" halting...");
+    halt_processor(cpu, HALT_RESERVED);
+}
+
+void halt_processor(CPU *cpu, int reason)
 {
     cpu->running = 0;
+    cpu->stop = 1;
+    cpu->halt_reason = reason;
+    console_flush(cpu);
 }
 
-void jump_command(char *cmd_buffer,CPU *cpu)
+void jump_command(Command *cmd, CPU *cpu)
 {
-    int inputNum,
-        x = sscanf(cmd_buffer,"j x%x",&inputNum);
+    unsigned long inputNum;
 
-    if(x != 1) {
+    if (cmd->nwords != 2 || command_number(cmd->word[1], &inputNum) != 0 ||
+        inputNum >= MEMLEN) {
         printf("Jump command should be j address\n");
     } else {
-        printf("jumping to  x%x\n", inputNum); 
+        printf("jumping to  x%lx\n", inputNum);
         cpu->pc = inputNum;
         cpu->running = 1;
+        cpu->halt_reason = HALT_NONE;
     }
 }
 
-void register_command(char *cmd_buffer,CPU *cpu) {
-    int inputNum, registerInput,
-        x = sscanf(cmd_buffer, "r r%d x%x\n", &registerInput, &inputNum);
+void register_command(Command *cmd, CPU *cpu) {
+    unsigned long inputNum;
+    char *name = cmd->nwords == 3 ? cmd->word[1] : NULL;
+    int registerInput = -1;
+
+    if (name != NULL && (name[0] == 'r' || name[0] == 'R') &&
+        name[1] >= '0' && name[1] < '0' + NREG && name[2] == '\0')
+        registerInput = name[1] - '0';
 
-    if (x != 2) {
+    if (registerInput < 0 ||
+        command_number(cmd->word[2], &inputNum) != 0 || inputNum > 0xFFFF) {
         printf("Register command should be r rN value (xNNNN format)\n");
     } else {
-        printf("Setting R%d to x%X\n", registerInput, inputNum);
+        printf("Setting R%d to x%lX\n", registerInput, inputNum);
         cpu->reg[registerInput] = inputNum;
     }
 }
 
-void memory_command(char *cmd_buffer, CPU *cpu) {
-    int inputNum, memAdd,
-        x = sscanf(cmd_buffer, "m x%x x%x", &memAdd, &inputNum);
+void memory_command(Command *cmd, CPU *cpu) {
+    unsigned long inputNum, memAdd;
 
-    if (x != 2) {
-        printf("Memory command should be in m addr value (xNNNN format)\n");           
+    if (cmd->nwords != 3 || command_number(cmd->word[1], &memAdd) != 0 ||
+        command_number(cmd->word[2], &inputNum) != 0 ||
+        memAdd >= MEMLEN || inputNum > 0xFFFF) {
+        printf("Memory command should be in m addr value (xNNNN format)\n");
     } else {
-        printf("Setting m[x%04X] to x%X\n", memAdd, inputNum);
-        cpu->mem[memAdd] = inputNum;
+        printf("Setting m[x%04lX] to x%lX\n", memAdd, inputNum);
+        store_word(cpu, memAdd, inputNum);
     }
 }
 
@@ -0,0 +1,238 @@
+/*
+ * Benchmark harness for the simulators (make bench).
+ *
+ * Runs every workload headless: the .hex files in bench/lc3 through
+ * lc3as, once interpreted and once with --jit, and the .sdc files in
+ * bench/sdc through decas.
+ * Each run is repeated and the fastest one is reported as a line of
+ * key=value pairs, so that the output of two commits can be compared
+ * line by line:
+ *
+ *   bench=lc3/loop engine=interp instructions=40006002 seconds=0.192
+ *       mips=208.4 load_ms=0.458 wall_ms=193.8 max_rss_kb=2656 status=0
+ *
+ * instructions, seconds, mips and load_ms are what the simulator reports
+ * (its performance counters and the "Loaded" line), wall_ms is the
+ * whole process as seen from here and max_rss_kb its peak resident
+ * set size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* What one run of a workload measured */
+typedef struct {
+    unsigned long instructions;
+    double seconds;      /* simulated instructions, host time */
+    double mips;
+    double load_ms;      /* loading the image */
+    double wall_ms;      /* the whole process */
+    long max_rss_kb;
+    int status;          /* exit status, -1 if it didn't exit */
+} Result;
+
+/* A simulator and the workloads it runs */
+typedef struct {
+    char *dir;           /* under the bench directory */
+    char *suffix;        /* of its workload files */
+    char *simulator;
+    char *engine;        /* name in the report */
+    char *option;        /* extra option, or NULL */
+} Suite;
+
+Suite suites[] = {
+    { "lc3", ".hex", "./lc3as", "interp", NULL },
+    { "lc3", ".hex", "./lc3as", "jit",    "--jit" },
+    { "sdc", ".sdc", "./decas", "interp", NULL },
+};
+
+# define NSUITES (sizeof(suites) / sizeof(suites[0]))
+
+/* Function Prototypes */
+void usage(char *name);
+int run_suite(Suite *suite, char *bench_dir, int repeat, char *only);
+int run_workload(Suite *suite, char *path, Result *r);
+void parse_line(char *line, Result *r);
+
+char *suffix;            /* scandir filter argument */
+
+int has_suffix(const struct dirent *entry)
+{
+    size_t len = strlen(entry->d_name), n = strlen(suffix);
+
+    return len > n && strcmp(entry->d_name + len - n, suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *bench_dir = "bench", *only = NULL;
+    int repeat = 3, failed = 0, opt;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+        switch (opt) {
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            bench_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+        only = argv[optind++];
+    if (optind < argc || repeat < 1)
+        usage(argv[0]);
+
+    for (i = 0; i < NSUITES; i++)
+        failed += run_suite(&suites[i], bench_dir, repeat, only);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void usage(char *name)
+{
+    printf("usage: %s [-n REPEAT] [-d BENCH_DIR] [WORKLOAD]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+/* Run and report every workload of a suite (only the one named only,
+ * if not NULL). Returns how many of them failed */
+int run_suite(Suite *suite, char *bench_dir, int repeat, char *only)
+{
+    struct dirent **names;
+    char dir[4096], path[4096 + 256];
+    int n, i, j, failed = 0;
+
+    snprintf(dir, sizeof(dir), "%s/%s", bench_dir, suite->dir);
+    suffix = suite->suffix;
+    n = scandir(dir, &names, has_suffix, alphasort);
+    if (n < 0) {
+        printf("error: Could not read %s\n", dir);
+        return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+        char name[256];
+        Result best = { 0 }, r;
+
+        snprintf(name, sizeof(name), "%s/%.*s", suite->dir,
+                 (int) (strlen(names[i]->d_name) - strlen(suite->suffix)),
+                 names[i]->d_name);
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        free(names[i]);
+        if (only != NULL && strcmp(only, name) != 0 &&
+            strcmp(only, strchr(name, '/') + 1) != 0)
+            continue;
+
+        /* Keep the fastest run: the others only add noise */
+        for (j = 0; j < repeat; j++) {
+            if (run_workload(suite, path, &r) != 0 || r.status != 0) {
+                best = r;
+                break;
+            }
+            if (j == 0 || r.mips > best.mips)
+                best = r;
+        }
+
+        printf("bench=%s engine=%s instructions=%lu seconds=%.3f mips=%.1f "
+               "load_ms=%.3f wall_ms=%.1f max_rss_kb=%ld status=%d\n",
+               name, suite->engine, best.instructions, best.seconds,
+               best.mips, best.load_ms, best.wall_ms, best.max_rss_kb,
+               best.status);
+        fflush(stdout);
+        if (best.status != 0)
+            failed++;
+    }
+
+    free(names);
+    return failed;
+}
+
+/* Run the simulator on one workload with its output in a pipe, picking
+ * the numbers out of it. Returns 0, or -1 if it could not be started */
+int run_workload(Suite *suite, char *path, Result *r)
+{
+    struct timespec start, end;
+    struct rusage usage;
+    char line[4096];
+    int fd[2], status;
+    FILE *output;
+    pid_t pid;
+
+    memset(r, 0, sizeof(Result));
+    r->status = -1;
+
+    if (pipe(fd) != 0)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0) {
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDONLY);
+
+        dup2(null, 0);
+        dup2(fd[1], 1);
+        close(fd[0]);
+        close(fd[1]);
+        if (suite->option != NULL)
+            execl(suite->simulator, suite->simulator, "--run",
+                  suite->option, path, (char *) NULL);
+        else
+            execl(suite->simulator, suite->simulator, "--run",
+                  path, (char *) NULL);
+        _exit(127);
+    }
+
+    close(fd[1]);
+    output = fdopen(fd[0], "r");
+    while (fgets(line, sizeof(line), output) != NULL)
+        parse_line(line, r);
+    fclose(output);
+
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    r->wall_ms = (end.tv_sec - start.tv_sec) * 1e3
+               + (end.tv_nsec - start.tv_nsec) / 1e6;
+    r->max_rss_kb = usage.ru_maxrss;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return 0;
+}
+
+/* Pick up the lines of the simulator's output that carry numbers:
+ *   Loaded N words (N bytes) in X ms, Y MB/s
+ *     N instructions in X s, Y MIPS */
+void parse_line(char *line, Result *r)
+{
+    char *loaded = strstr(line, "Loaded ");
+    char *in;
+    unsigned long instructions;
+    double seconds, mips = 0;
+
+    if (loaded != NULL && (in = strstr(loaded, ") in ")) != NULL) {
+        sscanf(in, ") in %lf ms", &r->load_ms);
+    } else if (sscanf(line, " %lu instructions in %lf s, %lf MIPS",
+                      &instructions, &seconds, &mips) >= 2) {
+        r->instructions = instructions;
+        r->seconds = seconds;
+        r->mips = mips;
+    }
+}